@@ -0,0 +1,466 @@
+/*
+ * Accumulated image
+ * -----------------------
+ *   Bins the centroids into a sub-pixel histogram of the phosphor screen, so that
+ *   imaging runs need neither the per-event bandwidth nor a host to integrate.
+ *
+ *   The image covers the square around the disk, oversample bins per pixel along
+ *   each axis, with 16 bit (saturating) or 32 bit bins. Bin (0,0) starts at the
+ *   left/top edge of pixel (x0,y0).
+ *
+ *   Two images are kept: the detector adds to the active one while the other, the
+ *   snapshot of the last exposure, is written to disk by the snapshot thread and/or
+ *   sent through the output sink by the transmitter (PROTO_IMAGE records). When an
+ *   exposure ends the images are swapped without waiting. If the previous snapshot
+ *   is still being written or sent, the running exposure is extended frame by
+ *   frame until it is free; the frames spanned are recorded with every snapshot.
+ *   The last consumer of a snapshot clears it for reuse.
+ */
+
+#ifndef ACCUM_H
+#define ACCUM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <atomic>
+
+#include "config.h"
+#include "detect.h"
+#include "protocol.h"
+#include "output_sink.h"
+
+//Image records sent by the transmitter between two batches of events
+#define ACCUM_TX_RECORDS 16
+//Zero bins that cost as much as the header of a new run
+#define ACCUM_ZERO_GAP ((PROTO_HEADER_BYTES + PROTO_IMAGE_HEADER + PROTO_CRC_BYTES) / 2)
+
+struct accum_snapshot
+{
+    void *bins;
+    uint32_t exposure;                  //exposure number, from 0
+    unsigned long long frame0;          //first frame of the exposure
+    unsigned long long n_frames;        //frames spanned, including dropped frames
+    unsigned long long events;          //centroids binned
+    unsigned long long saturated;       //centroids lost to full 16 bit bins
+    bool started;
+    //consumers still reading plus one, 0 when free for the detector
+    std::atomic<int> users;
+    //progress of the transmitter
+    int send_row, send_col;
+};
+
+struct accum
+{
+    int x0, y0;                         //pixel at the left/top edge of the image
+    long ox, oy;                        //that edge in 1/CEN_ONE pixel
+    int oversample;
+    int bits;                           //16 or 32
+    int width, height;                  //in bins
+    size_t bytes;
+    unsigned long long exposure_frames;
+    char path[256];                     //snapshot file prefix, empty for none
+    int format;                         //ACCUM_FITS or ACCUM_RAW
+    bool send;                          //send snapshots through the output sink
+
+    struct accum_snapshot snap[2];
+    int active;                         //image the detector adds to
+    uint32_t exposures;
+
+    //snapshot handed to the snapshot thread and to the transmitter, -1 for none
+    std::atomic<int> to_write;
+    std::atomic<int> to_send;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool quit;
+
+    //statistics
+    unsigned long long late_frames;     //frames added to an exposure past its length
+    std::atomic<unsigned long> written, sent, write_errors;
+};
+
+/*
+ * FITS image of width x height bins, 16 or 32 bit unsigned (BZERO offset).
+ * Returns 0 on success.
+ */
+static inline int accum_write_fits(FILE *fp, const void *bins, int bits, int width, int height,
+                                   int x0, int y0, int oversample, uint32_t exposure,
+                                   unsigned long long frame0, unsigned long long n_frames)
+{
+    char header[2880];
+    int n = 0;
+    memset(header, ' ', sizeof(header));
+    char card[81];
+#define FITS_CARD(...) do { snprintf(card, sizeof(card), __VA_ARGS__); memcpy(header + 80 * n++, card, strlen(card)); } while (0)
+    FITS_CARD("%-8s= %20s", "SIMPLE", "T");
+    FITS_CARD("%-8s= %20d", "BITPIX", bits);
+    FITS_CARD("%-8s= %20d", "NAXIS", 2);
+    FITS_CARD("%-8s= %20d", "NAXIS1", width);
+    FITS_CARD("%-8s= %20d", "NAXIS2", height);
+    FITS_CARD("%-8s= %20s / unsigned bins", "BZERO", bits == 16 ? "32768" : "2147483648");
+    FITS_CARD("%-8s= %20d", "BSCALE", 1);
+    FITS_CARD("%-8s= %20u / exposure number", "EXPNUM", exposure);
+    FITS_CARD("%-8s= %20llu / first frame of the exposure", "FRAME0", frame0);
+    FITS_CARD("%-8s= %20llu / frames spanned", "NFRAMES", n_frames);
+    FITS_CARD("%-8s= %20d / bins per pixel", "OVERSAMP", oversample);
+    FITS_CARD("%-8s= %20d / pixel at the left edge", "XORIGIN", x0);
+    FITS_CARD("%-8s= %20d / pixel at the top edge", "YORIGIN", y0);
+    FITS_CARD("END");
+#undef FITS_CARD
+    if (fwrite(header, 1, 2880, fp) != 2880) return -1;
+
+    //big endian, offset by BZERO, one row at a time
+    int bpb = bits / 8;
+    uint8_t *row = (uint8_t *)malloc((size_t)width * bpb);
+    size_t total = 0;
+    for (int r = 0; r < height; r++)
+    {
+        for (int c = 0; c < width; c++)
+        {
+            if (bits == 16)
+            {
+                uint16_t v = ((const uint16_t *)bins)[(size_t)r * width + c] ^ 0x8000;
+                row[2 * c] = (uint8_t)(v >> 8);
+                row[2 * c + 1] = (uint8_t)v;
+            }
+            else
+            {
+                uint32_t v = ((const uint32_t *)bins)[(size_t)r * width + c] ^ 0x80000000u;
+                for (int b = 0; b < 4; b++) row[4 * c + b] = (uint8_t)(v >> (24 - 8 * b));
+            }
+        }
+        if (fwrite(row, 1, (size_t)width * bpb, fp) != (size_t)width * bpb) break;
+        total += (size_t)width * bpb;
+    }
+    free(row);
+    if (total != (size_t)width * height * bpb) return -1;
+    //pad the data to a whole block
+    static const uint8_t zero[2880] = {0};
+    size_t pad = (2880 - total % 2880) % 2880;
+    return fwrite(zero, 1, pad, fp) == pad ? 0 : -1;
+}
+
+//Give up a snapshot, the last consumer clears it for the next exposure
+static inline void accum_release(struct accum *a, struct accum_snapshot *s)
+{
+    if (s->users.fetch_sub(1) == 2)
+    {
+        memset(s->bins, 0, a->bytes);
+        s->events = s->saturated = 0;
+        s->started = false;
+        s->users.store(0);
+    }
+}
+
+static inline int accum_write_snapshot(struct accum *a, const struct accum_snapshot *s)
+{
+    char path[300], tmp[310];
+    if (a->format == ACCUM_FITS) snprintf(path, sizeof(path), "%s_%06u.fits", a->path, s->exposure);
+    else snprintf(path, sizeof(path), "%s_%06u_%dx%d_u%d.raw", a->path, s->exposure, a->width, a->height, a->bits);
+    //readers never see a partial file
+    snprintf(tmp, sizeof(tmp), "%s.part", path);
+    FILE *fp = fopen(tmp, "wb");
+    if (fp == NULL)
+    {
+        perror(tmp);
+        return -1;
+    }
+    int ret;
+    if (a->format == ACCUM_FITS)
+        ret = accum_write_fits(fp, s->bins, a->bits, a->width, a->height, a->x0, a->y0, a->oversample,
+                               s->exposure, s->frame0, s->n_frames);
+    else
+        ret = fwrite(s->bins, 1, a->bytes, fp) == a->bytes ? 0 : -1;
+    if (fclose(fp) != 0) ret = -1;
+    if (ret == 0 && rename(tmp, path) != 0) ret = -1;
+    if (ret != 0) perror(path);
+    return ret;
+}
+
+//Thread: writes the snapshots handed over by the detector
+static void* accum_writer(void* pUser)
+{
+    struct accum *a = (struct accum *)pUser;
+    pthread_mutex_lock(&a->lock);
+    while (1)
+    {
+        while (!a->quit && a->to_write.load() < 0) pthread_cond_wait(&a->cond, &a->lock);
+        int idx = a->to_write.load();
+        if (idx < 0) break;
+        pthread_mutex_unlock(&a->lock);
+        struct accum_snapshot *s = &a->snap[idx];
+        if (accum_write_snapshot(a, s) == 0) a->written++;
+        else a->write_errors++;
+        a->to_write.store(-1);
+        accum_release(a, s);
+        pthread_mutex_lock(&a->lock);
+    }
+    pthread_mutex_unlock(&a->lock);
+    return 0;
+}
+
+/*
+ * Set up the image of the disk (cenx, ceny, radius) and start the snapshot thread.
+ * Returns 0 on success.
+ */
+static inline int accum_init(struct accum *a, int cenx, int ceny, int radius, int oversample, int bits,
+                             int exposure_frames, const char *path, int format, bool send)
+{
+    if (bits != 16 && bits != 32)
+    {
+        fprintf(stderr, "accum: bins must be 16 or 32 bit\n");
+        return -1;
+    }
+    if (path[0] == 0 && !send)
+    {
+        fprintf(stderr, "accum: set accum_path or accum_send\n");
+        return -1;
+    }
+    a->x0 = cenx - radius > 0 ? cenx - radius : 0;
+    a->y0 = ceny - radius > 0 ? ceny - radius : 0;
+    a->ox = (long)a->x0 * CEN_ONE - CEN_ONE / 2;
+    a->oy = (long)a->y0 * CEN_ONE - CEN_ONE / 2;
+    a->oversample = oversample;
+    a->bits = bits;
+    a->width = (cenx + radius - a->x0 + 1) * oversample;
+    a->height = (ceny + radius - a->y0 + 1) * oversample;
+    if (a->width > 65535 || a->height > 65535)
+    {
+        fprintf(stderr, "accum: image of %dx%d bins is too large\n", a->width, a->height);
+        return -1;
+    }
+    a->bytes = (size_t)a->width * a->height * (bits / 8);
+    a->exposure_frames = exposure_frames;
+    snprintf(a->path, sizeof(a->path), "%s", path);
+    a->format = format;
+    a->send = send;
+    for (int k = 0; k < 2; k++)
+    {
+        struct accum_snapshot *s = &a->snap[k];
+        s->bins = calloc(a->bytes, 1);
+        if (s->bins == NULL)
+        {
+            fprintf(stderr, "accum: cannot allocate %zu bytes\n", a->bytes);
+            return -1;
+        }
+        s->events = s->saturated = 0;
+        s->started = false;
+        s->users.store(0);
+    }
+    a->active = 0;
+    a->exposures = 0;
+    a->snap[0].exposure = 0;
+    a->to_write.store(-1);
+    a->to_send.store(-1);
+    a->quit = false;
+    a->late_frames = 0;
+    a->written = a->sent = a->write_errors = 0;
+    pthread_mutex_init(&a->lock, NULL);
+    pthread_cond_init(&a->cond, NULL);
+    if (pthread_create(&a->thread, NULL, accum_writer, a) != 0)
+    {
+        fprintf(stderr, "accum: cannot start the snapshot thread\n");
+        return -1;
+    }
+    return 0;
+}
+
+//Bin n events into the active image, detector only
+static inline void accum_add(struct accum *a, const struct event *ev, int n)
+{
+    struct accum_snapshot *s = &a->snap[a->active];
+    for (int e = 0; e < n; e++)
+    {
+        //negative offsets wrap to large unsigned values and fall outside
+        unsigned long bx = (unsigned long)(((ev[e].x - a->ox) * a->oversample) >> CEN_FRAC_BITS);
+        unsigned long by = (unsigned long)(((ev[e].y - a->oy) * a->oversample) >> CEN_FRAC_BITS);
+        if (bx >= (unsigned long)a->width || by >= (unsigned long)a->height) continue;
+        size_t k = by * a->width + bx;
+        if (a->bits == 16)
+        {
+            uint16_t *bin = (uint16_t *)s->bins + k;
+            if (*bin == UINT16_MAX)
+            {
+                s->saturated++;
+                continue;
+            }
+            (*bin)++;
+        }
+        else ((uint32_t *)s->bins)[k]++;
+        s->events++;
+    }
+}
+
+/*
+ * Hand the active image over as a snapshot and continue on the other one.
+ * With wait false the swap is skipped when the other image is still in use.
+ * Returns true when the images were swapped.
+ */
+static inline bool accum_swap(struct accum *a, bool wait)
+{
+    struct accum_snapshot *s = &a->snap[a->active];
+    struct accum_snapshot *next = &a->snap[1 - a->active];
+    while (next->users.load() != 0)
+    {
+        if (!wait) return false;
+        usleep(1000);
+    }
+    next->exposure = ++a->exposures;
+    s->users.store(1 + (a->path[0] != 0) + (a->send ? 1 : 0));
+    int idx = a->active;
+    a->active = 1 - a->active;
+    if (a->send)
+    {
+        s->send_row = s->send_col = 0;
+        a->to_send.store(idx);
+    }
+    if (a->path[0] != 0)
+    {
+        pthread_mutex_lock(&a->lock);
+        a->to_write.store(idx);
+        pthread_cond_signal(&a->cond);
+        pthread_mutex_unlock(&a->lock);
+    }
+    return true;
+}
+
+/*
+ * Account frame seq to the active exposure, detector only.
+ * Returns true when an exposure ended and a snapshot was handed over.
+ */
+static inline bool accum_frame(struct accum *a, unsigned long long seq)
+{
+    struct accum_snapshot *s = &a->snap[a->active];
+    if (!s->started)
+    {
+        s->frame0 = seq;
+        s->started = true;
+    }
+    s->n_frames = seq + 1 - s->frame0;
+    if (s->n_frames < a->exposure_frames) return false;
+    if (accum_swap(a, false)) return true;
+    a->late_frames++;
+    return false;
+}
+
+static inline uint32_t accum_bin(const struct accum *a, const struct accum_snapshot *s, size_t k)
+{
+    return a->bits == 16 ? ((const uint16_t *)s->bins)[k] : ((const uint32_t *)s->bins)[k];
+}
+
+//Smallest sink batch that holds an image record of one bin
+static inline size_t accum_min_batch(int bits)
+{
+    return PROTO_HEADER_BYTES + PROTO_IMAGE_HEADER + bits / 8 + PROTO_CRC_BYTES;
+}
+
+/*
+ * Send up to max_records runs of the pending snapshot through the sink, transmitter only.
+ * Zeros are only sent inside runs, between bins closer than ACCUM_ZERO_GAP. Returns true while part of a snapshot remains to be sent.
+ */
+static inline bool accum_send(struct accum *a, struct output_sink *sink, int max_records)
+{
+    int idx = a->to_send.load();
+    if (idx < 0) return false;
+    struct accum_snapshot *s = &a->snap[idx];
+    int bpb = a->bits / 8;
+    size_t head = PROTO_HEADER_BYTES + PROTO_IMAGE_HEADER + PROTO_CRC_BYTES;
+    size_t room = sink->flush_bytes > head ? sink->flush_bytes - head : 0;
+    if (room > PROTO_MAX_PAYLOAD - PROTO_IMAGE_HEADER) room = PROTO_MAX_PAYLOAD - PROTO_IMAGE_HEADER;
+    int per = (int)(room / bpb);
+    //main refuses batches below accum_min_batch
+    if (per < 1) return false;
+    struct proto_image_run run;
+    run.width = a->width;
+    run.height = a->height;
+    run.x0 = a->x0;
+    run.y0 = a->y0;
+    run.oversample = a->oversample;
+    run.frame0 = (uint32_t)s->frame0;
+    run.n_frames = (uint32_t)s->n_frames;
+    for (int r = 0; r < max_records && s->send_row < a->height; )
+    {
+        size_t base = (size_t)s->send_row * a->width;
+        int c = s->send_col;
+        while (c < a->width && accum_bin(a, s, base + c) == 0) c++;
+        if (c == a->width)
+        {
+            s->send_row++;
+            s->send_col = 0;
+            continue;
+        }
+        //end the run at a gap of zeros that costs more than a new record
+        int limit = c + per < a->width ? c + per : a->width, end = c + 1;
+        uint32_t max = 0;
+        for (int k = c; k < limit && k - end < ACCUM_ZERO_GAP; k++)
+        {
+            uint32_t v = accum_bin(a, s, base + k);
+            if (v == 0) continue;
+            if (v > max) max = v;
+            end = k + 1;
+        }
+        int flags = max > UINT16_MAX ? PROTO_F_WIDE : 0;
+        run.row = s->send_row;
+        run.col = c;
+        run.n = end - c;
+        size_t payload = PROTO_IMAGE_HEADER + (size_t)run.n * ((flags & PROTO_F_WIDE) ? 4 : 2);
+        uint8_t *rec = output_sink_reserve(sink, PROTO_HEADER_BYTES + payload + PROTO_CRC_BYTES);
+        uint8_t *p = rec + PROTO_HEADER_BYTES;
+        proto_put_image_run(p, &run);
+        p += PROTO_IMAGE_HEADER;
+        for (int k = c; k < end; k++)
+        {
+            if (flags & PROTO_F_WIDE)
+            {
+                proto_put32(p, accum_bin(a, s, base + k));
+                p += 4;
+            }
+            else
+            {
+                proto_put16(p, accum_bin(a, s, base + k));
+                p += 2;
+            }
+        }
+        output_sink_commit(sink, proto_seal(rec, PROTO_IMAGE, flags, s->exposure, payload));
+        s->send_col = end;
+        r++;
+    }
+    if (s->send_row < a->height) return true;
+    a->to_send.store(-1);
+    a->sent++;
+    accum_release(a, s);
+    return false;
+}
+
+//True while a snapshot waits for the transmitter
+static inline bool accum_send_pending(const struct accum *a)
+{
+    return a->to_send.load() >= 0;
+}
+
+/*
+ * Hand over the running exposure at the end of the input, waiting for the
+ * previous snapshot if necessary.
+ */
+static inline void accum_finish(struct accum *a)
+{
+    if (a->snap[a->active].started) accum_swap(a, true);
+}
+
+//Stop the snapshot thread once it has written the pending snapshot
+static inline void accum_free(struct accum *a)
+{
+    pthread_mutex_lock(&a->lock);
+    a->quit = true;
+    pthread_cond_signal(&a->cond);
+    pthread_mutex_unlock(&a->lock);
+    pthread_join(a->thread, NULL);
+    for (int k = 0; k < 2; k++) free(a->snap[k].bins);
+    pthread_mutex_destroy(&a->lock);
+    pthread_cond_destroy(&a->cond);
+}
+
+#endif
@@ -0,0 +1,388 @@
+/*
+ * Background model
+ * -----------------------
+ *   Per pixel background level and per tile noise of the phosphor screen, kept up
+ *   to date while the detector runs so that phosphor glow, bias drifts and uneven
+ *   illumination do not move the false event rate.
+ *
+ *   After the detection of every frame each band updates its own rows of one tile
+ *   stripe (BG_TILE rows) in bg_every, so every pixel is updated every bg_every frames
+ *   at an even cost per frame:
+ *       level      exponential moving average of the pixel, 1/256 DN, weight 2^-bg_shift
+ *                  (1/n for the first 2^bg_shift updates so the model settles quickly)
+ *                  samples are clipped at level + margin so photons barely move it
+ *       noise      variance of the pixel around its level over a BG_TILE x BG_TILE
+ *                  tile, samples above the margin left out, same moving average
+ *       threshold  condition 2 threshold of every pixel (detect.h):
+ *                  level + margin, margin = max(threshold, bg_nsigma * noise of the tile)
+ *                  255 (never a candidate) for hot pixels
+ *   The centroids subtract the level of every pixel of their window (detect.h).
+ *
+ *   Hot pixels are read from a file of "x y" lines (# starts a comment) and, with
+ *   bg_hot > 0, found as pixels whose level is more than bg_hot DN above the mean of
+ *   their tile.
+ *
+ *   Tiles are BAND_ROW_ALIGN rows high so each tile is updated by a single band. The
+ *   update also covers the halo of the ROI read by the centroid windows: the rows
+ *   within the margin (window/2) above and below the disk, and on every row the
+ *   union of the spans of the rows within the margin, widened by it. The first
+ *   update of a stripe primes it with the frame itself and a noise estimated from the
+ *   difference of neighbouring pixels, detection uses threshold 255 until then, so
+ *   the first bg_every frames are partly blind.
+ */
+
+#ifndef BACKGROUND_H
+#define BACKGROUND_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <atomic>
+
+#include "frame_source.h"
+#include "roi.h"
+#include "detect.h"
+#include "worker_pool.h"
+
+//Tile size of the noise estimate, in pixels
+#define BG_TILE BAND_ROW_ALIGN
+#define BG_MAX_TILES_X (DETECT_MAX_WIDTH / BG_TILE)
+//Smallest neighbour difference left out of the first noise estimate, in DN
+#define BG_PRIME_CLIP 16
+
+struct background
+{
+    int width, height;
+    int tiles_x, tiles_y;
+    uint16_t *level;                //width*height, 1/256 DN
+    uint8_t *threshold;             //width*height
+    uint8_t *hot;                   //width*height, 1 for the pixels of the hot pixel file
+    uint32_t *tile_var;             //noise variance of every tile, 1/256 DN^2
+    uint32_t *tile_level;           //mean level of every tile, 1/256 DN
+    struct detect_background maps;  //what the detector reads
+
+    int every, shift, nsigma, min_threshold, hot_level, margin;
+    unsigned long long frames;      //frames seen
+    unsigned long long updates;     //updates of every pixel, the current one while it runs
+    int phase;                      //stripes with index % every == phase are being updated
+    unsigned long hot_file;         //pixels masked by the file
+    std::atomic<unsigned long> hot_auto;        //pixels above bg_hot in the current update
+};
+
+/*
+ * Allocate the model of a width x height image. margin is the half window of the
+ * centroids. Returns 0 on success.
+ */
+static inline int background_init(struct background *bg, int width, int height, int every, int shift,
+                                  int nsigma, int min_threshold, int hot_level, int margin)
+{
+    size_t npix = (size_t)width * height;
+    bg->width = width;
+    bg->height = height;
+    bg->tiles_x = (width + BG_TILE - 1) / BG_TILE;
+    bg->tiles_y = (height + BG_TILE - 1) / BG_TILE;
+    bg->level = (uint16_t *)calloc(npix, sizeof(uint16_t));
+    bg->threshold = (uint8_t *)malloc(npix);
+    bg->hot = (uint8_t *)calloc(npix, 1);
+    bg->tile_var = (uint32_t *)calloc((size_t)bg->tiles_x * bg->tiles_y, sizeof(uint32_t));
+    bg->tile_level = (uint32_t *)calloc((size_t)bg->tiles_x * bg->tiles_y, sizeof(uint32_t));
+    if (bg->level == NULL || bg->threshold == NULL || bg->hot == NULL || bg->tile_var == NULL || bg->tile_level == NULL)
+    {
+        fprintf(stderr, "Background: cannot allocate the %dx%d maps\n", width, height);
+        return -1;
+    }
+    memset(bg->threshold, 255, npix);
+    bg->maps.threshold = bg->threshold;
+    bg->maps.level = bg->level;
+    bg->maps.stride = width;
+    bg->every = every;
+    bg->shift = shift;
+    bg->nsigma = nsigma;
+    bg->min_threshold = min_threshold;
+    bg->hot_level = hot_level;
+    bg->margin = margin;
+    bg->frames = 0;
+    bg->updates = 0;
+    bg->phase = 0;
+    bg->hot_file = 0;
+    bg->hot_auto.store(0);
+    return 0;
+}
+
+//Read the hot pixel file, returns 0 on success
+static inline int background_load_hot(struct background *bg, const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+    char line[256];
+    int lineno = 0, ret = 0;
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        lineno++;
+        char *hash = strchr(line, '#');
+        if (hash != NULL) *hash = 0;
+        int x, y;
+        char extra;
+        int k = sscanf(line, "%d %d %c", &x, &y, &extra);
+        if (k <= 0) continue;
+        if (k != 2 || x < 0 || x >= bg->width || y < 0 || y >= bg->height)
+        {
+            fprintf(stderr, "%s:%d: expected \"x y\" inside the image\n", path, lineno);
+            ret = -1;
+            continue;
+        }
+        uint8_t *h = &bg->hot[(size_t)y * bg->width + x];
+        bg->hot_file += *h == 0;
+        *h = 1;
+    }
+    fclose(fp);
+    return ret;
+}
+
+static inline void background_free(struct background *bg)
+{
+    free(bg->level);
+    free(bg->threshold);
+    free(bg->hot);
+    free(bg->tile_var);
+    free(bg->tile_level);
+}
+
+/*
+ * Pixels of row covered by the update: the union of the spans of the ROI rows within
+ * the margin of it, widened by the margin, so every pixel a centroid window reads.
+ */
+static inline void background_span(const struct background *bg, const struct disk_roi *roi, int row, int *s, int *e)
+{
+    int r0 = row - bg->margin < roi->row_begin ? roi->row_begin : row - bg->margin;
+    int r1 = row + bg->margin >= roi->row_end ? roi->row_end - 1 : row + bg->margin;
+    *s = bg->width;
+    *e = 0;
+    for (int r = r0; r <= r1; r++)
+    {
+        int rs = roi->start[r - roi->row_begin], re = roi->end[r - roi->row_begin];
+        if (rs >= re) continue;
+        if (rs < *s) *s = rs;
+        if (re > *e) *e = re;
+    }
+    if (*s >= *e)
+    {
+        *s = *e = 0;
+        return;
+    }
+    *s -= bg->margin;
+    *e += bg->margin;
+    if (*s < 0) *s = 0;
+    if (*e > bg->width) *e = bg->width;
+}
+
+//Margin of condition 2 above the level of a tile, in DN
+static inline int background_margin(const struct background *bg, uint32_t var)
+{
+    int t = (int)ceil(bg->nsigma * sqrt(var / 256.0));
+    if (t < bg->min_threshold) t = bg->min_threshold;
+    return t < 1 ? 1 : (t < 255 ? t : 255);
+}
+
+/*
+ * Update the levels of len pixels of a row, branch free so that compilers can
+ * vectorise it. Adds the squared residuals
+ * below the margin c (1/256 DN^2), their count and the new levels to q, n_in and l.
+ */
+static inline void background_segment(const uint8_t *p, uint16_t *lv, int len, int c, int32_t weight,
+                                      int32_t *q, int32_t *n_in, uint32_t *l)
+{
+    int32_t sq = 0, n = 0;
+    uint32_t sum = 0;
+    for (int j = 0; j < len; j++)
+    {
+        int r = (p[j] << 8) - lv[j];
+        int in = r < c;
+        sq += in * ((r >> 4) * (r >> 4));
+        n += in;
+        r = r < c ? r : c;
+        int v = lv[j] + ((r * weight) >> 16);
+        lv[j] = (uint16_t)v;
+        sum += v;
+    }
+    *q += sq;
+    *n_in += n;
+    *l += sum;
+}
+
+/*
+ * Update the stripes of the current phase within the rows [row_begin,row_end) from
+ * frame f. Only the caller's rows of the maps are written.
+ */
+static inline void background_update_rows(struct background *bg, const struct frame *f, const struct disk_roi *roi,
+                                          int row_begin, int row_end)
+{
+    //weight of the new sample, 1/(updates+1) until it reaches 2^-shift
+    unsigned long long n = bg->updates + 1;
+    int32_t weight = n < (1ULL << bg->shift) ? (int32_t)(65536 / n) : (65536 >> bg->shift);
+    unsigned long hot = 0;
+    for (int row = row_begin; row < row_end; )
+    {
+        int stripe_end = (row / BG_TILE + 1) * BG_TILE;
+        if (stripe_end > row_end) stripe_end = row_end;
+        if ((row / BG_TILE) % bg->every != bg->phase)
+        {
+            row = stripe_end;
+            continue;
+        }
+        uint32_t *tvar = bg->tile_var + (size_t)(row / BG_TILE) * bg->tiles_x;
+        uint32_t *tlev = bg->tile_level + (size_t)(row / BG_TILE) * bg->tiles_x;
+        int clip[BG_MAX_TILES_X];
+        int64_t sq[BG_MAX_TILES_X], lsum[BG_MAX_TILES_X];
+        int cnt[BG_MAX_TILES_X], lcnt[BG_MAX_TILES_X];
+        for (int t = 0; t < bg->tiles_x; t++)
+        {
+            clip[t] = background_margin(bg, tvar[t]);
+            if (bg->updates == 0 && clip[t] < BG_PRIME_CLIP) clip[t] = BG_PRIME_CLIP;
+            clip[t] <<= 8;
+            sq[t] = lsum[t] = 0;
+            cnt[t] = lcnt[t] = 0;
+        }
+
+        //pass 1: levels and tile statistics, one tile segment of a row at a time
+        for (int i = row; i < stripe_end; i++)
+        {
+            const uint8_t *p = f->data + (size_t)i * f->stride;
+            uint16_t *lv = bg->level + (size_t)i * bg->width;
+            int s, e;
+            background_span(bg, roi, i, &s, &e);
+            for (int j0 = s; j0 < e; )
+            {
+                int t = j0 / BG_TILE, c = clip[t];
+                int j1 = (t + 1) * BG_TILE < e ? (t + 1) * BG_TILE : e;
+                //squares of the residuals in 1/16 DN, so 1/256 DN^2 like tile_var
+                int32_t q = 0, n_in = 0;
+                uint32_t l = 0;
+                if (bg->updates == 0)
+                {
+                    //first noise estimate from the difference of neighbours, twice the variance
+                    for (int j = j0; j < j1; j++)
+                    {
+                        int r = j > s ? (p[j] - p[j - 1]) << 8 : c;
+                        if (r < c && -r < c)
+                        {
+                            q += (r >> 4) * (r >> 4) / 2;
+                            n_in++;
+                        }
+                        lv[j] = (uint16_t)(p[j] << 8);
+                        l += lv[j];
+                    }
+                }
+                else
+                {
+                    background_segment(p + j0, lv + j0, j1 - j0, c, weight, &q, &n_in, &l);
+                }
+                sq[t] += q;
+                cnt[t] += n_in;
+                lsum[t] += l;
+                lcnt[t] += j1 - j0;
+                j0 = j1;
+            }
+        }
+        for (int t = 0; t < bg->tiles_x; t++)
+        {
+            if (lcnt[t] > 0) tlev[t] = (uint32_t)(lsum[t] / lcnt[t]);
+            if (cnt[t] > 0)
+            {
+                int64_t var = sq[t] / cnt[t];
+                tvar[t] = (uint32_t)(tvar[t] + ((var - (int64_t)tvar[t]) * weight >> 16));
+            }
+            clip[t] = background_margin(bg, tvar[t]);
+        }
+
+        //pass 2: thresholds
+        for (int i = row; i < stripe_end; i++)
+        {
+            const uint16_t *lv = bg->level + (size_t)i * bg->width;
+            const uint8_t *h = bg->hot + (size_t)i * bg->width;
+            uint8_t *th = bg->threshold + (size_t)i * bg->width;
+            int s, e;
+            background_span(bg, roi, i, &s, &e);
+            for (int j0 = s; j0 < e; )
+            {
+                int t = j0 / BG_TILE, c = clip[t];
+                int j1 = (t + 1) * BG_TILE < e ? (t + 1) * BG_TILE : e;
+                int hot_limit = bg->hot_level > 0 ? (int)tlev[t] + (bg->hot_level << 8) : INT32_MAX;
+                for (int j = j0; j < j1; j++)
+                {
+                    int v = ((lv[j] + 128) >> 8) + c;
+                    if (lv[j] > hot_limit)
+                    {
+                        v = 255;
+                        hot++;
+                    }
+                    th[j] = (uint8_t)(h[j] || v > 255 ? 255 : v);
+                }
+                j0 = j1;
+            }
+        }
+        row = stripe_end;
+    }
+    if (hot > 0) bg->hot_auto.fetch_add(hot, std::memory_order_relaxed);
+}
+
+//Parameters of an update, shared by all band tasks
+struct background_job
+{
+    struct background *bg;
+    const struct frame *frame;
+    const struct disk_roi *roi;
+    const struct detect_band *bands;
+    int n_bands;
+};
+
+//Worker pool task: update the rows of one band, the first and last bands also the halo of the ROI
+static inline void background_band_task(void *ctx, int b)
+{
+    struct background_job *job = (struct background_job *)ctx;
+    int r0 = job->bands[b].row_begin, r1 = job->bands[b].row_end;
+    if (b == 0) r0 -= job->bg->margin;
+    if (b == job->n_bands - 1) r1 += job->bg->margin;
+    background_update_rows(job->bg, job->frame, job->roi, r0, r1);
+}
+
+//Select the stripes updated with the current frame
+static inline void background_next(struct background *bg)
+{
+    bg->updates = bg->frames / bg->every;
+    bg->phase = (int)(bg->frames % bg->every);
+    bg->frames++;
+    if (bg->phase == 0) bg->hot_auto.store(0, std::memory_order_relaxed);
+}
+
+//Update the stripes of the current frame on the worker pool, after the frame has been detected
+static inline void background_frame(struct background_job *job, struct worker_pool *pool)
+{
+    background_next(job->bg);
+    worker_pool_run(pool, background_band_task, job, job->n_bands);
+}
+
+//Mean noise of the tiles inside the ROI, in DN
+static inline double background_noise(const struct background *bg, const struct disk_roi *roi)
+{
+    double sum = 0;
+    long n = 0;
+    for (int ty = roi->row_begin / BG_TILE; ty <= (roi->row_end - 1) / BG_TILE; ty++)
+    {
+        int r = ty * BG_TILE < roi->row_begin ? roi->row_begin : ty * BG_TILE;
+        for (int tx = roi->start[r - roi->row_begin] / BG_TILE; tx * BG_TILE < roi->end[r - roi->row_begin]; tx++)
+        {
+            sum += sqrt(bg->tile_var[(size_t)ty * bg->tiles_x + tx] / 256.0);
+            n++;
+        }
+    }
+    return n > 0 ? sum / n : 0;
+}
+
+#endif
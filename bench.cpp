@@ -0,0 +1,655 @@
+
+/*
+ * Title: Offline benchmark of the photon counting pipeline
+ * Description: Runs the detection code of main.o on synthetic frames (synth.h) or on
+ * recorded raspividyuv .yuv files, without the camera, the GPIO or the serial port.
+ * Reports the time of every stage, the frame rate with one thread and with the worker
+ * pool, and the centroid bias and RMS against the true photon positions.
+ *
+ * This code is released under the MIT License, see LICENSE.
+ */
+
+/*
+ * Usage: bench [options]
+ *   -c file     configuration file of main.o (geometry, thresholds, threads)
+ *   -s k=v      set a configuration key
+ *   -m modes    window modes to run, e.g. 35 or 357 (default 357)
+ *   -n frames   number of frames (default 200)
+ *   -i file     replay a recorded .yuv luma stream or a sparse recording (record.h) instead of synthetic frames
+ *   -f flux     mean photons per frame (default 100)
+ *   -g gain     mean photon energy in DN (default 800)
+ *   -S sigma    Gaussian PSF sigma in pixels (default 0.8)
+ *   -P file     measured PSF (see synth.h)
+ *   -r noise    read noise in DN (default 1.5)
+ *   -G glow     phosphor glow, fraction of the signal kept from frame to frame (default 0)
+ *   -B bias     pedestal in DN (default 2)
+ *   -x seed     random seed (default 1)
+ *   -C file     write the centroid bias measured against the true positions as a calibration table (calib.h)
+ *
+ * Build with "make bench". The candidate kernel is chosen from the compiler target flags,
+ * the scalar reference kernel is always run as well and the candidate lists are compared.
+ * With -s background=1 the background model of main.o is run and its update is timed.
+ * With -s coincidence=drop or merge the coincidence filter is run on the events before the
+ * output and the accuracy, use -G to make the photons of one frame show again in the next.
+ * With -s record=file the frames of the first mode are recorded as main.o does, the encoder
+ * is timed and every frame is rebuilt from its record and detected again to check the replay.
+ * With -s calib=file the centroids are corrected with the calibration table and the correction
+ * is timed; -C on synthetic frames without it writes the bias LUT of every mode that was run.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
+#include "config.h"
+#include "frame_source.h"
+#include "roi.h"
+#include "detect.h"
+#include "worker_pool.h"
+#include "protocol.h"
+#include "synth.h"
+#include "background.h"
+#include "coincidence.h"
+#include "record.h"
+#include "calib.h"
+
+//Stages of the pipeline timed per frame
+enum
+{
+    ST_INGEST,
+    ST_MASK,
+    ST_DETECT,
+    ST_CENTROID,
+    ST_CALIB,
+    ST_OUTPUT,
+    ST_BACKGROUND,
+    ST_COINC,
+    ST_RECORD,
+    ST_COUNT
+};
+
+static const char *stage_name[ST_COUNT] = {"ingest", "mask", "detect", "centroid", "calibration", "output", "background", "coincidence", "record"};
+
+//Events within this distance of a true photon are matched to it, in pixels
+#define MATCH_RADIUS 1.5
+//Bins of the bias LUT written with -C
+#define BIAS_BINS 32
+
+//Frames kept in memory so that generation and disk reads are not timed
+struct frame_set
+{
+    int n;
+    size_t frame_bytes;
+    uint8_t *data;
+    std::vector< std::vector<struct synth_photon> > truth;      //empty for recorded frames
+};
+
+static int load_yuv(struct frame_set *set, const char *path, int max_frames)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        perror(path);
+        return -1;
+    }
+    set->data = (uint8_t *)malloc(set->frame_bytes * max_frames);
+    set->n = 0;
+    while (set->n < max_frames &&
+           frame_read_full(fd, set->data + set->frame_bytes * set->n, set->frame_bytes) == set->frame_bytes)
+        set->n++;
+    close(fd);
+    return set->n > 0 ? 0 : -1;
+}
+
+static int load_recording(struct frame_set *set, const char *path, int max_frames, int stride, int rows)
+{
+    struct record_reader rd;
+    if (record_reader_open(&rd, path) != 0) return -1;
+    set->data = (uint8_t *)malloc(set->frame_bytes * max_frames);
+    set->n = 0;
+    unsigned long long seq;
+    long long t;
+    while (set->n < max_frames && record_reader_next(&rd, set->data + set->frame_bytes * set->n, stride, rows, &seq, &t) == 1)
+        set->n++;
+    record_reader_close(&rd);
+    return set->n > 0 ? 0 : -1;
+}
+
+static int make_synthetic(struct frame_set *set, struct synth_params *sp, const char *psf_path, int n_frames)
+{
+    struct synth s;
+    if (synth_init(&s, sp) != 0) return -1;
+    if (psf_path != NULL && synth_load_psf(&s, psf_path) != 0) return -1;
+    set->data = (uint8_t *)malloc(set->frame_bytes * n_frames);
+    set->n = n_frames;
+    set->truth.resize(n_frames);
+    std::vector<struct synth_photon> ph(1000000);
+    for (int k = 0; k < n_frames; k++)
+    {
+        int n = synth_frame(&s, set->data + set->frame_bytes * k, ph.data(), (int)ph.size());
+        set->truth[k].assign(ph.begin(), ph.begin() + n);
+    }
+    synth_free(&s);
+    return 0;
+}
+
+static bool by_y(const struct event &a, const struct event &b)
+{
+    return a.y < b.y;
+}
+
+//Centroid accuracy accumulated over the frames
+struct accuracy
+{
+    long truth, matched, events, unmatched_events;
+    double sx, sy, sxx, syy;
+    //true minus measured position by the nearest LUT entry of the measured fractional position
+    double bias_x[BIAS_BINS], bias_y[BIAS_BINS];
+    long bias_nx[BIAS_BINS], bias_ny[BIAS_BINS];
+};
+
+//Match the events of one frame to the true photons, nearest event within MATCH_RADIUS
+static void match_truth(struct accuracy *acc, std::vector<struct event> &ev, const std::vector<struct synth_photon> &truth)
+{
+    std::sort(ev.begin(), ev.end(), by_y);
+    std::vector<char> used(ev.size(), 0);
+    acc->truth += truth.size();
+    acc->events += ev.size();
+    for (size_t t = 0; t < truth.size(); t++)
+    {
+        struct event key;
+        key.y = (int32_t)((truth[t].y - MATCH_RADIUS) * CEN_ONE);
+        size_t e = std::lower_bound(ev.begin(), ev.end(), key, by_y) - ev.begin();
+        double best = MATCH_RADIUS * MATCH_RADIUS;
+        long best_e = -1;
+        for (; e < ev.size() && ev[e].y <= (truth[t].y + MATCH_RADIUS) * CEN_ONE; e++)
+        {
+            double dx = (double)ev[e].x / CEN_ONE - truth[t].x, dy = (double)ev[e].y / CEN_ONE - truth[t].y;
+            if (!used[e] && dx * dx + dy * dy < best)
+            {
+                best = dx * dx + dy * dy;
+                best_e = (long)e;
+            }
+        }
+        if (best_e < 0) continue;
+        used[best_e] = 1;
+        double dx = (double)ev[best_e].x / CEN_ONE - truth[t].x, dy = (double)ev[best_e].y / CEN_ONE - truth[t].y;
+        int bx = (((ev[best_e].x & (CEN_ONE - 1)) * BIAS_BINS + CEN_ONE / 2) >> CEN_FRAC_BITS) % BIAS_BINS;
+        int by = (((ev[best_e].y & (CEN_ONE - 1)) * BIAS_BINS + CEN_ONE / 2) >> CEN_FRAC_BITS) % BIAS_BINS;
+        acc->bias_x[bx] -= dx;
+        acc->bias_nx[bx]++;
+        acc->bias_y[by] -= dy;
+        acc->bias_ny[by]++;
+        acc->matched++;
+        acc->sx += dx;
+        acc->sy += dy;
+        acc->sxx += dx * dx;
+        acc->syy += dy * dy;
+    }
+    for (size_t e = 0; e < ev.size(); e++)
+        if (!used[e]) acc->unmatched_events++;
+}
+
+static void run_mode(const struct config *cfg, int mode, const struct frame_set *set, int n_threads, bool record, FILE *bias_out)
+{
+    int window = mode_window(mode);
+    int stride = cfg->stride > 0 ? cfg->stride : (cfg->width + FRAME_STRIDE_ALIGN - 1) / FRAME_STRIDE_ALIGN * FRAME_STRIDE_ALIGN;
+    long long stage[ST_COUNT] = {0};
+
+    long long t0 = monotonic_ns();
+    struct disk_roi roi;
+    if (disk_roi_init(&roi, cfg->cenx, cfg->ceny, cfg->radius, cfg->width, cfg->height, window / 2) != 0) return;
+    long long roi_ns = monotonic_ns() - t0;
+
+    //the frame buffer the reader thread would fill
+    void *p = NULL;
+    if (posix_memalign(&p, FRAME_ALIGN, set->frame_bytes) != 0) return;
+    uint8_t *buf = (uint8_t *)p;
+    struct frame f;
+    f.data = buf;
+    f.width = cfg->width;
+    f.height = cfg->height;
+    f.stride = stride;
+
+    int cap = detect_capacity(&roi, roi.row_begin, roi.row_end);
+    std::vector<struct candidate> cand(cap + 1), cand_ref(cap + 1);
+    std::vector<struct event> ev(cap + 1), leave_ev(COINC_PENDING + cap + 1);
+    centroid_fn centroid = centroid_for_window(window);
+    int energy_threshold = cfg->energy_threshold[mode];
+    int flags = PROTO_F_TIME | (mode != MODE_3X3 ? PROTO_F_CORNERS : 0);
+    std::vector<uint8_t> out(PROTO_HEADER_BYTES + PROTO_MAX_PAYLOAD + PROTO_CRC_BYTES);
+
+    struct accuracy acc;
+    memset(&acc, 0, sizeof(acc));
+    long long scalar_ns = 0, full_ns = 0, out_bytes = 0;
+    long candidates = 0;
+    bool identical = true;
+    struct background bg;
+    const struct detect_background *maps = NULL;
+    if (cfg->background)
+    {
+        if (background_init(&bg, cfg->width, cfg->height, cfg->bg_every, cfg->bg_shift, cfg->bg_nsigma,
+                            cfg->threshold, cfg->bg_hot, window / 2) != 0)
+            return;
+        maps = &bg.maps;
+    }
+    struct coinc coinc;
+    memset(&coinc, 0, sizeof(coinc));
+    if (cfg->coincidence != COINC_OFF &&
+        coinc_init(&coinc, cfg->coincidence, cfg->coinc_frames, cfg->coinc_radius, cfg->cenx, cfg->ceny, cfg->radius) != 0)
+        return;
+    //calibration table of this mode
+    struct calib cal;
+    const struct detect_calib *table = NULL;
+    if (cfg->calib[0] != 0)
+    {
+        if (calib_load(&cal, cfg->calib, window) != 0) return;
+        table = &cal.table;
+    }
+    //the recording of main.o, every frame is rebuilt and detected again
+    struct recorder rec;
+    record = record && cfg->record[0] != 0;
+    if (record && record_open(&rec, cfg->record, &roi, cfg->width, cfg->height, cfg->cenx, cfg->ceny, cfg->radius,
+                              cfg->record_threshold, window / 2) != 0)
+        return;
+    std::vector<uint8_t> rebuilt(record ? set->frame_bytes : 0);
+    //the replay encodes the raw slot handed to the encoder thread again, with its own buffers
+    std::vector<uint8_t> encoded(record ? record_frame_bound(&rec.h, &roi) : 0);
+    std::vector<uint64_t> masks(record ? record_mask_words(&rec.h) : 0);
+    std::vector<struct event> ev_replay(record ? cap + 1 : 0);
+    bool replay_identical = true;
+    //events by the frame they were found in, matched to the truth at the end
+    std::vector< std::vector<struct event> > sent(set->n);
+
+    for (int k = 0; k < set->n; k++)
+    {
+        long long t = monotonic_ns();
+        memcpy(buf, set->data + set->frame_bytes * k, set->frame_bytes);
+        long long t1 = monotonic_ns();
+        stage[ST_INGEST] += t1 - t;
+
+        //mask: nothing to do per frame, the disk spans are precomputed
+        int n_cand;
+        if (cfg->prefilter)
+            n_cand = detect_candidates_sparse(&f, &roi, roi.row_begin, roi.row_end, cfg->threshold, maps, cand.data());
+        else if (maps != NULL)
+            n_cand = detect_candidates_map(&f, &roi, roi.row_begin, roi.row_end, maps, cand.data());
+        else
+            n_cand = detect_candidates(&f, &roi, roi.row_begin, roi.row_end, cfg->threshold, cand.data());
+        long long t2 = monotonic_ns();
+        stage[ST_DETECT] += t2 - t1;
+
+        int n_ev = centroid(&f, cand.data(), n_cand, energy_threshold, maps, ev.data(), n_cand);
+        for (int e = 0; e < n_ev; e++) ev[e].frame = (uint32_t)k;
+        long long t3 = monotonic_ns();
+        stage[ST_CENTROID] += t3 - t2;
+        if (table != NULL)
+        {
+            detect_calibrate(table, ev.data(), n_ev);
+            long long t4 = monotonic_ns();
+            stage[ST_CALIB] += t4 - t3;
+            t3 = t4;
+        }
+
+        if (record)
+        {
+            f.seq = (unsigned long long)k;
+            f.t_ingest = t;
+            bool kept = record_frame(&rec, &f);
+            stage[ST_RECORD] += monotonic_ns() - t3;
+            //a dropped frame is counted, not checked
+            if (kept)
+            {
+                struct frame g = f, raw;
+                g.data = rebuilt.data();
+                record_raw_frame(&rec, rec.raw_filled - 1, &raw);
+                size_t n_rec = record_encode(&rec.h, &roi, &raw, masks.data(), encoded.data());
+                if (record_decode(&rec.h, encoded.data() + RECORD_FRAME_HEADER_BYTES, n_rec - RECORD_FRAME_HEADER_BYTES,
+                                  rebuilt.data(), stride, (int)(set->frame_bytes / stride)) != 0)
+                    replay_identical = false;
+                else if (maps == NULL)
+                {
+                    int n_rc = detect_candidates(&g, &roi, roi.row_begin, roi.row_end, cfg->threshold, cand_ref.data());
+                    int n_rev = centroid(&g, cand_ref.data(), n_rc, energy_threshold, NULL, ev_replay.data(), n_rc);
+                    for (int e = 0; e < n_rev; e++) ev_replay[e].frame = (uint32_t)k;
+                    if (table != NULL) detect_calibrate(table, ev_replay.data(), n_rev);
+                    if (n_rev != n_ev || memcmp(ev_replay.data(), ev.data(), sizeof(struct event) * n_ev) != 0)
+                        replay_identical = false;
+                }
+            }
+            t3 = monotonic_ns();
+        }
+
+        //the events that leave with this frame, held events first in merge mode as in main.o
+        const struct event *leave = ev.data();
+        int n_leave = n_ev;
+        if (cfg->coincidence != COINC_OFF)
+        {
+            if (cfg->coincidence == COINC_MERGE)
+            {
+                const struct event *held;
+                int n;
+                n_leave = 0;
+                while ((n = coinc_take(&coinc, (uint32_t)k, n_ev, false, &held)) > 0)
+                {
+                    memcpy(&leave_ev[n_leave], held, sizeof(struct event) * n);
+                    n_leave += n;
+                }
+                leave = leave_ev.data();
+            }
+            n_ev = coinc_filter(&coinc, ev.data(), n_ev, (uint32_t)k);
+            if (cfg->coincidence == COINC_DROP) n_leave = n_ev;
+            else
+            {
+                memcpy(&leave_ev[n_leave], ev.data(), sizeof(struct event) * n_ev);
+                n_leave += n_ev;
+            }
+            long long t4 = monotonic_ns();
+            stage[ST_COINC] += t4 - t3;
+            t3 = t4;
+        }
+
+        int max_k = proto_max_events(flags);
+        for (int e = 0; e < n_leave; e += max_k)
+            out_bytes += proto_encode_events(out.data(), (uint32_t)k, (uint64_t)k, flags, leave + e, std::min(max_k, n_leave - e));
+        stage[ST_OUTPUT] += monotonic_ns() - t3;
+        for (int e = 0; e < n_leave; e++) sent[leave[e].frame].push_back(leave[e]);
+        candidates += n_cand;
+
+        //the vectorised kernel over every pixel, for the gain of the prefilter
+        long long t4 = monotonic_ns();
+        if (cfg->prefilter)
+        {
+            if (maps != NULL) detect_candidates_map(&f, &roi, roi.row_begin, roi.row_end, maps, cand_ref.data());
+            else detect_candidates(&f, &roi, roi.row_begin, roi.row_end, cfg->threshold, cand_ref.data());
+            full_ns += monotonic_ns() - t4;
+        }
+
+        //reference kernel over every pixel, must find exactly the same candidates
+        t4 = monotonic_ns();
+        int n_ref = maps != NULL ?
+            detect_candidates_map(&f, &roi, roi.row_begin, roi.row_end, maps, cand_ref.data(), detect_row_map_scalar) :
+            detect_candidates(&f, &roi, roi.row_begin, roi.row_end, cfg->threshold, cand_ref.data(), detect_row_scalar);
+        scalar_ns += monotonic_ns() - t4;
+        if (n_ref != n_cand || memcmp(cand_ref.data(), cand.data(), sizeof(struct candidate) * n_cand) != 0)
+            identical = false;
+
+        //background update of main.o on a single thread, after the frame is detected
+        if (maps != NULL)
+        {
+            long long t5 = monotonic_ns();
+            background_next(&bg);
+            background_update_rows(&bg, &f, &roi, roi.row_begin - bg.margin, roi.row_end + bg.margin);
+            stage[ST_BACKGROUND] += monotonic_ns() - t5;
+        }
+
+    }
+    if (cfg->coincidence == COINC_MERGE)
+    {
+        const struct event *held;
+        int n;
+        while ((n = coinc_take(&coinc, 0, 0, true, &held)) > 0)
+            for (int e = 0; e < n; e++) sent[held[e].frame].push_back(held[e]);
+    }
+    for (int k = 0; k < set->n; k++)
+    {
+        if (!set->truth.empty()) match_truth(&acc, sent[k], set->truth[k]);
+        else acc.events += sent[k].size();
+    }
+    unsigned long long record_frames = 0, record_bytes = 0, record_dropped = 0, record_encode_ns = 0;
+    if (record)
+    {
+        record_close(&rec);
+        record_frames = rec.frames;
+        record_bytes = rec.bytes;
+        record_dropped = rec.dropped;
+        record_encode_ns = rec.encode_ns;
+    }
+    unsigned long long duplicates = 0, early = 0;
+    if (cfg->coincidence != COINC_OFF)
+    {
+        duplicates = coinc.duplicates;
+        early = coinc.early;
+        coinc_free(&coinc);
+    }
+
+    //whole detection on the worker pool, as in main.o
+    struct detect_band *bands = (struct detect_band *)malloc(sizeof(struct detect_band) * 4 * n_threads);
+    int n_bands = detect_bands_init(bands, 4 * n_threads, &roi);
+    struct worker_pool pool;
+    worker_pool_init(&pool, n_threads - 1);
+    struct detect_job job;
+    job.frame = &f;
+    job.roi = &roi;
+    job.bands = bands;
+    job.threshold = cfg->threshold;
+    job.energy_threshold = energy_threshold;
+    job.centroid = centroid;
+    job.bg = NULL;
+    job.prefilter = cfg->prefilter != 0;
+    job.calib = table;
+    struct background_job bg_job;
+    double noise = 0;
+    unsigned long hot = 0;
+    if (maps != NULL)
+    {
+        //start again from an empty model
+        noise = background_noise(&bg, &roi);
+        hot = bg.hot_auto.load();
+        background_free(&bg);
+        background_init(&bg, cfg->width, cfg->height, cfg->bg_every, cfg->bg_shift, cfg->bg_nsigma,
+                        cfg->threshold, cfg->bg_hot, window / 2);
+        bg_job.bg = &bg;
+        bg_job.frame = &f;
+        bg_job.roi = &roi;
+        bg_job.bands = bands;
+        bg_job.n_bands = n_bands;
+        job.bg = maps;
+    }
+    long long tp = monotonic_ns();
+    for (int k = 0; k < set->n; k++)
+    {
+        f.data = set->data + set->frame_bytes * k;
+        f.seq = k;
+        worker_pool_run(&pool, detect_band_task, &job, n_bands);
+        if (maps != NULL) background_frame(&bg_job, &pool);
+    }
+    long long pool_ns = monotonic_ns() - tp;
+    if (maps != NULL) background_free(&bg);
+    worker_pool_free(&pool);
+    detect_bands_free(bands, n_bands);
+    free(bands);
+
+    long long total = 0;
+    for (int s = 0; s < ST_COUNT; s++) total += stage[s];
+    double n = set->n;
+    printf("\n== %dx%d mode ==\n", window, window);
+    printf("%-16s %12s\n", "stage", "ns/frame");
+    for (int s = 0; s < ST_COUNT; s++)
+    {
+        printf("%-16s %12.0f", stage_name[s], stage[s] / n);
+        if (s == ST_MASK) printf("   disk spans precomputed once in %lld us", roi_ns / 1000);
+        if (s == ST_DETECT) printf("   %s kernel%s, %.1f candidates/frame", DETECT_KERNEL,
+                                   cfg->prefilter ? " with tile prefilter" : "", candidates / n);
+        if (s == ST_CALIB && table != NULL)
+        {
+            if (table->grid != NULL) printf("   %dx%d distortion grid", table->cols, table->rows);
+            else printf("   no distortion grid");
+            if (table->bias_x != NULL) printf(", bias LUT of %d bins", table->bins);
+            else printf(", no bias LUT");
+        }
+        if (s == ST_OUTPUT) printf("   %.0f bytes/frame", out_bytes / n);
+        if (s == ST_BACKGROUND && maps != NULL)
+            printf("   1/%d of the stripes per frame, noise %.2f DN, %lu hot pixels", cfg->bg_every, noise, hot);
+        if (s == ST_COINC && cfg->coincidence != COINC_OFF)
+            printf("   %.2f duplicates/frame, %llu sent early", duplicates / n, early);
+        if (s == ST_RECORD && record)
+        {
+            printf("   copy, %.0f ns encoding on the encoder thread, %.1f of %.0f kB/frame, %llu dropped, replay identical: %s",
+                   (double)record_encode_ns / std::max(record_frames, 1ULL), record_bytes / 1000.0 / std::max(record_frames, 1ULL),
+                   set->frame_bytes / 1000.0, record_dropped, maps != NULL ? "not checked with background" : (replay_identical ? "yes" : "NO"));
+        }
+        printf("\n");
+    }
+    if (cfg->prefilter) printf("%-16s %12.0f   every tile\n", "detect full", full_ns / n);
+    printf("%-16s %12.0f   identical candidates: %s\n", "detect scalar", scalar_ns / n, identical ? "yes" : "NO");
+    printf("%-16s %12.0f\n", "total", total / n);
+    printf("frames/s: %.1f single thread, %.1f detect and centroid on %d threads\n", 1e9 * n / total, 1e9 * n / pool_ns, n_threads);
+    printf("events/frame: %.2f\n", acc.events / n);
+    if (!set->truth.empty() && acc.matched > 0)
+    {
+        double bx = acc.sx / acc.matched, by = acc.sy / acc.matched;
+        printf("photons/frame: %.2f, detected %.2f%%, unmatched events/frame %.2f\n",
+               acc.truth / n, 100.0 * acc.matched / acc.truth, acc.unmatched_events / n);
+        printf("centroid bias x %+.4f y %+.4f px, rms x %.4f y %.4f px\n",
+               bx, by, sqrt(acc.sxx / acc.matched), sqrt(acc.syy / acc.matched));
+        if (bias_out != NULL)
+        {
+            //the mean error of every entry, an empty entry (3x3 never lands near the pixel edge) takes the nearest one
+            fprintf(bias_out, "bias %d %d\n", window, BIAS_BINS);
+            for (int axis = 0; axis < 2; axis++)
+            {
+                const double *sum = axis == 0 ? acc.bias_x : acc.bias_y;
+                const long *cnt = axis == 0 ? acc.bias_nx : acc.bias_ny;
+                for (int b = 0; b < BIAS_BINS; b++)
+                {
+                    int near = b;
+                    for (int d = 1; d <= BIAS_BINS / 2 && cnt[near] == 0; d++)
+                        near = cnt[(b + d) % BIAS_BINS] > 0 ? (b + d) % BIAS_BINS : (b - d + BIAS_BINS) % BIAS_BINS;
+                    fprintf(bias_out, "%s%+.4f", b > 0 ? " " : "", cnt[near] > 0 ? sum[near] / cnt[near] : 0.0);
+                }
+                fprintf(bias_out, "\n");
+            }
+        }
+    }
+    if (table != NULL) calib_free(&cal);
+    free(buf);
+    disk_roi_free(&roi);
+}
+
+int main(int argc, char **argv)
+{
+    struct config cfg;
+    config_defaults(&cfg);
+    struct synth_params sp;
+    synth_defaults(&sp);
+    const char *modes = "357", *yuv = NULL, *psf = NULL, *bias_path = NULL;
+    int n_frames = 200;
+    int opt, bad = 0;
+    while ((opt = getopt(argc, argv, "c:s:m:n:i:f:g:S:P:r:G:x:B:C:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'c': bad |= config_load(&cfg, optarg); break;
+            case 's': bad |= config_assign(&cfg, optarg); break;
+            case 'm': modes = optarg; break;
+            case 'n': n_frames = atoi(optarg); break;
+            case 'i': yuv = optarg; break;
+            case 'f': sp.flux = atof(optarg); break;
+            case 'g': sp.gain = atof(optarg); break;
+            case 'S': sp.sigma = atof(optarg); break;
+            case 'P': psf = optarg; break;
+            case 'r': sp.read_noise = atof(optarg); break;
+            case 'G': sp.glow = atof(optarg); break;
+            case 'x': sp.seed = (unsigned)atoi(optarg); break;
+            case 'B': sp.bias = atof(optarg); break;
+            case 'C': bias_path = optarg; break;
+            default: bad = 1;
+        }
+    }
+    if (bad || n_frames < 1)
+    {
+        fprintf(stderr, "Usage: %s [-c file] [-s key=value] [-m 357] [-n frames] [-i file.yuv] "
+                        "[-f flux] [-g gain] [-S sigma] [-P psf] [-r noise] [-G glow] [-B bias] [-x seed] [-C table]\n", argv[0]);
+        return 1;
+    }
+
+    //a recording brings its own geometry
+    struct record_reader rd;
+    bool recording = false;
+    FILE *fp = yuv != NULL ? fopen(yuv, "rb") : NULL;
+    if (fp != NULL)
+    {
+        uint8_t magic[4];
+        recording = fread(magic, 1, 4, fp) == 4 && proto_get32(magic) == RECORD_MAGIC;
+        fclose(fp);
+    }
+    if (recording)
+    {
+        if (record_reader_open(&rd, yuv) != 0) return 1;
+        cfg.width = rd.h.width;
+        cfg.height = rd.h.height;
+        cfg.cenx = rd.h.cenx;
+        cfg.ceny = rd.h.ceny;
+        cfg.radius = rd.h.radius;
+        record_reader_close(&rd);
+    }
+
+    struct frame_set set;
+    int stride = cfg.stride > 0 ? cfg.stride : (cfg.width + FRAME_STRIDE_ALIGN - 1) / FRAME_STRIDE_ALIGN * FRAME_STRIDE_ALIGN;
+    int rows = cfg.rows > 0 ? cfg.rows : (cfg.height + FRAME_ROWS_ALIGN - 1) / FRAME_ROWS_ALIGN * FRAME_ROWS_ALIGN;
+    set.frame_bytes = (size_t)stride * rows;
+    if (yuv != NULL)
+    {
+        if ((recording ? load_recording(&set, yuv, n_frames, stride, rows) : load_yuv(&set, yuv, n_frames)) != 0)
+        {
+            fprintf(stderr, "%s: no complete frame of %zu bytes\n", yuv, set.frame_bytes);
+            return 1;
+        }
+        printf("Frames: %d from %s%s\n", set.n, yuv, recording ? ", rebuilt from the recording" : "");
+    }
+    else
+    {
+        sp.width = cfg.width;
+        sp.height = cfg.height;
+        sp.stride = stride;
+        sp.cenx = cfg.cenx;
+        sp.ceny = cfg.ceny;
+        sp.radius = cfg.radius;
+        if (make_synthetic(&set, &sp, psf, n_frames) != 0) return 1;
+        printf("Frames: %d synthetic, flux %g, gain %g, %s %g, read noise %g, glow %g, bias %g\n", set.n, sp.flux, sp.gain,
+               psf != NULL ? "psf" : "sigma", psf != NULL ? 0.0 : sp.sigma, sp.read_noise, sp.glow, sp.bias);
+    }
+
+    int n_threads = cfg.threads > 0 ? cfg.threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_threads < 1) n_threads = 1;
+    printf("Image %dx%d, stride %d, disk (%d,%d) r=%d, threshold %d\n",
+           cfg.width, cfg.height, stride, cfg.cenx, cfg.ceny, cfg.radius, cfg.threshold);
+    FILE *bias_out = NULL;
+    if (bias_path != NULL)
+    {
+        if (set.truth.empty())
+        {
+            fprintf(stderr, "-C needs synthetic frames, the true positions are not known\n");
+            return 1;
+        }
+        bias_out = fopen(bias_path, "w");
+        if (bias_out == NULL)
+        {
+            perror(bias_path);
+            return 1;
+        }
+        fprintf(bias_out, "# centroid bias of bench, flux %g, gain %g, %s %g, read noise %g\n", sp.flux, sp.gain,
+                psf != NULL ? "psf" : "sigma", psf != NULL ? 0.0 : sp.sigma, sp.read_noise);
+    }
+    for (const char *m = modes; *m; m++)
+    {
+        if (*m == '3') run_mode(&cfg, MODE_3X3, &set, n_threads, m == modes, bias_out);
+        else if (*m == '5') run_mode(&cfg, MODE_5X5, &set, n_threads, m == modes, bias_out);
+        else if (*m == '7') run_mode(&cfg, MODE_7X7, &set, n_threads, m == modes, bias_out);
+    }
+    if (bias_out != NULL)
+    {
+        fclose(bias_out);
+        printf("\nBias LUTs of %d bins written to %s\n", BIAS_BINS, bias_path);
+    }
+    free(set.data);
+    return 0;
+}
@@ -0,0 +1,185 @@
+/*
+ * Calibration table
+ * -----------------------
+ *   Corrects the centroids on the Pi so the events leave in the coordinates of the
+ *   undistorted image, two corrections added to the raw centroid (detect.h):
+ *       bias       the window moments pull the centroid towards the pixel centre, by
+ *                  an amount that depends on the fractional position and the window
+ *                  mode: a LUT of bins entries per axis over one pixel, entry k at
+ *                  fractional position k/bins, linear interpolation between entries
+ *       distortion the image tube distortion: a coarse grid of offsets with nodes every
+ *                  step pixels from (0,0), bilinear interpolation inside a cell and
+ *                  the nearest edge of the grid outside it
+ *   The bias is corrected first, from the raw fractional position. Both are kept in
+ *   1/256 pixel and interpolated with 8 bit weights, integer arithmetic only.
+ *
+ *   Text file, # starts a comment, values in pixels:
+ *       grid step cols rows        step a power of two, then the cols*rows nodes
+ *       dx dy                      row by row
+ *       bias N bins                window mode N, then bins corrections of x for the
+ *       dx ...                     fractional x, then bins corrections of y
+ *       dy ...
+ *   Either section may be left out, bias sections of other modes are skipped.
+ */
+
+#ifndef CALIB_H
+#define CALIB_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "detect.h"
+
+//Largest distortion offset and bias correction, in pixels
+#define CALIB_MAX_OFFSET 64
+#define CALIB_MAX_BIAS 1
+#define CALIB_MAX_BINS 256
+
+struct calib
+{
+    int32_t *grid;                  //dx, dy of every node, 1/256 pixel
+    int16_t *bias;                  //bins+1 corrections of x then bins+1 of y, 1/256 pixel
+    int step;                       //grid step in pixels
+    struct detect_calib table;      //what the centroids read
+};
+
+//Next number of the file text at *p, false at the end or on something else
+static inline bool calib_number(char **p, double *v)
+{
+    char *end;
+    *v = strtod(*p, &end);
+    if (end == *p) return false;
+    *p = end;
+    return true;
+}
+
+static inline int32_t calib_fixed(double v)
+{
+    return (int32_t)(v * CEN_ONE + (v < 0 ? -0.5 : 0.5));
+}
+
+/*
+ * Read the calibration table path, with the bias LUT of the window size in use.
+ * Returns 0 on success.
+ */
+static inline int calib_load(struct calib *c, const char *path, int window)
+{
+    memset(c, 0, sizeof(*c));
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+    //the whole file, comments blanked
+    fseek(fp, 0, SEEK_END);
+    long len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char *text = len >= 0 ? (char *)malloc(len + 1) : NULL;
+    if (text == NULL || fread(text, 1, len, fp) != (size_t)len)
+    {
+        fprintf(stderr, "%s: cannot read the calibration table\n", path);
+        free(text);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    text[len] = 0;
+    for (char *q = text, *hash; (hash = strchr(q, '#')) != NULL; q = hash)
+        while (*hash != 0 && *hash != '\n') *hash++ = ' ';
+
+    int ret = 0;
+    char *p = text;
+    while (ret == 0)
+    {
+        char word[16];
+        int used = 0;
+        if (sscanf(p, " %15s%n", word, &used) != 1) break;
+        p += used;
+        double a, b, d;
+        if (strcmp(word, "grid") == 0 && calib_number(&p, &a) && calib_number(&p, &b) && calib_number(&p, &d))
+        {
+            int step = (int)a, cols = (int)b, rows = (int)d, shift = 0;
+            while ((1 << shift) < step) shift++;
+            if (step != (1 << shift) || cols < 2 || rows < 2 || c->grid != NULL)
+            {
+                fprintf(stderr, "%s: one grid, with a power of two step and 2x2 nodes at least\n", path);
+                ret = -1;
+                break;
+            }
+            c->grid = (int32_t *)malloc(sizeof(int32_t) * 2 * cols * rows);
+            if (c->grid == NULL)
+            {
+                fprintf(stderr, "%s: cannot allocate a %dx%d grid\n", path, cols, rows);
+                ret = -1;
+                break;
+            }
+            for (int k = 0; k < 2 * cols * rows && ret == 0; k++)
+            {
+                if (!calib_number(&p, &d) || d <= -CALIB_MAX_OFFSET || d >= CALIB_MAX_OFFSET)
+                {
+                    fprintf(stderr, "%s: grid node %d: expected dx dy below %d pixels\n", path, k / 2, CALIB_MAX_OFFSET);
+                    ret = -1;
+                }
+                c->grid[k] = calib_fixed(d);
+            }
+            c->step = step;
+            c->table.grid = c->grid;
+            c->table.grid_shift = shift;
+            c->table.cols = cols;
+            c->table.rows = rows;
+        }
+        else if (strcmp(word, "bias") == 0 && calib_number(&p, &a) && calib_number(&p, &b))
+        {
+            int mode = (int)a, bins = (int)b;
+            if (bins < 1 || bins > CALIB_MAX_BINS || (mode == window && c->bias != NULL))
+            {
+                fprintf(stderr, "%s: one bias LUT per mode, of 1 to %d bins\n", path, CALIB_MAX_BINS);
+                ret = -1;
+                break;
+            }
+            int16_t lut[2 * (CALIB_MAX_BINS + 1)];
+            for (int k = 0; k < 2 * bins && ret == 0; k++)
+            {
+                if (!calib_number(&p, &d) || d <= -CALIB_MAX_BIAS || d >= CALIB_MAX_BIAS)
+                {
+                    fprintf(stderr, "%s: bias %dx%d: expected %d corrections below %d pixel\n", path, mode, mode,
+                            2 * bins, CALIB_MAX_BIAS);
+                    ret = -1;
+                }
+                //one more entry per axis repeats the first, the LUT wraps around the pixel
+                lut[k + k / bins] = (int16_t)calib_fixed(d);
+            }
+            if (ret != 0 || mode != window) continue;
+            lut[bins] = lut[0];
+            lut[2 * bins + 1] = lut[bins + 1];
+            c->bias = (int16_t *)malloc(sizeof(int16_t) * 2 * (bins + 1));
+            if (c->bias == NULL)
+            {
+                ret = -1;
+                break;
+            }
+            memcpy(c->bias, lut, sizeof(int16_t) * 2 * (bins + 1));
+            c->table.bias_x = c->bias;
+            c->table.bias_y = c->bias + bins + 1;
+            c->table.bins = bins;
+        }
+        else
+        {
+            fprintf(stderr, "%s: expected \"grid step cols rows\" or \"bias N bins\" at \"%s\"\n", path, word);
+            ret = -1;
+        }
+    }
+    free(text);
+    return ret;
+}
+
+static inline void calib_free(struct calib *c)
+{
+    free(c->grid);
+    free(c->bias);
+}
+
+#endif
@@ -0,0 +1,228 @@
+/*
+ * Temporal coincidence filter
+ * -----------------------
+ *   Phosphor decay and the rolling shutter spread one photon splash over consecutive
+ *   frames, so the same photon is detected again in the next frame(s). The filter
+ *   compares every event with the events of the previous coinc_frames frames and
+ *   treats one closer than coinc_radius pixels as a duplicate:
+ *       drop   the duplicate is not sent, events leave without delay
+ *       merge  events are held for coinc_frames frames, duplicates add their energy
+ *              to the held event and move its centroid to the energy weighted mean,
+ *              the duplicates of an event that has already left are dropped
+ *   A duplicate takes the place of the event it matched, so the decaying splash is
+ *   followed from frame to frame. Events of the same frame never match.
+ *
+ *   Recent events live in a direct indexed grid of square cells over the bounding
+ *   box of the disk, COINC_SLOTS per cell, the oldest being replaced. A cell is at
+ *   least twice as large as the radius, so a lookup reads the 2x2 cells from the
+ *   corner (x-radius,y-radius): O(1) per event and no clearing, old entries are told
+ *   apart by their frame number.
+ *
+ *   Held events wait in a FIFO in frame order. When it is full the oldest leave
+ *   early, unmerged, and the events of a frame that does not fit are not held.
+ */
+
+#ifndef COINCIDENCE_H
+#define COINCIDENCE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "detect.h"
+
+//Recent events kept per grid cell
+#define COINC_SLOTS 2
+//Smallest cell, in pixels
+#define COINC_MIN_CELL 8
+//Bits of the slot index in the lookup key, 2x2 cells of COINC_SLOTS
+#define COINC_SLOT_BITS 3
+//Events held in merge mode
+#define COINC_PENDING 65536
+
+struct coinc_slot
+{
+    int32_t x, y;               //last position of the splash, CEN_FRAC_BITS fractional bits
+    uint32_t frame;             //frame it was last seen in
+    uint32_t pending;           //sequence number of the held event in merge mode
+};
+
+struct coinc
+{
+    int mode;
+    int window;                 //frames
+    int32_t radius;             //1/256 pixel units
+    int64_t radius2;            //squared radius
+    int cell_shift;             //cell size 2^cell_shift pixels
+    int x0, y0;                 //pixel at the corner of cell (0,0)
+    int cols, rows;             //cells
+    struct coinc_slot *grid;    //cols*rows*COINC_SLOTS
+
+    //merge mode FIFO, sequence numbers [tail,head) are held
+    struct event *held;
+    uint32_t head, tail;
+
+    unsigned long long duplicates;      //events removed
+    unsigned long long early;           //held events sent before their window ended
+};
+
+/*
+ * Cover the disk (cenx,ceny,radius). Returns 0 on success.
+ */
+static inline int coinc_init(struct coinc *c, int mode, int window, int radius_px, int cenx, int ceny, int radius)
+{
+    c->mode = mode;
+    c->window = window;
+    c->radius = radius_px << CEN_FRAC_BITS;
+    c->radius2 = (int64_t)c->radius * c->radius;
+    c->cell_shift = 0;
+    while ((1 << c->cell_shift) < 2 * radius_px || (1 << c->cell_shift) < COINC_MIN_CELL) c->cell_shift++;
+    //one cell of margin around the disk so the 2x2 lookup never leaves the grid
+    int cell = 1 << c->cell_shift;
+    c->x0 = cenx - radius - cell;
+    c->y0 = ceny - radius - cell;
+    c->cols = (2 * radius + 2 * cell) / cell + 2;
+    c->rows = c->cols;
+    c->grid = (struct coinc_slot *)malloc(sizeof(struct coinc_slot) * c->cols * c->rows * COINC_SLOTS);
+    c->held = mode == COINC_MERGE ? (struct event *)malloc(sizeof(struct event) * COINC_PENDING) : NULL;
+    if (c->grid == NULL || (mode == COINC_MERGE && c->held == NULL))
+    {
+        fprintf(stderr, "Coincidence: cannot allocate a %dx%d grid\n", c->cols, c->rows);
+        return -1;
+    }
+    //frame numbers far in the past, nothing matches them
+    for (int k = 0; k < c->cols * c->rows * COINC_SLOTS; k++)
+    {
+        c->grid[k].x = c->grid[k].y = 0;
+        c->grid[k].frame = UINT32_MAX / 2;
+        c->grid[k].pending = 0;
+    }
+    c->head = c->tail = 0;
+    c->duplicates = 0;
+    c->early = 0;
+    return 0;
+}
+
+static inline void coinc_free(struct coinc *c)
+{
+    free(c->grid);
+    free(c->held);
+}
+
+//Merge mode: hold ev, false when the FIFO is full and it has to leave now
+static inline bool coinc_hold(struct coinc *c, const struct event *ev)
+{
+    if (c->head - c->tail >= COINC_PENDING)
+    {
+        c->early++;
+        return false;
+    }
+    c->held[c->head++ & (COINC_PENDING - 1)] = *ev;
+    return true;
+}
+
+/*
+ * Filter the events ev[0..n) of frame, in place. Returns the number of events that
+ * go on now: the events that are not duplicates in drop mode, in merge mode only
+ * those that found the FIFO full, the others are held (coinc_take makes room first).
+ */
+static inline int coinc_filter(struct coinc *c, struct event *ev, int n, uint32_t frame)
+{
+    int kept = 0;
+    for (int e = 0; e < n; e++)
+    {
+        //cells within the radius: the 2x2 cells from the corner (x-radius,y-radius)
+        int cx = ((ev[e].x - c->radius) >> CEN_FRAC_BITS) - c->x0;
+        int cy = ((ev[e].y - c->radius) >> CEN_FRAC_BITS) - c->y0;
+        if (cx < 0 || cy < 0 || (cx >> c->cell_shift) >= c->cols - 1 || (cy >> c->cell_shift) >= c->rows - 1)
+        {
+            //outside the grid, never a duplicate
+            if (c->mode != COINC_MERGE || !coinc_hold(c, &ev[e])) ev[kept++] = ev[e];
+            continue;
+        }
+        int corner = ((cy >> c->cell_shift) * c->cols + (cx >> c->cell_shift)) * COINC_SLOTS;
+
+        //nearest event of the previous window frames, as the smallest d2 << COINC_SLOT_BITS | slot,
+        //selected without branches as which slots match is random
+        uint64_t best = UINT64_MAX;
+        for (int dy = 0; dy < 2; dy++)
+            for (int k = 0; k < 2 * COINC_SLOTS; k++)
+            {
+                int slot = corner + dy * c->cols * COINC_SLOTS + k;
+                const struct coinc_slot *s = &c->grid[slot];
+                int64_t ddx = ev[e].x - s->x, ddy = ev[e].y - s->y;
+                uint64_t d2 = (uint64_t)(ddx * ddx + ddy * ddy);
+                uint64_t far = (uint64_t)(frame - s->frame - 1 >= (uint32_t)c->window) | (uint64_t)(d2 > (uint64_t)c->radius2);
+                uint64_t key = (d2 << COINC_SLOT_BITS | (uint64_t)(slot - corner)) | (0 - far);
+                best = key < best ? key : best;
+            }
+        struct coinc_slot *match = best != UINT64_MAX ?
+            &c->grid[corner + (int)(best & ((1 << COINC_SLOT_BITS) - 1))] : NULL;
+
+        if (match != NULL)
+        {
+            c->duplicates++;
+            //a held event that has already left cannot take the energy any more
+            if (c->mode == COINC_MERGE && (int32_t)(match->pending - c->tail) >= 0)
+            {
+                struct event *h = &c->held[match->pending & (COINC_PENDING - 1)];
+                int64_t w0 = h->sum, w1 = ev[e].sum;
+                if (w0 + w1 > 0)
+                {
+                    h->x = (int32_t)((h->x * w0 + ev[e].x * w1) / (w0 + w1));
+                    h->y = (int32_t)((h->y * w0 + ev[e].y * w1) / (w0 + w1));
+                }
+                h->sum = (uint16_t)(w0 + w1 < UINT16_MAX ? w0 + w1 : UINT16_MAX);
+            }
+            //follow the splash
+            match->x = ev[e].x;
+            match->y = ev[e].y;
+            match->frame = frame;
+            continue;
+        }
+
+        //a new photon replaces the oldest entry of its cell
+        int cell = (((ev[e].y >> CEN_FRAC_BITS) - c->y0) >> c->cell_shift) * c->cols +
+                   (((ev[e].x >> CEN_FRAC_BITS) - c->x0) >> c->cell_shift);
+        struct coinc_slot *s = &c->grid[cell * COINC_SLOTS];
+        struct coinc_slot *old = &s[0];
+        for (int k = 1; k < COINC_SLOTS; k++)
+            if (frame - s[k].frame > frame - old->frame) old = &s[k];
+        old->x = ev[e].x;
+        old->y = ev[e].y;
+        old->frame = frame;
+        //an event that is not held counts as already left
+        old->pending = c->head;
+        if (c->mode != COINC_MERGE || !coinc_hold(c, &ev[e]))
+        {
+            old->pending = c->tail - 1;
+            ev[kept++] = ev[e];
+        }
+    }
+    return kept;
+}
+
+/*
+ * Merge mode: the held events to send before the events of frame are filtered, those
+ * whose window has passed, all of them with flush, and the oldest until n_new more
+ * fit. Points out to the first and returns how many follow it contiguously; call
+ * again until it returns 0.
+ */
+static inline int coinc_take(struct coinc *c, uint32_t frame, int n_new, bool flush, const struct event **out)
+{
+    if (n_new > COINC_PENDING) n_new = COINC_PENDING;
+    uint32_t start = c->tail;
+    while (c->tail != c->head && (c->tail & (COINC_PENDING - 1)) >= (start & (COINC_PENDING - 1)))
+    {
+        bool final = flush || frame - c->held[c->tail & (COINC_PENDING - 1)].frame > (uint32_t)c->window;
+        if (!final && c->head - c->tail <= (uint32_t)(COINC_PENDING - n_new)) break;
+        if (!final) c->early++;
+        c->tail++;
+    }
+    *out = &c->held[start & (COINC_PENDING - 1)];
+    return (int)(c->tail - start);
+}
+
+#endif
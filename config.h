@@ -0,0 +1,404 @@
+/*
+ * Runtime configuration
+ * -----------------------
+ *   Geometry, thresholds, window mode and output settings, so a detector can be
+ *   realigned or retuned without rebuilding on the Pi.
+ *
+ *   Values are taken, in increasing priority, from
+ *       the defaults below
+ *       a configuration file given with -c, one "key = value" per line, # starts a comment
+ *       the command line, -s key=value or the short options of main()
+ *
+ *   Keys:
+ *       width, height          image size of the video stream
+ *       stride, rows           padded row length and row count of a frame, 0 = raspividyuv padding
+ *       cenx, ceny, radius     centre and radius of the phosphor screen in the image plane
+ *       threshold              event threshold of the centre pixel, above the background with background = 1
+ *       energy_threshold_3x3, energy_threshold_5x5, energy_threshold_7x7
+ *                              energy threshold of the window sum in each mode
+ *       mode                   pin (read the mode select pin), 3, 5 or 7
+ *       threads                detection threads, 0 = one per core
+ *       prefilter              0 or 1, run the candidate kernel only on the 16x16 tiles with a pixel above threshold
+ *       output                 output sink, see output_sink.h
+ *       baud                   serial port speed
+ *       flush_bytes, flush_ms  output batch size and latency bound, flush_bytes 0 = sink default
+ *       send_energy            0 or 1, send the energy of every event
+ *       send_events            0 or 1, send the events, 0 for imaging runs that only need the accumulated image
+ *       accum                  0 or 1, accumulate the centroids in a sub-pixel image (accum.h)
+ *       accum_oversample       bins per pixel along each axis
+ *       accum_bits             16 or 32 bit bins, 16 bit bins saturate
+ *       accum_frames           exposure length in frames of the input stream
+ *       accum_path             snapshot files are written as accum_path_NNNNNN.fits (or .raw), empty = no files
+ *       accum_format           fits or raw
+ *       accum_send             0 or 1, send the snapshots through the output sink
+ *       stats_ms               interval of the statistics report (stats.h), 0 = off
+ *       stats_output           sink of the statistics report, empty = stderr
+ *       background             0 or 1, subtract a running background and use thresholds from the noise (background.h)
+ *       bg_every               frames between two background updates of a pixel, 1/bg_every of the rows per frame
+ *       bg_shift               background weight 2^-bg_shift per update
+ *       bg_nsigma              threshold above the background in noise standard deviations, at least threshold
+ *       bg_hot                 mask pixels more than bg_hot DN above their tile, 0 = off
+ *       hot_pixels             file of hot pixels to mask, "x y" per line, empty = none
+ *       coincidence            off, drop or merge events of one photon seen in consecutive frames (coincidence.h)
+ *       coinc_frames           frames an event is compared with, merged events are held as long
+ *       coinc_radius           largest distance of a duplicate, in pixels
+ *       record                 file to record the frames in, sparse (record.h), empty = off
+ *       record_threshold       pixels above it are recorded with the window around them
+ *       calib                  calibration table of the centroids, bias and distortion (calib.h), empty = raw
+ *       governor               0 or 1, reduce the output when the link falls behind (governor.h), default 0
+ *       gov_latency_ms         age of the oldest event waiting above which the output is reduced
+ *       gov_decimate           the reduced output sends the events of 1 in gov_decimate tiles per frame
+ *       gov_energy             and only those of this energy at least, 0 = all
+ */
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+//Define the width and height of the Video stream
+#define WIDTH 1280
+#define HEIGHT 720
+
+//Declare threshold for photon event detection
+//Event threshold value
+#define THRESHOLD 20
+//Energy threshold value
+#define ENERGY_THRESHOLD_3x3 50
+#define ENERGY_THRESHOLD_5x5 500
+#define ENERGY_THRESHOLD_7x7 800
+
+//Define the center of the phosphor screen and the radius of the phosphor screen in the image plane
+#define CENX 800
+#define CENY 400
+#define RADIUS 300
+
+//Default output and serial port speed
+#define OUTPUT_SINK "serial:/dev/serial0"
+#define UART_BAUD 921600
+//Longest time a record waits in the output batch
+#define SINK_FLUSH_MS 10
+
+// Modes of operation
+#define MODE_3X3 0
+#define MODE_5X5 1
+#define MODE_7X7 2
+//Take the mode from the mode select pin
+#define MODE_PIN -1
+
+//Snapshot file formats of the accumulated image
+#define ACCUM_FITS 0
+#define ACCUM_RAW 1
+
+//Temporal coincidence filter modes (coincidence.h)
+#define COINC_OFF 0
+#define COINC_DROP 1
+#define COINC_MERGE 2
+
+struct config
+{
+    int width, height;
+    int stride, rows;
+    int cenx, ceny, radius;
+    int threshold;
+    int energy_threshold[3];        //indexed by mode
+    int mode;
+    int threads;
+    int prefilter;
+    char output[256];
+    int baud;
+    int flush_bytes;
+    int flush_ms;
+    int send_energy;
+    int send_events;
+    int accum;
+    int accum_oversample;
+    int accum_bits;
+    int accum_frames;
+    char accum_path[256];
+    int accum_format;
+    int accum_send;
+    int stats_ms;
+    char stats_output[256];
+    int background;
+    int bg_every;
+    int bg_shift;
+    int bg_nsigma;
+    int bg_hot;
+    char hot_pixels[256];
+    int coincidence;
+    int coinc_frames;
+    int coinc_radius;
+    char record[256];
+    int record_threshold;
+    char calib[256];
+    int governor;
+    int gov_latency_ms;
+    int gov_decimate;
+    int gov_energy;
+};
+
+static inline void config_defaults(struct config *cfg)
+{
+    cfg->width = WIDTH;
+    cfg->height = HEIGHT;
+    cfg->stride = 0;
+    cfg->rows = 0;
+    cfg->cenx = CENX;
+    cfg->ceny = CENY;
+    cfg->radius = RADIUS;
+    cfg->threshold = THRESHOLD;
+    cfg->energy_threshold[MODE_3X3] = ENERGY_THRESHOLD_3x3;
+    cfg->energy_threshold[MODE_5X5] = ENERGY_THRESHOLD_5x5;
+    cfg->energy_threshold[MODE_7X7] = ENERGY_THRESHOLD_7x7;
+    cfg->mode = MODE_PIN;
+    cfg->threads = 0;
+    cfg->prefilter = 1;
+    snprintf(cfg->output, sizeof(cfg->output), "%s", OUTPUT_SINK);
+    cfg->baud = UART_BAUD;
+    cfg->flush_bytes = 0;
+    cfg->flush_ms = SINK_FLUSH_MS;
+    cfg->send_energy = 0;
+    cfg->send_events = 1;
+    cfg->accum = 0;
+    cfg->accum_oversample = 4;
+    cfg->accum_bits = 32;
+    cfg->accum_frames = 300;
+    cfg->accum_path[0] = 0;
+    cfg->accum_format = ACCUM_FITS;
+    cfg->accum_send = 0;
+    cfg->stats_ms = 0;
+    cfg->stats_output[0] = 0;
+    cfg->background = 0;
+    cfg->bg_every = 4;
+    cfg->bg_shift = 6;
+    cfg->bg_nsigma = 5;
+    cfg->bg_hot = 0;
+    cfg->hot_pixels[0] = 0;
+    cfg->coincidence = COINC_OFF;
+    cfg->coinc_frames = 2;
+    cfg->coinc_radius = 2;
+    cfg->record[0] = 0;
+    cfg->record_threshold = 10;
+    cfg->calib[0] = 0;
+    cfg->governor = 0;
+    cfg->gov_latency_ms = 200;
+    cfg->gov_decimate = 4;
+    cfg->gov_energy = 0;
+}
+
+//Window size of a mode
+static inline int mode_window(int mode)
+{
+    return mode == MODE_3X3 ? 3 : (mode == MODE_5X5 ? 5 : 7);
+}
+
+struct config_key
+{
+    const char *name;
+    size_t offset;              //of an int in struct config, or of output
+    int min, max;
+};
+
+static const struct config_key config_keys[] =
+{
+    {"width", offsetof(struct config, width), 16, 4096},
+    {"height", offsetof(struct config, height), 16, 4096},
+    {"stride", offsetof(struct config, stride), 0, 8192},
+    {"rows", offsetof(struct config, rows), 0, 8192},
+    {"cenx", offsetof(struct config, cenx), 0, 4095},
+    {"ceny", offsetof(struct config, ceny), 0, 4095},
+    {"radius", offsetof(struct config, radius), 1, 4096},
+    {"threshold", offsetof(struct config, threshold), 0, 254},
+    {"energy_threshold_3x3", offsetof(struct config, energy_threshold[MODE_3X3]), 0, 9 * 255},
+    {"energy_threshold_5x5", offsetof(struct config, energy_threshold[MODE_5X5]), 0, 25 * 255},
+    {"energy_threshold_7x7", offsetof(struct config, energy_threshold[MODE_7X7]), 0, 49 * 255},
+    {"threads", offsetof(struct config, threads), 0, 64},
+    {"prefilter", offsetof(struct config, prefilter), 0, 1},
+    {"baud", offsetof(struct config, baud), 1, 4000000},
+    {"flush_bytes", offsetof(struct config, flush_bytes), 0, 1 << 24},
+    {"flush_ms", offsetof(struct config, flush_ms), 0, 10000},
+    {"send_energy", offsetof(struct config, send_energy), 0, 1},
+    {"send_events", offsetof(struct config, send_events), 0, 1},
+    {"accum", offsetof(struct config, accum), 0, 1},
+    {"accum_oversample", offsetof(struct config, accum_oversample), 1, 16},
+    {"accum_bits", offsetof(struct config, accum_bits), 16, 32},
+    {"accum_frames", offsetof(struct config, accum_frames), 1, 1 << 30},
+    {"accum_send", offsetof(struct config, accum_send), 0, 1},
+    {"stats_ms", offsetof(struct config, stats_ms), 0, 3600000},
+    {"background", offsetof(struct config, background), 0, 1},
+    {"bg_every", offsetof(struct config, bg_every), 1, 100000},
+    {"bg_shift", offsetof(struct config, bg_shift), 0, 12},
+    {"bg_nsigma", offsetof(struct config, bg_nsigma), 0, 100},
+    {"bg_hot", offsetof(struct config, bg_hot), 0, 255},
+    {"coinc_frames", offsetof(struct config, coinc_frames), 1, 15},
+    {"coinc_radius", offsetof(struct config, coinc_radius), 1, 8},
+    {"record_threshold", offsetof(struct config, record_threshold), 0, 254},
+    {"governor", offsetof(struct config, governor), 0, 1},
+    {"gov_latency_ms", offsetof(struct config, gov_latency_ms), 10, 60000},
+    {"gov_decimate", offsetof(struct config, gov_decimate), 2, 255},
+    {"gov_energy", offsetof(struct config, gov_energy), 0, 65535},
+};
+
+/*
+ * Set one key from its text value.
+ * Returns 0 on success, prints the problem and returns -1 otherwise.
+ */
+static inline int config_set(struct config *cfg, const char *key, const char *value)
+{
+    if (strcmp(key, "output") == 0)
+    {
+        snprintf(cfg->output, sizeof(cfg->output), "%s", value);
+        return 0;
+    }
+    if (strcmp(key, "accum_path") == 0)
+    {
+        snprintf(cfg->accum_path, sizeof(cfg->accum_path), "%s", value);
+        return 0;
+    }
+    if (strcmp(key, "stats_output") == 0)
+    {
+        snprintf(cfg->stats_output, sizeof(cfg->stats_output), "%s", value);
+        return 0;
+    }
+    if (strcmp(key, "hot_pixels") == 0)
+    {
+        snprintf(cfg->hot_pixels, sizeof(cfg->hot_pixels), "%s", value);
+        return 0;
+    }
+    if (strcmp(key, "record") == 0)
+    {
+        snprintf(cfg->record, sizeof(cfg->record), "%s", value);
+        return 0;
+    }
+    if (strcmp(key, "calib") == 0)
+    {
+        snprintf(cfg->calib, sizeof(cfg->calib), "%s", value);
+        return 0;
+    }
+    if (strcmp(key, "accum_format") == 0)
+    {
+        if (strcmp(value, "fits") == 0) cfg->accum_format = ACCUM_FITS;
+        else if (strcmp(value, "raw") == 0) cfg->accum_format = ACCUM_RAW;
+        else
+        {
+            fprintf(stderr, "config: accum_format must be fits or raw, not \"%s\"\n", value);
+            return -1;
+        }
+        return 0;
+    }
+    if (strcmp(key, "coincidence") == 0)
+    {
+        if (strcmp(value, "off") == 0) cfg->coincidence = COINC_OFF;
+        else if (strcmp(value, "drop") == 0) cfg->coincidence = COINC_DROP;
+        else if (strcmp(value, "merge") == 0) cfg->coincidence = COINC_MERGE;
+        else
+        {
+            fprintf(stderr, "config: coincidence must be off, drop or merge, not \"%s\"\n", value);
+            return -1;
+        }
+        return 0;
+    }
+    if (strcmp(key, "mode") == 0)
+    {
+        if (strcmp(value, "pin") == 0) cfg->mode = MODE_PIN;
+        else if (strcmp(value, "3") == 0) cfg->mode = MODE_3X3;
+        else if (strcmp(value, "5") == 0) cfg->mode = MODE_5X5;
+        else if (strcmp(value, "7") == 0) cfg->mode = MODE_7X7;
+        else
+        {
+            fprintf(stderr, "config: mode must be pin, 3, 5 or 7, not \"%s\"\n", value);
+            return -1;
+        }
+        return 0;
+    }
+    for (size_t k = 0; k < sizeof(config_keys) / sizeof(config_keys[0]); k++)
+    {
+        if (strcmp(key, config_keys[k].name) != 0) continue;
+        char *end;
+        long v = strtol(value, &end, 0);
+        if (end == value || *end != 0 || v < config_keys[k].min || v > config_keys[k].max)
+        {
+            fprintf(stderr, "config: %s must be an integer in [%d,%d], not \"%s\"\n",
+                    key, config_keys[k].min, config_keys[k].max, value);
+            return -1;
+        }
+        *(int *)((char *)cfg + config_keys[k].offset) = (int)v;
+        return 0;
+    }
+    fprintf(stderr, "config: unknown key \"%s\"\n", key);
+    return -1;
+}
+
+//Strip leading and trailing blanks in place
+static inline char* config_trim(char *s)
+{
+    while (*s == ' ' || *s == '\t') s++;
+    char *e = s + strlen(s);
+    while (e > s && (e[-1] == ' ' || e[-1] == '\t' || e[-1] == '\n' || e[-1] == '\r')) e--;
+    *e = 0;
+    return s;
+}
+
+//Apply a "key=value" assignment, returns 0 on success
+static inline int config_assign(struct config *cfg, char *line)
+{
+    char *eq = strchr(line, '=');
+    if (eq == NULL)
+    {
+        fprintf(stderr, "config: expected key = value, got \"%s\"\n", line);
+        return -1;
+    }
+    *eq = 0;
+    return config_set(cfg, config_trim(line), config_trim(eq + 1));
+}
+
+//Read a configuration file, returns 0 on success
+static inline int config_load(struct config *cfg, const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+    char line[512];
+    int lineno = 0, ret = 0;
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        lineno++;
+        char *hash = strchr(line, '#');
+        if (hash != NULL) *hash = 0;
+        char *s = config_trim(line);
+        if (*s == 0) continue;
+        if (config_assign(cfg, s) != 0)
+        {
+            fprintf(stderr, "%s:%d: invalid line\n", path, lineno);
+            ret = -1;
+        }
+    }
+    fclose(fp);
+    return ret;
+}
+
+//Print the configuration in the file format
+static inline void config_print(const struct config *cfg, FILE *out)
+{
+    for (size_t k = 0; k < sizeof(config_keys) / sizeof(config_keys[0]); k++)
+        fprintf(out, "%s = %d\n", config_keys[k].name, *(const int *)((const char *)cfg + config_keys[k].offset));
+    if (cfg->mode == MODE_PIN) fprintf(out, "mode = pin\n");
+    else fprintf(out, "mode = %d\n", mode_window(cfg->mode));
+    fprintf(out, "output = %s\n", cfg->output);
+    fprintf(out, "accum_path = %s\n", cfg->accum_path);
+    fprintf(out, "accum_format = %s\n", cfg->accum_format == ACCUM_RAW ? "raw" : "fits");
+    fprintf(out, "stats_output = %s\n", cfg->stats_output);
+    fprintf(out, "hot_pixels = %s\n", cfg->hot_pixels);
+    fprintf(out, "record = %s\n", cfg->record);
+    fprintf(out, "calib = %s\n", cfg->calib);
+    fprintf(out, "coincidence = %s\n", cfg->coincidence == COINC_MERGE ? "merge" : (cfg->coincidence == COINC_DROP ? "drop" : "off"));
+}
+
+#endif
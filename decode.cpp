@@ -0,0 +1,279 @@
+
+/*
+ * Title: Host-side decoder for the photon event stream
+ * Description: Converts the binary records sent by main.o (protocol.h) from a captured
+ * byte stream, a serial port or a pipe back to CSV or to fixed size binary records,
+ * and sparse frame recordings (record.h) back to a luma stream.
+ *
+ * This code is released under the MIT License, see LICENSE.
+ */
+
+/*
+ * Usage: decode [-f csv|bin] [-o output] [-I prefix] [input]
+ *        decode -R recording [-o output]
+ *   input defaults to stdin and output to stdout
+ *   -I writes the accumulated images (PROTO_IMAGE records) as prefix_NNNNNN.fits
+ *   -R rebuilds the frames of a recording as the padded luma stream of raspividyuv,
+ *      to replay them through main.o or bench -i
+ *
+ *   csv: one line per event
+ *       frame,x,y,c_max,c_min,energy,time
+ *       x,y in pixels, time in seconds of the Pi's monotonic clock,
+ *       c_max,c_min,energy,time are 0 when not present in the stream
+ *   bin: 24 bytes per event, little endian
+ *       u32 frame, s32 x, s32 y (1/256 pixel), u16 energy, u8 c_max, u8 c_min, u64 time (ns)
+ *
+ * Output level changes of the governor (PROTO_LEVEL records) are printed to stderr with
+ * the events withheld before them. A summary of the records and of the bytes lost to
+ * resynchronisation is printed to stderr at the end of the input.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+
+#include "protocol.h"
+#include "accum.h"
+#include "record.h"
+
+#define READ_CHUNK 65536
+//A record never exceeds this size, keep room for one plus a new chunk
+#define DECODE_BUFFER (2 * (PROTO_HEADER_BYTES + PROTO_MAX_PAYLOAD + PROTO_CRC_BYTES) + READ_CHUNK)
+
+static void write_event(FILE *out, bool binary, const struct event *ev, uint64_t time_ns)
+{
+    if (binary)
+    {
+        uint8_t rec[24];
+        proto_put32(rec, ev->frame);
+        proto_put32(rec + 4, (uint32_t)ev->x);
+        proto_put32(rec + 8, (uint32_t)ev->y);
+        proto_put16(rec + 12, ev->sum);
+        rec[14] = ev->c_max;
+        rec[15] = ev->c_min;
+        proto_put32(rec + 16, (uint32_t)time_ns);
+        proto_put32(rec + 20, (uint32_t)(time_ns >> 32));
+        fwrite(rec, 1, sizeof(rec), out);
+    }
+    else
+    {
+        fprintf(out, "%u,%.4f,%.4f,%d,%d,%d,%.6f\n", ev->frame,
+                (double)ev->x / CEN_ONE, (double)ev->y / CEN_ONE, ev->c_max, ev->c_min, ev->sum, time_ns * 1e-9);
+    }
+}
+
+//Accumulated image being reassembled from PROTO_IMAGE records
+struct image
+{
+    bool open;
+    uint32_t exposure;
+    struct proto_image_run geometry;
+    uint32_t *bins;
+};
+
+static void image_write(struct image *img, const char *prefix, unsigned long *images)
+{
+    if (!img->open) return;
+    char path[300];
+    snprintf(path, sizeof(path), "%s_%06u.fits", prefix, img->exposure);
+    FILE *fp = fopen(path, "wb");
+    const struct proto_image_run *g = &img->geometry;
+    if (fp == NULL || accum_write_fits(fp, img->bins, 32, g->width, g->height, g->x0, g->y0, g->oversample,
+                                       img->exposure, g->frame0, g->n_frames) != 0)
+        perror(path);
+    else (*images)++;
+    if (fp != NULL) fclose(fp);
+    free(img->bins);
+    img->open = false;
+}
+
+//Add a run to the image of its exposure, writing the previous image when a new one starts
+static void image_add(struct image *img, const char *prefix, const struct proto_record *rec, unsigned long *images)
+{
+    struct proto_image_run run;
+    if (!proto_get_image_run(rec->payload, rec->length, rec->flags, &run)) return;
+    const struct proto_image_run *g = &img->geometry;
+    if (img->open && (img->exposure != rec->frame || g->width != run.width || g->height != run.height))
+        image_write(img, prefix, images);
+    if (!img->open)
+    {
+        img->bins = (uint32_t *)calloc((size_t)run.width * run.height, sizeof(uint32_t));
+        if (img->bins == NULL) return;
+        img->open = true;
+        img->exposure = rec->frame;
+        img->geometry = run;
+    }
+    for (int k = 0; k < run.n; k++)
+        img->bins[(size_t)run.row * run.width + run.col + k] = proto_image_bin(&run, rec->flags, k);
+}
+
+//Write the frames of a recording as a raspividyuv luma stream, returns 0 on success
+static int replay_recording(const char *path, FILE *out)
+{
+    struct record_reader rd;
+    if (record_reader_open(&rd, path) != 0) return -1;
+    int stride = (rd.h.width + FRAME_STRIDE_ALIGN - 1) / FRAME_STRIDE_ALIGN * FRAME_STRIDE_ALIGN;
+    int rows = (rd.h.height + FRAME_ROWS_ALIGN - 1) / FRAME_ROWS_ALIGN * FRAME_ROWS_ALIGN;
+    uint8_t *frame = (uint8_t *)malloc((size_t)stride * rows);
+    unsigned long long seq, first = 0, last = 0;
+    long long t_ingest;
+    unsigned long frames = 0;
+    int ret = 0;
+    while (frame != NULL && (ret = record_reader_next(&rd, frame, stride, rows, &seq, &t_ingest)) == 1)
+    {
+        if (fwrite(frame, 1, (size_t)stride * rows, out) != (size_t)stride * rows)
+        {
+            perror("write");
+            break;
+        }
+        if (frames++ == 0) first = seq;
+        last = seq;
+    }
+    if (ret < 0) fprintf(stderr, "%s: damaged frame after %lu frames\n", path, frames);
+    fprintf(stderr, "Rebuilt %lu frames of %dx%d (stride %d, %d rows), input frames %llu-%llu%s\n", frames,
+            rd.h.width, rd.h.height, stride, rows, first, last, rd.frames < 0 ? ", no index" : "");
+    free(frame);
+    record_reader_close(&rd);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    bool binary = false;
+    const char *out_path = NULL, *image_prefix = NULL, *recording = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:o:I:R:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'f':
+                if (strcmp(optarg, "bin") == 0) binary = true;
+                else if (strcmp(optarg, "csv") == 0) binary = false;
+                else
+                {
+                    fprintf(stderr, "Unknown format %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'o': out_path = optarg; break;
+            case 'I': image_prefix = optarg; break;
+            case 'R': recording = optarg; break;
+            default:
+                fprintf(stderr, "Usage: %s [-f csv|bin] [-o output] [-I prefix] [input] | -R recording [-o output]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (recording != NULL)
+    {
+        FILE *out = out_path != NULL ? fopen(out_path, "wb") : stdout;
+        if (out == NULL)
+        {
+            perror(out_path);
+            return 1;
+        }
+        int ret = replay_recording(recording, out);
+        if (out != stdout) fclose(out);
+        return ret != 0;
+    }
+
+    int in = STDIN_FILENO;
+    if (optind < argc && (in = open(argv[optind], O_RDONLY)) < 0)
+    {
+        perror(argv[optind]);
+        return 1;
+    }
+    FILE *out = stdout;
+    if (out_path != NULL && (out = fopen(out_path, binary ? "wb" : "w")) == NULL)
+    {
+        perror(out_path);
+        return 1;
+    }
+    if (!binary) fprintf(out, "frame,x,y,c_max,c_min,energy,time\n");
+
+    uint8_t *buf = (uint8_t *)malloc(DECODE_BUFFER);
+    size_t len = 0;
+    unsigned long records = 0, events = 0, skipped_records = 0, crc_errors = 0, lost_bytes = 0, images = 0;
+    //output level of the governor and the events it withheld
+    int level = 0;
+    unsigned long long withheld = 0;
+    struct image img;
+    img.open = false;
+    bool eof = false;
+    while (!eof || len > 0)
+    {
+        if (!eof)
+        {
+            ssize_t n = read(in, buf + len, READ_CHUNK);
+            if (n <= 0) eof = true;
+            else len += (size_t)n;
+        }
+
+        size_t pos = 0;
+        while (pos < len)
+        {
+            struct proto_record rec;
+            bool found;
+            size_t used = proto_parse(buf + pos, len - pos, &rec, &found, &crc_errors);
+            if (!found)
+            {
+                lost_bytes += used;
+                pos += used;
+                //at the end of the input a partial record can only be garbage, look past its sync word
+                if (eof && pos < len)
+                {
+                    lost_bytes++;
+                    pos++;
+                    continue;
+                }
+                break;
+            }
+            lost_bytes += used - (PROTO_HEADER_BYTES + rec.length + PROTO_CRC_BYTES);
+            pos += used;
+            records++;
+            if (rec.type == PROTO_IMAGE && image_prefix != NULL)
+            {
+                image_add(&img, image_prefix, &rec, &images);
+                continue;
+            }
+            struct proto_level lv;
+            if (rec.type == PROTO_LEVEL && proto_get_level(rec.payload, rec.length, &lv))
+            {
+                if (lv.level != level && lv.level == 1)
+                    fprintf(stderr, "Frame %u: output decimated, 1 in %d tiles, energy %d at least\n", rec.frame, lv.decimate, lv.energy);
+                else if (lv.level != level)
+                    fprintf(stderr, "Frame %u: output %s\n", rec.frame, lv.level == 0 ? "full" : "summary");
+                level = lv.level;
+                withheld += lv.withheld;
+                continue;
+            }
+            if (rec.type != PROTO_EVENTS)
+            {
+                skipped_records++;
+                continue;
+            }
+            int n = proto_events_count(rec.length, rec.flags);
+            uint64_t time_ns = proto_events_time(rec.payload, rec.flags);
+            for (int e = 0; e < n; e++)
+            {
+                struct event ev;
+                proto_decode_event(rec.payload, rec.flags, e, rec.frame, &ev);
+                write_event(out, binary, &ev, time_ns);
+            }
+            events += n;
+        }
+        memmove(buf, buf + pos, len - pos);
+        len -= pos;
+    }
+
+    if (image_prefix != NULL) image_write(&img, image_prefix, &images);
+    fprintf(stderr, "Decoded %lu records, %lu events, %lu images, %lu records of other types, %lu bytes lost, %lu CRC mismatches\n",
+            records, events, images, skipped_records, lost_bytes, crc_errors);
+    if (withheld > 0 || level != 0) fprintf(stderr, "Governor: %llu events withheld at reduced output\n", withheld);
+    free(buf);
+    if (out != stdout) fclose(out);
+    return 0;
+}
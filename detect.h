@@ -0,0 +1,788 @@
+/*
+ * Event detection
+ * -----------------------
+ *   Detection is split in two passes over the disk ROI:
+ *
+ *   1. Candidate detection: a pixel is a candidate when
+ *          condition 1: it is strictly greater than all 8 neighbouring pixels
+ *          condition 2: it is greater than THRESHOLD
+ *      The test is vectorised, 16 pixels per instruction with NEON (Raspberry Pi)
+ *      and SSE2, 32 pixels with AVX2. The kernel is chosen at compile time from the
+ *      target flags; detect_row_scalar is the reference implementation and all
+ *      kernels produce the same candidate list in the same order.
+ *
+ *   2. Centroiding: the window moments are computed only for the candidates and
+ *      events below the energy threshold are rejected (condition 3). Centroids are
+ *      computed in integer arithmetic and kept in fixed point with CEN_FRAC_BITS
+ *      fractional bits, so the result does not depend on the kernel used.
+ *
+ *   At low flux almost every tile of DETECT_TILE x DETECT_TILE pixels is empty. The
+ *   prefilter (detect_candidates_sparse) first tests every tile for a pixel above
+ *   threshold with a vertical maximum, without branches, and runs the kernel only on
+ *   the runs of occupied tiles. Candidates are the same as with the full
+ *   scan: a candidate is itself above threshold, so its tile is occupied.
+ *
+ *   With a background model (background.h) condition 2 uses a threshold per pixel,
+ *   the background level plus a margin from the local noise (255 for masked
+ *   pixels), and the background is subtracted from every pixel of the window
+ *   before the moments and the energy are computed.
+ *
+ *   With a calibration table (calib.h) the centroids are corrected for the sub-pixel
+ *   bias of the window and the distortion of the image tube before they leave.
+ *
+ *   REF: Photon Event Centroiding with UV Photon-counting Detectors J. B. Hutchings
+ */
+
+#ifndef DETECT_H
+#define DETECT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "frame_source.h"
+#include "roi.h"
+
+//Centroids are stored in fixed point, 1/256 pixel
+#define CEN_FRAC_BITS 8
+#define CEN_ONE (1 << CEN_FRAC_BITS)
+
+//Widest image row supported by detect_candidates
+#define DETECT_MAX_WIDTH 4096
+
+struct candidate
+{
+    uint16_t row, col;
+};
+
+//Background maps (background.h), read only during detection
+struct detect_background
+{
+    const uint8_t *threshold;   //condition 2 threshold of every pixel
+    const uint16_t *level;      //background level of every pixel, 1/256 DN
+    int stride;                 //entries between two rows of the maps
+};
+
+//Calibration table (calib.h), read only during detection
+struct detect_calib
+{
+    const int32_t *grid;        //dx, dy of every distortion node, 1/256 pixel, NULL for none
+    int grid_shift;             //nodes every 2^grid_shift pixels
+    int cols, rows;
+    const int16_t *bias_x;      //bins+1 bias corrections over one pixel, 1/256 pixel, NULL for none
+    const int16_t *bias_y;
+    int bins;
+};
+
+struct event
+{
+    uint32_t frame;         //sequence number of the frame the event was found in
+    int32_t x, y;           //centroid column and row, CEN_FRAC_BITS fractional bits
+    uint16_t sum;           //energy, sum of the window
+    uint8_t c_max, c_min;   //corner maxima and minima (5x5 and 7x7 window modes)
+};
+
+/*
+ * Candidate kernels
+ *   Scan the pixels [start,end) of the row starting at p (stride bytes between rows)
+ *   and append the column of every candidate to cols. Returns the number found.
+ *   The threshold is the same for the whole row, or with MAP taken per pixel from
+ *   the threshold map row tmap.
+ *   The caller guarantees that the row above/below and columns start-1, end exist.
+ */
+template<bool MAP>
+static inline int detect_row_scalar_t(const uint8_t *p, ptrdiff_t stride, int start, int end, int threshold,
+                                      const uint8_t *tmap, uint16_t *cols)
+{
+    const uint8_t *up = p - stride, *dn = p + stride;
+    int n = 0;
+    for (int j = start; j < end; j++)
+    {
+        int c = p[j];
+        if (c <= (MAP ? tmap[j] : threshold)) continue;
+        if (c > up[j-1] && c > up[j] && c > up[j+1] &&
+            c > p[j-1]  &&              c > p[j+1]  &&
+            c > dn[j-1] && c > dn[j] && c > dn[j+1])
+            cols[n++] = (uint16_t)j;
+    }
+    return n;
+}
+
+static inline int detect_row_scalar(const uint8_t *p, ptrdiff_t stride, int start, int end, int threshold, uint16_t *cols)
+{
+    return detect_row_scalar_t<false>(p, stride, start, end, threshold, NULL, cols);
+}
+
+static inline int detect_row_map_scalar(const uint8_t *p, ptrdiff_t stride, int start, int end, const uint8_t *tmap, uint16_t *cols)
+{
+    return detect_row_scalar_t<true>(p, stride, start, end, 0, tmap, cols);
+}
+
+#if defined(__AVX2__)
+#define DETECT_KERNEL "avx2"
+#define DETECT_WIDTH 32
+template<bool MAP>
+static inline int detect_row_simd_t(const uint8_t *p, ptrdiff_t stride, int start, int end, int threshold,
+                                    const uint8_t *tmap, uint16_t *cols)
+{
+    const uint8_t *up = p - stride, *dn = p + stride;
+    const __m256i thr = _mm256_set1_epi8((char)threshold);
+    const __m256i zero = _mm256_setzero_si256();
+    int n = 0, j = start;
+    for (; j + DETECT_WIDTH <= end; j += DETECT_WIDTH)
+    {
+        //a > b exactly when the saturating difference a-b is non zero
+        __m256i c = _mm256_loadu_si256((const __m256i *)(p + j));
+        __m256i m = _mm256_subs_epu8(c, MAP ? _mm256_loadu_si256((const __m256i *)(tmap + j)) : thr);
+        if (_mm256_testz_si256(m, m)) continue;
+        m = _mm256_min_epu8(m, _mm256_subs_epu8(c, _mm256_loadu_si256((const __m256i *)(up + j - 1))));
+        m = _mm256_min_epu8(m, _mm256_subs_epu8(c, _mm256_loadu_si256((const __m256i *)(up + j))));
+        m = _mm256_min_epu8(m, _mm256_subs_epu8(c, _mm256_loadu_si256((const __m256i *)(up + j + 1))));
+        m = _mm256_min_epu8(m, _mm256_subs_epu8(c, _mm256_loadu_si256((const __m256i *)(p + j - 1))));
+        m = _mm256_min_epu8(m, _mm256_subs_epu8(c, _mm256_loadu_si256((const __m256i *)(p + j + 1))));
+        m = _mm256_min_epu8(m, _mm256_subs_epu8(c, _mm256_loadu_si256((const __m256i *)(dn + j - 1))));
+        m = _mm256_min_epu8(m, _mm256_subs_epu8(c, _mm256_loadu_si256((const __m256i *)(dn + j))));
+        m = _mm256_min_epu8(m, _mm256_subs_epu8(c, _mm256_loadu_si256((const __m256i *)(dn + j + 1))));
+        uint32_t bits = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(m, zero));
+        while (bits)
+        {
+            cols[n++] = (uint16_t)(j + __builtin_ctz(bits));
+            bits &= bits - 1;
+        }
+    }
+    return n + detect_row_scalar_t<MAP>(p, stride, j, end, threshold, tmap, cols + n);
+}
+#elif defined(__SSE2__)
+#define DETECT_KERNEL "sse2"
+#define DETECT_WIDTH 16
+template<bool MAP>
+static inline int detect_row_simd_t(const uint8_t *p, ptrdiff_t stride, int start, int end, int threshold,
+                                    const uint8_t *tmap, uint16_t *cols)
+{
+    const uint8_t *up = p - stride, *dn = p + stride;
+    const __m128i thr = _mm_set1_epi8((char)threshold);
+    const __m128i zero = _mm_setzero_si128();
+    int n = 0, j = start;
+    for (; j + DETECT_WIDTH <= end; j += DETECT_WIDTH)
+    {
+        //a > b exactly when the saturating difference a-b is non zero
+        __m128i c = _mm_loadu_si128((const __m128i *)(p + j));
+        __m128i m = _mm_subs_epu8(c, MAP ? _mm_loadu_si128((const __m128i *)(tmap + j)) : thr);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(m, zero)) == 0xFFFF) continue;
+        m = _mm_min_epu8(m, _mm_subs_epu8(c, _mm_loadu_si128((const __m128i *)(up + j - 1))));
+        m = _mm_min_epu8(m, _mm_subs_epu8(c, _mm_loadu_si128((const __m128i *)(up + j))));
+        m = _mm_min_epu8(m, _mm_subs_epu8(c, _mm_loadu_si128((const __m128i *)(up + j + 1))));
+        m = _mm_min_epu8(m, _mm_subs_epu8(c, _mm_loadu_si128((const __m128i *)(p + j - 1))));
+        m = _mm_min_epu8(m, _mm_subs_epu8(c, _mm_loadu_si128((const __m128i *)(p + j + 1))));
+        m = _mm_min_epu8(m, _mm_subs_epu8(c, _mm_loadu_si128((const __m128i *)(dn + j - 1))));
+        m = _mm_min_epu8(m, _mm_subs_epu8(c, _mm_loadu_si128((const __m128i *)(dn + j))));
+        m = _mm_min_epu8(m, _mm_subs_epu8(c, _mm_loadu_si128((const __m128i *)(dn + j + 1))));
+        unsigned bits = ~(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(m, zero)) & 0xFFFF;
+        while (bits)
+        {
+            cols[n++] = (uint16_t)(j + __builtin_ctz(bits));
+            bits &= bits - 1;
+        }
+    }
+    return n + detect_row_scalar_t<MAP>(p, stride, j, end, threshold, tmap, cols + n);
+}
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define DETECT_KERNEL "neon"
+#define DETECT_WIDTH 16
+template<bool MAP>
+static inline int detect_row_simd_t(const uint8_t *p, ptrdiff_t stride, int start, int end, int threshold,
+                                    const uint8_t *tmap, uint16_t *cols)
+{
+    static const uint8_t lane_bit[16] = {1,2,4,8,16,32,64,128,1,2,4,8,16,32,64,128};
+    const uint8_t *up = p - stride, *dn = p + stride;
+    const uint8x16_t thr = vdupq_n_u8((uint8_t)threshold);
+    const uint8x16_t weight = vld1q_u8(lane_bit);
+    int n = 0, j = start;
+    for (; j + DETECT_WIDTH <= end; j += DETECT_WIDTH)
+    {
+        uint8x16_t c = vld1q_u8(p + j);
+        uint8x16_t m = vcgtq_u8(c, MAP ? vld1q_u8(tmap + j) : thr);
+        uint8x8_t any = vorr_u8(vget_low_u8(m), vget_high_u8(m));
+        if (vget_lane_u64(vreinterpret_u64_u8(any), 0) == 0) continue;
+        m = vandq_u8(m, vcgtq_u8(c, vld1q_u8(up + j - 1)));
+        m = vandq_u8(m, vcgtq_u8(c, vld1q_u8(up + j)));
+        m = vandq_u8(m, vcgtq_u8(c, vld1q_u8(up + j + 1)));
+        m = vandq_u8(m, vcgtq_u8(c, vld1q_u8(p + j - 1)));
+        m = vandq_u8(m, vcgtq_u8(c, vld1q_u8(p + j + 1)));
+        m = vandq_u8(m, vcgtq_u8(c, vld1q_u8(dn + j - 1)));
+        m = vandq_u8(m, vcgtq_u8(c, vld1q_u8(dn + j)));
+        m = vandq_u8(m, vcgtq_u8(c, vld1q_u8(dn + j + 1)));
+        //collapse the lane mask to a 16 bit mask
+        uint8x16_t b = vandq_u8(m, weight);
+        uint8x8_t s = vpadd_u8(vget_low_u8(b), vget_high_u8(b));
+        s = vpadd_u8(s, s);
+        s = vpadd_u8(s, s);
+        unsigned bits = vget_lane_u16(vreinterpret_u16_u8(s), 0);
+        while (bits)
+        {
+            cols[n++] = (uint16_t)(j + __builtin_ctz(bits));
+            bits &= bits - 1;
+        }
+    }
+    return n + detect_row_scalar_t<MAP>(p, stride, j, end, threshold, tmap, cols + n);
+}
+#else
+#define DETECT_KERNEL "scalar"
+#define DETECT_WIDTH 1
+template<bool MAP>
+static inline int detect_row_simd_t(const uint8_t *p, ptrdiff_t stride, int start, int end, int threshold,
+                                    const uint8_t *tmap, uint16_t *cols)
+{
+    return detect_row_scalar_t<MAP>(p, stride, start, end, threshold, tmap, cols);
+}
+#endif
+
+static inline int detect_row_simd(const uint8_t *p, ptrdiff_t stride, int start, int end, int threshold, uint16_t *cols)
+{
+    return detect_row_simd_t<false>(p, stride, start, end, threshold, NULL, cols);
+}
+
+static inline int detect_row_map_simd(const uint8_t *p, ptrdiff_t stride, int start, int end, const uint8_t *tmap, uint16_t *cols)
+{
+    return detect_row_simd_t<true>(p, stride, start, end, 0, tmap, cols);
+}
+
+typedef int (*detect_row_fn)(const uint8_t *p, ptrdiff_t stride, int start, int end, int threshold, uint16_t *cols);
+typedef int (*detect_row_map_fn)(const uint8_t *p, ptrdiff_t stride, int start, int end, const uint8_t *tmap, uint16_t *cols);
+
+/*
+ * Upper bound on the candidates of the ROI rows [row_begin,row_end).
+ * Strict local maxima cannot touch, so a row holds at most every second pixel.
+ */
+static inline int detect_capacity(const struct disk_roi *roi, int row_begin, int row_end)
+{
+    int cap = 0;
+    for (int i = row_begin; i < row_end; i++)
+        cap += (roi->end[i - roi->row_begin] - roi->start[i - roi->row_begin] + 1) / 2;
+    return cap;
+}
+
+/*
+ * Run the candidate kernel over the ROI rows [row_begin,row_end).
+ * out must hold detect_capacity() entries. Returns the number of candidates.
+ */
+static inline int detect_candidates(const struct frame *f, const struct disk_roi *roi, int row_begin, int row_end,
+                                    int threshold, struct candidate *out, detect_row_fn kernel = detect_row_simd)
+{
+    int n = 0;
+    uint16_t cols[DETECT_MAX_WIDTH];
+    for (int i = row_begin; i < row_end; i++)
+    {
+        int k = kernel(f->data + (size_t)i * f->stride, f->stride,
+                       roi->start[i - roi->row_begin], roi->end[i - roi->row_begin], threshold, cols);
+        for (int c = 0; c < k; c++)
+        {
+            out[n].row = (uint16_t)i;
+            out[n].col = cols[c];
+            n++;
+        }
+    }
+    return n;
+}
+
+/*
+ * detect_candidates with the per pixel thresholds of a background model.
+ */
+static inline int detect_candidates_map(const struct frame *f, const struct disk_roi *roi, int row_begin, int row_end,
+                                        const struct detect_background *bg, struct candidate *out,
+                                        detect_row_map_fn kernel = detect_row_map_simd)
+{
+    int n = 0;
+    uint16_t cols[DETECT_MAX_WIDTH];
+    for (int i = row_begin; i < row_end; i++)
+    {
+        int k = kernel(f->data + (size_t)i * f->stride, f->stride,
+                       roi->start[i - roi->row_begin], roi->end[i - roi->row_begin],
+                       bg->threshold + (size_t)i * bg->stride, cols);
+        for (int c = 0; c < k; c++)
+        {
+            out[n].row = (uint16_t)i;
+            out[n].col = cols[c];
+            n++;
+        }
+    }
+    return n;
+}
+
+//Tiles of the occupancy prefilter, pixels along each axis
+#define DETECT_TILE 16
+
+/*
+ * Tile test of the prefilter: bit k of the result is set when a pixel of the k-th
+ * DETECT_TILE columns from p, in the next rows rows, exceeds the threshold, or with
+ * MAP its entry of the threshold map rows at tmap. DETECT_TILE_GROUP tiles, one cache
+ * line, are tested at once so the walk down the stripe reads whole lines.
+ */
+#define DETECT_TILE_GROUP 4
+#if defined(__AVX2__)
+template<bool MAP>
+static inline unsigned detect_tiles_any(const uint8_t *p, ptrdiff_t stride, int rows, int threshold,
+                                        const uint8_t *tmap, ptrdiff_t tstride)
+{
+    const __m256i thr = _mm256_set1_epi8((char)threshold);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i a0 = zero, a1 = zero;
+    for (int r = 0; r < rows; r++)
+    {
+        const uint8_t *q = p + r * stride;
+        a0 = _mm256_max_epu8(a0, _mm256_subs_epu8(_mm256_loadu_si256((const __m256i *)q),
+                                                  MAP ? _mm256_loadu_si256((const __m256i *)(tmap + r * tstride)) : thr));
+        a1 = _mm256_max_epu8(a1, _mm256_subs_epu8(_mm256_loadu_si256((const __m256i *)(q + 32)),
+                                                  MAP ? _mm256_loadu_si256((const __m256i *)(tmap + r * tstride + 32)) : thr));
+    }
+    //one bit per column that is zero, then one bit per tile that is not all zero
+    uint64_t z = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a0, zero)) |
+                 (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a1, zero)) << 32;
+    unsigned m = 0;
+    for (int k = 0; k < DETECT_TILE_GROUP; k++)
+        if ((z >> (k * DETECT_TILE) & 0xffff) != 0xffff) m |= 1u << k;
+    return m;
+}
+#elif defined(__SSE2__)
+template<bool MAP>
+static inline unsigned detect_tiles_any(const uint8_t *p, ptrdiff_t stride, int rows, int threshold,
+                                        const uint8_t *tmap, ptrdiff_t tstride)
+{
+    const __m128i thr = _mm_set1_epi8((char)threshold);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i a[DETECT_TILE_GROUP] = {zero, zero, zero, zero};
+    for (int r = 0; r < rows; r++)
+        for (int k = 0; k < DETECT_TILE_GROUP; k++)
+        {
+            __m128i c = _mm_loadu_si128((const __m128i *)(p + r * stride + k * DETECT_TILE));
+            a[k] = _mm_max_epu8(a[k], _mm_subs_epu8(c, MAP ? _mm_loadu_si128((const __m128i *)(tmap + r * tstride + k * DETECT_TILE)) : thr));
+        }
+    unsigned m = 0;
+    for (int k = 0; k < DETECT_TILE_GROUP; k++)
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(a[k], zero)) != 0xffff) m |= 1u << k;
+    return m;
+}
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+template<bool MAP>
+static inline unsigned detect_tiles_any(const uint8_t *p, ptrdiff_t stride, int rows, int threshold,
+                                        const uint8_t *tmap, ptrdiff_t tstride)
+{
+    const uint8x16_t thr = vdupq_n_u8((uint8_t)threshold);
+    uint8x16_t a[DETECT_TILE_GROUP] = {vdupq_n_u8(0), vdupq_n_u8(0), vdupq_n_u8(0), vdupq_n_u8(0)};
+    for (int r = 0; r < rows; r++)
+        for (int k = 0; k < DETECT_TILE_GROUP; k++)
+            a[k] = vmaxq_u8(a[k], vqsubq_u8(vld1q_u8(p + r * stride + k * DETECT_TILE),
+                                            MAP ? vld1q_u8(tmap + r * tstride + k * DETECT_TILE) : thr));
+    unsigned m = 0;
+    for (int k = 0; k < DETECT_TILE_GROUP; k++)
+    {
+        uint64x2_t v = vreinterpretq_u64_u8(a[k]);
+        if ((vgetq_lane_u64(v, 0) | vgetq_lane_u64(v, 1)) != 0) m |= 1u << k;
+    }
+    return m;
+}
+#else
+template<bool MAP>
+static inline unsigned detect_tiles_any(const uint8_t *p, ptrdiff_t stride, int rows, int threshold,
+                                        const uint8_t *tmap, ptrdiff_t tstride)
+{
+    unsigned m = 0;
+    for (int k = 0; k < DETECT_TILE_GROUP; k++)
+        for (int r = 0; r < rows && !(m >> k & 1); r++)
+            for (int c = k * DETECT_TILE; c < (k + 1) * DETECT_TILE; c++)
+                if (p[r * stride + c] > (MAP ? tmap[r * tstride + c] : threshold))
+                {
+                    m |= 1u << k;
+                    break;
+                }
+    return m;
+}
+#endif
+
+//First tile t <= k < end whose occupancy bit equals bit, end when there is none
+static inline int detect_next_tile(const uint64_t *occ, int t, int end, int bit)
+{
+    while (t < end)
+    {
+        uint64_t w = (bit ? occ[t >> 6] : ~occ[t >> 6]) >> (t & 63);
+        if (w != 0)
+        {
+            t += __builtin_ctzll(w);
+            return t < end ? t : end;
+        }
+        t = (t | 63) + 1;
+    }
+    return end;
+}
+
+/*
+ * detect_candidates with the occupancy prefilter, one stripe of DETECT_TILE image
+ * rows at a time. With MAP the thresholds are taken from the background maps bg.
+ */
+template<bool MAP>
+static inline int detect_candidates_sparse_t(const struct frame *f, const struct disk_roi *roi, int row_begin, int row_end,
+                                             int threshold, const struct detect_background *bg, struct candidate *out)
+{
+    int n = 0;
+    uint16_t cols[DETECT_MAX_WIDTH];
+    uint64_t occ[(DETECT_MAX_WIDTH / DETECT_TILE + 63) / 64];
+    int runs[DETECT_MAX_WIDTH / DETECT_TILE + 2];
+    for (int r0 = row_begin; r0 < row_end; )
+    {
+        int r1 = (r0 / DETECT_TILE + 1) * DETECT_TILE;
+        if (r1 > row_end) r1 = row_end;
+        //columns covered by the spans of the stripe
+        int s = f->width, e = 0;
+        for (int i = r0; i < r1; i++)
+        {
+            int rs = roi->start[i - roi->row_begin], re = roi->end[i - roi->row_begin];
+            if (rs >= re) continue;
+            if (rs < s) s = rs;
+            if (re > e) e = re;
+        }
+        if (s >= e)
+        {
+            r0 = r1;
+            continue;
+        }
+        int t0 = s / DETECT_TILE / DETECT_TILE_GROUP * DETECT_TILE_GROUP, t1 = (e - 1) / DETECT_TILE + 1;
+        memset(occ, 0, sizeof(occ));
+        for (int t = t0; t < t1; t += DETECT_TILE_GROUP)
+        {
+            int c = t * DETECT_TILE;
+            //groups cut by the image edge are simply scanned
+            unsigned any = c + DETECT_TILE_GROUP * DETECT_TILE > f->width ? (1u << DETECT_TILE_GROUP) - 1 :
+                detect_tiles_any<MAP>(f->data + (size_t)r0 * f->stride + c, f->stride, r1 - r0, threshold,
+                                      MAP ? bg->threshold + (size_t)r0 * bg->stride + c : NULL, MAP ? bg->stride : 0);
+            occ[t >> 6] |= (uint64_t)any << (t & 63);
+        }
+
+        //a mostly occupied stripe is cheaper to scan whole
+        int occupied = 0;
+        for (int w = t0 >> 6; w <= (t1 - 1) >> 6; w++) occupied += __builtin_popcountll(occ[w]);
+        if (occupied == 0)
+        {
+            r0 = r1;
+            continue;
+        }
+        //column runs of occupied tiles, the same for every row of the stripe
+        int n_runs = 0;
+        if (2 * occupied > t1 - t0)
+        {
+            //a mostly occupied stripe is cheaper to scan whole
+            runs[0] = s;
+            runs[1] = e;
+            n_runs = 1;
+        }
+        else
+            for (int t = detect_next_tile(occ, t0, t1, 1); t < t1; t = detect_next_tile(occ, t, t1, 1))
+            {
+                int a = t * DETECT_TILE;
+                t = detect_next_tile(occ, t, t1, 0);
+                //whole vectors so that the runs do not fall to the scalar tail, ending on a tile edge
+                int b = a + (t * DETECT_TILE - a + DETECT_WIDTH - 1) / DETECT_WIDTH * DETECT_WIDTH;
+                t = (b + DETECT_TILE - 1) / DETECT_TILE;
+                runs[2 * n_runs] = a;
+                runs[2 * n_runs + 1] = t * DETECT_TILE;
+                n_runs++;
+            }
+
+        //the kernel on the runs within the span of every row
+        for (int i = r0; i < r1; i++)
+        {
+            int rs = roi->start[i - roi->row_begin], re = roi->end[i - roi->row_begin];
+            const uint8_t *p = f->data + (size_t)i * f->stride;
+            const uint8_t *tmap = MAP ? bg->threshold + (size_t)i * bg->stride : NULL;
+            for (int r = 0; r < n_runs; r++)
+            {
+                int a = runs[2 * r] > rs ? runs[2 * r] : rs;
+                int b = runs[2 * r + 1] < re ? runs[2 * r + 1] : re;
+                if (a >= b) continue;
+                int k = detect_row_simd_t<MAP>(p, f->stride, a, b, threshold, tmap, cols);
+                for (int c = 0; c < k; c++)
+                {
+                    out[n].row = (uint16_t)i;
+                    out[n].col = cols[c];
+                    n++;
+                }
+            }
+        }
+        r0 = r1;
+    }
+    return n;
+}
+
+/*
+ * Candidates of the ROI rows [row_begin,row_end) with the prefilter, with the per
+ * pixel thresholds of bg when it is not NULL.
+ */
+static inline int detect_candidates_sparse(const struct frame *f, const struct disk_roi *roi, int row_begin, int row_end,
+                                           int threshold, const struct detect_background *bg, struct candidate *out)
+{
+    if (bg != NULL) return detect_candidates_sparse_t<true>(f, roi, row_begin, row_end, 0, bg, out);
+    return detect_candidates_sparse_t<false>(f, roi, row_begin, row_end, threshold, NULL, out);
+}
+
+//num/den rounded to the nearest integer, den > 0
+static inline int32_t div_round(int32_t num, int32_t den)
+{
+    return num >= 0 ? (num + den / 2) / den : -((-num + den / 2) / den);
+}
+
+static inline int64_t div_round64(int64_t num, int64_t den)
+{
+    return num >= 0 ? (num + den / 2) / den : -((-num + den / 2) / den);
+}
+
+/*
+ * NxN window centroiding, N = 3, 5 or 7
+ *   The window size is a compile time constant so the row and column moments unroll.
+ *   With R_k, C_k the sums of row and column k = -N/2 .. N/2 of the window
+ *       x = j + sum(k*C_k)/sum, y = i + sum(k*R_k)/sum
+ *   which is (C3-C1)/sum for 3x3 and (2*C5+C4-C2-2*C1)/sum for 5x5.
+ *   From 5x5 up the minima and maxima of the 4 corner pixels are reported as well.
+ *   With a background (bg not NULL) the moments and the energy are those of the
+ *   pixels minus their background level, kept in 1/256 DN.
+ *   Appends at most cap events to out and returns the number appended.
+ */
+template<int N>
+static inline int centroid_window(const struct frame *f, const struct candidate *cand, int n, int energy_threshold,
+                                  const struct detect_background *bg, struct event *out, int cap)
+{
+    const int H = N / 2;
+    const ptrdiff_t stride = f->stride;
+    int k = 0;
+    for (int c = 0; c < n && k < cap; c++)
+    {
+        int i = cand[c].row, j = cand[c].col;
+        const uint8_t *w = f->data + (size_t)(i - H) * stride + (j - H);
+        int R[N], C[N];
+        for (int s = 0; s < N; s++) C[s] = 0;
+        for (int r = 0; r < N; r++)
+        {
+            R[r] = 0;
+            for (int s = 0; s < N; s++)
+            {
+                int v = w[r * stride + s];
+                R[r] += v;
+                C[s] += v;
+            }
+        }
+        int sum = 0, mx = 0, my = 0;
+        if (bg != NULL)
+        {
+            //pixel values minus background, 1/256 DN
+            const uint16_t *b = bg->level + (size_t)(i - H) * bg->stride + (j - H);
+            for (int r = 0; r < N; r++)
+            {
+                R[r] <<= 8;
+                C[r] <<= 8;
+            }
+            for (int r = 0; r < N; r++)
+                for (int s = 0; s < N; s++)
+                {
+                    int v = b[r * bg->stride + s];
+                    R[r] -= v;
+                    C[s] -= v;
+                }
+        }
+        for (int r = 0; r < N; r++)
+        {
+            sum += R[r];
+            mx += (r - H) * C[r];
+            my += (r - H) * R[r];
+        }
+        if (bg != NULL)
+        {
+            //condition 3 on the energy above the background
+            if (sum <= energy_threshold << 8) continue;
+            out[k].x = (j << CEN_FRAC_BITS) + (int32_t)div_round64((int64_t)mx * CEN_ONE, sum);
+            out[k].y = (i << CEN_FRAC_BITS) + (int32_t)div_round64((int64_t)my * CEN_ONE, sum);
+            sum >>= 8;
+        }
+        else
+        {
+            //condition 3 : Energy(sum) should be greather than a threshold
+            if (sum <= energy_threshold) continue;
+            out[k].x = (j << CEN_FRAC_BITS) + div_round(mx * CEN_ONE, sum);
+            out[k].y = (i << CEN_FRAC_BITS) + div_round(my * CEN_ONE, sum);
+        }
+        out[k].sum = (uint16_t)(sum < UINT16_MAX ? sum : UINT16_MAX);
+        out[k].c_max = 0;
+        out[k].c_min = 0;
+        if (N >= 5)
+        {
+            //calculate the minima and maxima value of 4 corner pixels
+            int a = w[0], b = w[N - 1], d = w[(N - 1) * stride], e = w[(N - 1) * stride + N - 1];
+            int mn = a, mxc = a;
+            if (b < mn) mn = b;
+            if (b > mxc) mxc = b;
+            if (d < mn) mn = d;
+            if (d > mxc) mxc = d;
+            if (e < mn) mn = e;
+            if (e > mxc) mxc = e;
+            out[k].c_min = (uint8_t)mn;
+            out[k].c_max = (uint8_t)mxc;
+        }
+        k++;
+    }
+    return k;
+}
+
+typedef int (*centroid_fn)(const struct frame *f, const struct candidate *cand, int n, int energy_threshold,
+                           const struct detect_background *bg, struct event *out, int cap);
+
+//Centroid kernel of a window size, NULL if there is none
+static inline centroid_fn centroid_for_window(int n)
+{
+    switch (n)
+    {
+        case 3: return centroid_window<3>;
+        case 5: return centroid_window<5>;
+        case 7: return centroid_window<7>;
+        default: return NULL;
+    }
+}
+
+/*
+ * Calibration of the centroids ev[0..n), in place
+ *   The bias is linear between the LUT entries around the fractional position, the
+ *   distortion bilinear between the 4 grid nodes around the pixel, both with 8 bit
+ *   weights and rounded once, so the result is exact in 1/256 pixel on every target.
+ */
+static inline int32_t calib_bias(const int16_t *lut, int bins, int32_t v)
+{
+    int p = (v & (CEN_ONE - 1)) * bins;
+    int b = p >> CEN_FRAC_BITS, w = p & (CEN_ONE - 1);
+    return (lut[b] * (CEN_ONE - w) + lut[b + 1] * w + CEN_ONE / 2) >> CEN_FRAC_BITS;
+}
+
+static inline void detect_calibrate(const struct detect_calib *cal, struct event *ev, int n)
+{
+    //last position inside the grid, in 1/256 cell
+    int32_t ux_max = ((cal->cols - 1) << CEN_FRAC_BITS) - 1, uy_max = ((cal->rows - 1) << CEN_FRAC_BITS) - 1;
+    for (int e = 0; e < n; e++)
+    {
+        int32_t x = ev[e].x, y = ev[e].y;
+        if (cal->bias_x != NULL)
+        {
+            x += calib_bias(cal->bias_x, cal->bins, ev[e].x);
+            y += calib_bias(cal->bias_y, cal->bins, ev[e].y);
+        }
+        if (cal->grid != NULL)
+        {
+            int32_t ux = x >> cal->grid_shift, uy = y >> cal->grid_shift;
+            ux = ux < 0 ? 0 : (ux > ux_max ? ux_max : ux);
+            uy = uy < 0 ? 0 : (uy > uy_max ? uy_max : uy);
+            int wx = ux & (CEN_ONE - 1), wy = uy & (CEN_ONE - 1);
+            const int32_t *a = cal->grid + 2 * ((uy >> CEN_FRAC_BITS) * cal->cols + (ux >> CEN_FRAC_BITS));
+            const int32_t *c = a + 2 * cal->cols;
+            //offsets are below 64 pixels, 2^14, so the products fit in 31 bits
+            int32_t top_x = a[0] * (CEN_ONE - wx) + a[2] * wx, bot_x = c[0] * (CEN_ONE - wx) + c[2] * wx;
+            int32_t top_y = a[1] * (CEN_ONE - wx) + a[3] * wx, bot_y = c[1] * (CEN_ONE - wx) + c[3] * wx;
+            x += (top_x * (CEN_ONE - wy) + bot_x * wy + (1 << (2 * CEN_FRAC_BITS - 1))) >> (2 * CEN_FRAC_BITS);
+            y += (top_y * (CEN_ONE - wy) + bot_y * wy + (1 << (2 * CEN_FRAC_BITS - 1))) >> (2 * CEN_FRAC_BITS);
+        }
+        ev[e].x = x;
+        ev[e].y = y;
+    }
+}
+
+/*
+ * Detection bands
+ *   The ROI rows are split into horizontal bands that are processed in parallel.
+ *   A band owns the candidates centred on its rows and writes them to its own
+ *   buffers. Windows near a band edge read up to N/2 rows (the halo, 2 rows for
+ *   5x5) of the neighbouring band straight from the shared read-only frame buffer, so the
+ *   events are the same as with a single scan over the ROI.
+ *   Band edges are aligned to BAND_ROW_ALIGN image rows.
+ */
+#define BAND_ROW_ALIGN 16
+
+struct detect_band
+{
+    int row_begin, row_end;
+    struct candidate *cand;     //detect_capacity() entries
+    struct event *events;       //one event per candidate at most
+    int n_events;
+};
+
+/*
+ * Split the ROI into at most n_bands bands of roughly equal pixel count.
+ * Returns the number of bands created.
+ */
+static inline int detect_bands_init(struct detect_band *bands, int n_bands, const struct disk_roi *roi)
+{
+    long per_band = roi->pixels / n_bands + 1;
+    int n = 0, row = roi->row_begin;
+    while (row < roi->row_end && n < n_bands)
+    {
+        long acc = 0;
+        int end = row;
+        while (end < roi->row_end && (acc < per_band || end % BAND_ROW_ALIGN != 0))
+        {
+            acc += roi->end[end - roi->row_begin] - roi->start[end - roi->row_begin];
+            end++;
+        }
+        if (n == n_bands - 1) end = roi->row_end;
+        int cap = detect_capacity(roi, row, end);
+        bands[n].row_begin = row;
+        bands[n].row_end = end;
+        bands[n].cand = (struct candidate *)malloc(sizeof(struct candidate) * (cap + 1));
+        bands[n].events = (struct event *)malloc(sizeof(struct event) * (cap + 1));
+        bands[n].n_events = 0;
+        n++;
+        row = end;
+    }
+    return n;
+}
+
+static inline void detect_bands_free(struct detect_band *bands, int n_bands)
+{
+    for (int b = 0; b < n_bands; b++)
+    {
+        free(bands[b].cand);
+        free(bands[b].events);
+    }
+}
+
+//Parameters of the frame being processed, shared by all band tasks
+struct detect_job
+{
+    const struct frame *frame;
+    const struct disk_roi *roi;
+    struct detect_band *bands;
+    int threshold;
+    int energy_threshold;
+    const struct detect_background *bg;     //NULL for the fixed threshold
+    bool prefilter;                         //skip the empty tiles
+    centroid_fn centroid;
+    const struct detect_calib *calib;       //NULL for raw centroids
+};
+
+//Worker pool task: detect and centroid one band
+static inline void detect_band_task(void *ctx, int b)
+{
+    struct detect_job *job = (struct detect_job *)ctx;
+    struct detect_band *band = &job->bands[b];
+    int n_cand;
+    if (job->prefilter)
+        n_cand = detect_candidates_sparse(job->frame, job->roi, band->row_begin, band->row_end, job->threshold, job->bg, band->cand);
+    else if (job->bg != NULL)
+        n_cand = detect_candidates_map(job->frame, job->roi, band->row_begin, band->row_end, job->bg, band->cand);
+    else
+        n_cand = detect_candidates(job->frame, job->roi, band->row_begin, band->row_end, job->threshold, band->cand);
+    band->n_events = job->centroid(job->frame, band->cand, n_cand, job->energy_threshold, job->bg, band->events, n_cand);
+    if (job->calib != NULL) detect_calibrate(job->calib, band->events, band->n_events);
+    for (int e = 0; e < band->n_events; e++)
+        band->events[e].frame = (uint32_t)job->frame->seq;
+}
+
+#endif
@@ -0,0 +1,162 @@
+/*
+ * Event ring
+ * -----------------------
+ *   Fixed capacity single producer / single consumer queue of events between the
+ *   detector (producer) and uart_transmitter (consumer).
+ *
+ *   - Events leave the ring in the order they were pushed (FIFO).
+ *   - The producer never waits: events that do not fit are dropped and counted.
+ *   - Head and tail live on separate cache lines so the two threads do not
+ *     invalidate each other's line on every event.
+ *   - An idle consumer sleeps on a condition variable. The producer only takes
+ *     the mutex to wake it, when the consumer has announced it is going to sleep.
+ */
+
+#ifndef EVENT_RING_H
+#define EVENT_RING_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <atomic>
+
+#include "detect.h"
+
+#define CACHE_LINE 64
+
+struct event_ring
+{
+    //written by the producer
+    alignas(CACHE_LINE) std::atomic<unsigned long> head;       //next slot to write
+    std::atomic<unsigned long> produced;                        //events accepted
+    std::atomic<unsigned long> dropped;                         //events rejected because the ring was full
+
+    //written by the consumer
+    alignas(CACHE_LINE) std::atomic<unsigned long> tail;       //next slot to read
+    std::atomic<bool> sleeping;                                 //consumer is about to wait on wake
+    std::atomic<unsigned long> sent;                            //events the consumer has transmitted
+
+    //read only after init
+    alignas(CACHE_LINE) struct event *slot;
+    unsigned long mask;                                         //capacity - 1, capacity is a power of two
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+};
+
+/*
+ * Allocate a ring holding at least capacity events.
+ * Returns 0 on success.
+ */
+static inline int event_ring_init(struct event_ring *ring, unsigned long capacity)
+{
+    unsigned long size = 1;
+    while (size < capacity) size <<= 1;
+    void *p = NULL;
+    if (posix_memalign(&p, CACHE_LINE, sizeof(struct event) * size) != 0)
+    {
+        fprintf(stderr, "event ring: cannot allocate %lu events\n", size);
+        return -1;
+    }
+    ring->slot = (struct event *)p;
+    ring->mask = size - 1;
+    ring->head.store(0);
+    ring->tail.store(0);
+    ring->sleeping.store(false);
+    ring->produced.store(0);
+    ring->dropped.store(0);
+    ring->sent.store(0);
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->wake, NULL);
+    return 0;
+}
+
+static inline void event_ring_free(struct event_ring *ring)
+{
+    free(ring->slot);
+    pthread_mutex_destroy(&ring->lock);
+    pthread_cond_destroy(&ring->wake);
+}
+
+static inline unsigned long event_ring_capacity(const struct event_ring *ring)
+{
+    return ring->mask + 1;
+}
+
+//Number of events waiting, may be read from any thread
+static inline unsigned long event_ring_depth(const struct event_ring *ring)
+{
+    return ring->head.load(std::memory_order_acquire) - ring->tail.load(std::memory_order_acquire);
+}
+
+/*
+ * Producer: append n events, dropping the ones that do not fit.
+ * Returns the number of events accepted.
+ */
+static inline int event_ring_push(struct event_ring *ring, const struct event *ev, int n)
+{
+    unsigned long head = ring->head.load(std::memory_order_relaxed);
+    unsigned long tail = ring->tail.load(std::memory_order_acquire);
+    unsigned long space = event_ring_capacity(ring) - (head - tail);
+    int k = n < (long)space ? n : (int)space;
+    for (int e = 0; e < k; e++)
+        ring->slot[(head + e) & ring->mask] = ev[e];
+    ring->head.store(head + k, std::memory_order_release);
+    ring->produced.store(ring->produced.load(std::memory_order_relaxed) + k, std::memory_order_relaxed);
+    ring->dropped.store(ring->dropped.load(std::memory_order_relaxed) + (n - k), std::memory_order_relaxed);
+
+    //pairs with the fence in event_ring_wait: either the consumer sees the new head or we see it sleeping
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (k > 0 && ring->sleeping.load(std::memory_order_relaxed))
+    {
+        pthread_mutex_lock(&ring->lock);
+        pthread_cond_signal(&ring->wake);
+        pthread_mutex_unlock(&ring->lock);
+    }
+    return k;
+}
+
+/*
+ * Consumer: copy up to max events in FIFO order.
+ * Returns the number of events copied, 0 when the ring is empty.
+ */
+static inline int event_ring_pop(struct event_ring *ring, struct event *ev, int max)
+{
+    unsigned long tail = ring->tail.load(std::memory_order_relaxed);
+    unsigned long head = ring->head.load(std::memory_order_acquire);
+    unsigned long avail = head - tail;
+    int k = (long)avail < max ? (int)avail : max;
+    for (int e = 0; e < k; e++)
+        ev[e] = ring->slot[(tail + e) & ring->mask];
+    ring->tail.store(tail + k, std::memory_order_release);
+    return k;
+}
+
+//Consumer: account for n events handed to the output
+static inline void event_ring_sent(struct event_ring *ring, int n)
+{
+    ring->sent.store(ring->sent.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+/*
+ * Consumer: sleep until the producer pushes or timeout_ms expires.
+ * The timeout bounds the wait should a wake-up race with the check.
+ */
+static inline void event_ring_wait(struct event_ring *ring, int timeout_ms)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += (long)timeout_ms * 1000000L;
+    ts.tv_sec += ts.tv_nsec / 1000000000L;
+    ts.tv_nsec %= 1000000000L;
+
+    pthread_mutex_lock(&ring->lock);
+    ring->sleeping.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (event_ring_depth(ring) == 0)
+        pthread_cond_timedwait(&ring->wake, &ring->lock, &ts);
+    ring->sleeping.store(false, std::memory_order_relaxed);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+#endif
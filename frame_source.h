@@ -0,0 +1,250 @@
+/*
+ * Frame source
+ * -----------------------
+ *   Reads the raw luma stream produced by "raspividyuv --luma -o -" from a pipe.
+ *
+ *   The stream carries no headers, so frame boundaries are defined purely by the
+ *   frame size. raspividyuv pads every luma row to a multiple of 32 bytes and the
+ *   plane height to a multiple of 16 rows; a frame therefore occupies
+ *   stride*rows bytes and only the first width bytes of the first height rows
+ *   are image data.
+ *
+ *   A reader thread keeps the pipe drained and fills a triple buffer:
+ *       filling - slot the reader thread is currently writing
+ *       ready   - newest complete frame that the detector has not taken yet
+ *       reading - slot the detector is working on
+ *   When the reader completes a frame while the previous one is still waiting in
+ *   "ready", the older one is discarded and counted as dropped, so the detector
+ *   always receives the newest complete frame and never stalls the camera.
+ *   A frame that ends early (short read at end of stream or read error) is
+ *   counted as torn and never handed to the detector.
+ *
+ *   Every frame is stamped with its index in the stream and the CLOCK_MONOTONIC
+ *   time its last byte was read, the reference of all latency measurements.
+ */
+
+#ifndef FRAME_SOURCE_H
+#define FRAME_SOURCE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#define FRAME_SLOTS 3
+//Alignment of the frame buffers, one cache line and enough for any SIMD load
+#define FRAME_ALIGN 64
+
+//raspividyuv luma padding
+#define FRAME_STRIDE_ALIGN 32
+#define FRAME_ROWS_ALIGN 16
+
+struct frame
+{
+    const unsigned char *data;      //first pixel of the luma plane
+    int width, height;              //image size in pixels
+    int stride;                     //bytes between the start of two rows
+    unsigned long long seq;         //index of the frame in the input stream, gaps are dropped frames
+    long long t_ingest;             //monotonic_ns() when the frame was complete
+};
+
+struct frame_source
+{
+    int fd;
+    int width, height;
+    int stride, rows;               //padded row length and padded row count
+    size_t frame_bytes;
+
+    unsigned char *slot[FRAME_SLOTS];
+    unsigned long long slot_seq[FRAME_SLOTS];
+    long long slot_time[FRAME_SLOTS];
+    int filling, ready, reading;    //slot indices, -1 when unused
+    bool eof;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+
+    //statistics, protected by lock
+    unsigned long long frames_read;         //complete frames read from the pipe
+    unsigned long long frames_delivered;    //frames handed to the detector
+    unsigned long long frames_dropped;      //complete frames overwritten before the detector took them
+    unsigned long long frames_torn;         //incomplete frames at end of stream or on read error
+};
+
+//CLOCK_MONOTONIC in ns
+static inline long long monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Read exactly len bytes unless the stream ends or fails.
+ * Returns the number of bytes read.
+ */
+static inline size_t frame_read_full(int fd, unsigned char *dst, size_t len)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t n = read(fd, dst + done, len - done);
+        if (n > 0)
+        {
+            done += (size_t)n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) perror("frame source read");
+        break;
+    }
+    return done;
+}
+
+//Return a slot that is neither being filled, waiting, nor being read
+static inline int frame_source_free_slot(const struct frame_source *src)
+{
+    for (int s = 0; s < FRAME_SLOTS; s++)
+        if (s != src->filling && s != src->ready && s != src->reading) return s;
+    return -1;
+}
+
+/* Thread: frame_reader
+    * -----------------------
+    *   Reads whole frames into the "filling" slot and publishes them as "ready".
+*/
+static void* frame_reader(void* pUser)
+{
+    struct frame_source *src = (struct frame_source *)pUser;
+    unsigned long long seq = 0;
+    while (1)
+    {
+        size_t got = frame_read_full(src->fd, src->slot[src->filling], src->frame_bytes);
+        long long now = monotonic_ns();
+
+        pthread_mutex_lock(&src->lock);
+        if (got != src->frame_bytes)
+        {
+            if (got > 0) src->frames_torn++;
+            src->eof = true;
+            pthread_cond_signal(&src->cond);
+            pthread_mutex_unlock(&src->lock);
+            break;
+        }
+        src->frames_read++;
+        src->slot_seq[src->filling] = seq++;
+        src->slot_time[src->filling] = now;
+        if (src->ready >= 0)
+        {
+            //the detector has not taken the previous frame, replace it with the newer one
+            int stale = src->ready;
+            src->ready = src->filling;
+            src->filling = stale;
+            src->frames_dropped++;
+        }
+        else
+        {
+            src->ready = src->filling;
+            src->filling = frame_source_free_slot(src);
+        }
+        pthread_cond_signal(&src->cond);
+        pthread_mutex_unlock(&src->lock);
+    }
+    return 0;
+}
+
+/*
+ * Allocate the frame buffers and start the reader thread.
+ * stride and rows of 0 select the raspividyuv padding for the given size.
+ * Returns 0 on success.
+ */
+static inline int frame_source_open(struct frame_source *src, int fd, int width, int height, int stride, int rows)
+{
+    memset(src, 0, sizeof(*src));
+    src->fd = fd;
+    src->width = width;
+    src->height = height;
+    src->stride = stride > 0 ? stride : (width + FRAME_STRIDE_ALIGN - 1) / FRAME_STRIDE_ALIGN * FRAME_STRIDE_ALIGN;
+    src->rows = rows > 0 ? rows : (height + FRAME_ROWS_ALIGN - 1) / FRAME_ROWS_ALIGN * FRAME_ROWS_ALIGN;
+    if (src->stride < width || src->rows < height)
+    {
+        fprintf(stderr, "frame source: stride %d x %d rows is smaller than the image\n", src->stride, src->rows);
+        return -1;
+    }
+    src->frame_bytes = (size_t)src->stride * src->rows;
+    for (int s = 0; s < FRAME_SLOTS; s++)
+    {
+        void *p = NULL;
+        if (posix_memalign(&p, FRAME_ALIGN, src->frame_bytes) != 0)
+        {
+            fprintf(stderr, "frame source: cannot allocate frame buffers\n");
+            return -1;
+        }
+        src->slot[s] = (unsigned char *)p;
+    }
+    src->filling = 0;
+    src->ready = -1;
+    src->reading = -1;
+    pthread_mutex_init(&src->lock, NULL);
+    pthread_cond_init(&src->cond, NULL);
+    int nRet = pthread_create(&src->thread, NULL, frame_reader, src);
+    if (nRet != 0)
+    {
+        fprintf(stderr, "frame reader thread create failed.ret = %d\n", nRet);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Release the previously returned frame and wait for the newest complete one.
+ * Returns false once the stream has ended and no frame is left.
+ */
+static inline bool frame_source_next(struct frame_source *src, struct frame *out)
+{
+    pthread_mutex_lock(&src->lock);
+    src->reading = -1;
+    while (src->ready < 0 && !src->eof)
+        pthread_cond_wait(&src->cond, &src->lock);
+    if (src->ready < 0)
+    {
+        pthread_mutex_unlock(&src->lock);
+        return false;
+    }
+    src->reading = src->ready;
+    src->ready = -1;
+    src->frames_delivered++;
+    out->data = src->slot[src->reading];
+    out->seq = src->slot_seq[src->reading];
+    out->t_ingest = src->slot_time[src->reading];
+    pthread_mutex_unlock(&src->lock);
+
+    out->width = src->width;
+    out->height = src->height;
+    out->stride = src->stride;
+    return true;
+}
+
+//Print the frame counters to stderr
+static inline void frame_source_report(struct frame_source *src)
+{
+    pthread_mutex_lock(&src->lock);
+    fprintf(stderr, "Frames: read %llu, processed %llu, dropped %llu, torn %llu\n",
+            src->frames_read, src->frames_delivered, src->frames_dropped, src->frames_torn);
+    pthread_mutex_unlock(&src->lock);
+}
+
+//Wait for the reader thread to finish and free the buffers
+static inline void frame_source_close(struct frame_source *src)
+{
+    pthread_join(src->thread, NULL);
+    for (int s = 0; s < FRAME_SLOTS; s++) free(src->slot[s]);
+    pthread_mutex_destroy(&src->lock);
+    pthread_cond_destroy(&src->cond);
+}
+
+#endif
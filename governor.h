@@ -0,0 +1,204 @@
+/*
+ * Output governor
+ * -----------------------
+ *   Keeps the latency of the event stream bounded when the link cannot carry every
+ *   event, without ever holding back the detector. The transmitter runs it on the
+ *   events it takes from the ring and sends every frame at one of three levels:
+ *       GOV_FULL       every event
+ *       GOV_DECIMATED  the events of 1 in gov_decimate tiles of 16x16 pixels, the tiles
+ *                      rotating from frame to frame, with an energy of gov_energy at least
+ *       GOV_SUMMARY    no events, the accumulated image (accum.h) is the summary of the
+ *                      photons, with the number of events withheld in PROTO_LEVEL records
+ *   The summary level is only used when the accumulated image is sent (accum = 1 and
+ *   accum_send = 1), otherwise the governor goes no lower than GOV_DECIMATED.
+ *
+ *   Every GOV_TICK_MS it measures
+ *       age        time since the capture of the oldest event it is about to send
+ *       offered    bytes per second the events would take at full output, from the
+ *                  events pushed to the ring, accepted or dropped
+ *       capacity   bytes per second the link carried at full output while the ring was
+ *                  never found empty, baud/10 for a serial port until then
+ *   It steps down one level as soon as the age exceeds gov_latency_ms, and back up one
+ *   level when the age has stayed below a quarter of it for GOV_HOLD_MS and the level
+ *   above would take at most GOV_HEADROOM of the capacity, so it does not oscillate
+ *   around the link rate. Withheld events leave the ring at memory speed, the backlog
+ *   drains and the age falls back within a tick or two of a bright transient.
+ *
+ *   The level changes at frame boundaries. A PROTO_LEVEL record (protocol.h) announces
+ *   it before the first record of the frame, and is repeated every GOV_REPORT_MS below
+ *   full output with the events withheld since the previous one.
+ */
+
+#ifndef GOVERNOR_H
+#define GOVERNOR_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "detect.h"
+#include "protocol.h"
+
+//Output levels
+#define GOV_FULL 0
+#define GOV_DECIMATED 1
+#define GOV_SUMMARY 2
+#define GOV_LEVELS 3
+
+//Interval of the measurements and decisions
+#define GOV_TICK_MS 50
+//Time the age must stay low before a step up
+#define GOV_HOLD_MS 1000
+//Largest share of the capacity the level above may take for a step up
+#define GOV_HEADROOM 0.7
+//Interval of the PROTO_LEVEL records below full output
+#define GOV_REPORT_MS 1000
+
+struct governor
+{
+    int latency_ms, decimate, energy;
+    int max_level;                      //lowest output allowed, GOV_DECIMATED or GOV_SUMMARY
+    int level;                          //decided by the last tick
+    int frame_level;                    //level of the frame being sent
+    uint32_t frame;                     //newest frame latched
+    bool started;                       //a frame has been sent
+
+    //measurements of the current tick
+    long long t_tick;
+    unsigned long long pushed0, written0;
+    bool idle;                          //the ring was found empty
+    double offered, capacity;           //bytes/s, capacity 0 while unknown
+    long long calm_since;               //age low and room above since, 0 if not
+
+    //since the last PROTO_LEVEL record
+    long long t_report;
+    uint32_t n_frames;                  //frames latched, the current one included
+    uint32_t withheld;
+
+    unsigned long long withheld_total, changes;
+    unsigned long long frames[GOV_LEVELS];      //frames sent at every level
+};
+
+/*
+ * capacity is the link rate in bytes/s when it is known in advance (serial port),
+ * 0 to measure it. max_level is GOV_SUMMARY when the accumulated image is sent.
+ */
+static inline void governor_init(struct governor *g, int latency_ms, int decimate, int energy, int max_level,
+                                 double capacity, long long now)
+{
+    memset(g, 0, sizeof(*g));
+    g->max_level = max_level;
+    g->latency_ms = latency_ms;
+    g->decimate = decimate;
+    g->energy = energy;
+    g->capacity = capacity;
+    g->t_tick = now;
+    g->t_report = now;
+}
+
+//The transmitter found the ring empty
+static inline void governor_idle(struct governor *g)
+{
+    g->idle = true;
+}
+
+/*
+ * Update the measurements and the level once per GOV_TICK_MS. age_ns is the age of the
+ * oldest event waiting, pushed the events pushed to the ring so far, event_bytes their
+ * size on the link and written the bytes written to the link so far.
+ */
+static inline void governor_tick(struct governor *g, long long now, long long age_ns, unsigned long long pushed,
+                                 int event_bytes, unsigned long long written)
+{
+    if (now - g->t_tick < GOV_TICK_MS * 1000000LL) return;
+    double dt = (now - g->t_tick) * 1e-9;
+    g->offered += ((double)(pushed - g->pushed0) * event_bytes / dt - g->offered) / 4;
+    //the link is the limit only while there is always something to send
+    if (!g->idle && g->frame_level == GOV_FULL && written > g->written0)
+    {
+        double rate = (written - g->written0) / dt;
+        g->capacity = g->capacity == 0 ? rate : g->capacity + (rate - g->capacity) / 4;
+    }
+    g->t_tick = now;
+    g->pushed0 = pushed;
+    g->written0 = written;
+    g->idle = false;
+
+    long long limit = g->latency_ms * 1000000LL;
+    if (age_ns > limit)
+    {
+        if (g->level < g->max_level) g->level++;
+        g->calm_since = 0;
+        return;
+    }
+    double above = g->level == GOV_DECIMATED ? g->offered : g->offered / g->decimate;
+    if (g->level == GOV_FULL || age_ns > limit / 4 || (g->capacity > 0 && above > GOV_HEADROOM * g->capacity))
+    {
+        g->calm_since = 0;
+        return;
+    }
+    if (g->calm_since == 0) g->calm_since = now;
+    else if (now - g->calm_since >= GOV_HOLD_MS * 1000000LL)
+    {
+        g->level--;
+        g->calm_since = 0;
+    }
+}
+
+/*
+ * The transmitter reached an event of frame: latch the level when it is a new frame.
+ * Events held back by the coincidence filter can arrive after those of newer frames,
+ * they are sent at the level of the newest frame. Returns true when a PROTO_LEVEL
+ * record is due before the events of the frame.
+ */
+static inline bool governor_frame(struct governor *g, uint32_t frame, long long now)
+{
+    if (g->started && (int32_t)(frame - g->frame) <= 0) return false;
+    bool changed = g->started ? g->level != g->frame_level : g->level != GOV_FULL;
+    if (changed) g->changes++;
+    g->started = true;
+    g->frame = frame;
+    g->frame_level = g->level;
+    g->frames[g->level]++;
+    g->n_frames++;
+    return changed || (g->level != GOV_FULL && now - g->t_report >= GOV_REPORT_MS * 1000000LL);
+}
+
+//Contents of the PROTO_LEVEL record for the current frame, restarts the counts
+static inline void governor_record(struct governor *g, long long now, struct proto_level *lv)
+{
+    lv->level = g->frame_level;
+    lv->decimate = g->decimate;
+    lv->energy = g->energy;
+    //the frames before the current one
+    lv->n_frames = g->n_frames > 0 ? g->n_frames - 1 : 0;
+    lv->withheld = g->withheld;
+    g->n_frames = g->n_frames > 0 ? 1 : 0;
+    g->withheld = 0;
+    g->t_report = now;
+}
+
+/*
+ * Keep the events ev[0..n) of one frame that the current level sends, in place, the
+ * tiles of the frame of the events. Returns the number kept.
+ */
+static inline int governor_filter(struct governor *g, struct event *ev, int n)
+{
+    int k = n;
+    if (g->frame_level == GOV_SUMMARY) k = 0;
+    else if (g->frame_level == GOV_DECIMATED)
+    {
+        const int shift = CEN_FRAC_BITS + PROTO_LEVEL_TILE_SHIFT;
+        k = 0;
+        for (int e = 0; e < n; e++)
+        {
+            uint32_t tx = ev[e].x < 0 ? 0 : (uint32_t)ev[e].x >> shift;
+            uint32_t ty = ev[e].y < 0 ? 0 : (uint32_t)ev[e].y >> shift;
+            if ((tx + ty + ev[e].frame) % (uint32_t)g->decimate == 0 && ev[e].sum >= g->energy) ev[k++] = ev[e];
+        }
+    }
+    g->withheld += n - k;
+    g->withheld_total += n - k;
+    return k;
+}
+
+#endif
@@ -37,43 +37,52 @@
 #include <fcntl.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
 //GPIO library
 #include <wiringPi.h>
 
+#include "config.h"
+#include "frame_source.h"
+#include "roi.h"
+#include "detect.h"
+#include "worker_pool.h"
+#include "event_ring.h"
+#include "protocol.h"
+#include "output_sink.h"
+#include "accum.h"
+#include "stats.h"
+#include "background.h"
+#include "coincidence.h"
+#include "record.h"
+#include "calib.h"
+#include "governor.h"
+
 
 //Define pin map
 #define EN 4
 #define MODE_SELECT_PIN 5
 
-//Define the width and height of the Video stream
-#define WIDTH 1280
-#define HEIGHT 720
-
-//Declare threshold for photon event detection
-//Event threshold value
-#define THRESHOLD 20
-//Energy threshold value
-#define ENERGY_THRESHOLD_3x3 50
-#define ENERGY_THRESHOLD_5x5 500
+//Detection bands per core, more bands than cores balance the uneven disk rows
+#define BANDS_PER_THREAD 4
 
-//Define the center of the phosphor screen and the radius of the phosphor screen in the image plane
-#define CENX 800
-#define CENY 400
-#define RADIUS 300
+//Window mode in use, MODE_3X3, MODE_5X5 or MODE_7X7 (config.h)
+int Mode_select = MODE_5X5;
+//Runtime configuration (config.h)
+struct config cfg;
 
-// Modes of operation
-#define MODE_3X3 0
-#define MODE_5X5 1
-//Set default mode to 5x5
-bool Mode_select = MODE_5X5;
 
+//Capacity of the event ring between the detector and uart_transmitter
+#define EVENT_RING_CAPACITY 131072
+//Events taken from the ring per transmitter iteration
+#define TX_BATCH 1024
+//Longest sleep of an idle transmitter
+#define TX_IDLE_MS 100
 
-float x_cen[100000],y_cen[100000];
-int c_max[100000],c_min[100000];
-int number_of_centroids=0;
+//Event ring, filled by the detector and drained by uart_transmitter
+struct event_ring ring;
 
-//Define the mutex for the centroid array
-pthread_mutex_t cen;
 
 
 
@@ -81,366 +90,509 @@ pthread_mutex_t cen;
 
 
 
-unsigned char image[HEIGHT][WIDTH];
-unsigned char image_cv[HEIGHT*WIDTH];
-
 /* Thread: uart_tramitter
     * -----------------------
-    *   This thread is responsible for transmitting the data to the uart port 
-    *   The data is transmitted in the following format
-    *   x1,y1 for 3x3 window mode
-    *       x1 is the x coordinate of the centroid
-    *       y1 is the y coordinate of the centroid
-    *   x1,y1,c_max,c_min for 5x5 window mode 
-    *       c_max is thde corner maxima
-    *       c_min is the corner minima   
-    *   
+    *   This thread is responsible for transmitting the data to the uart port or another output sink (output_sink.h)
+    *   The data is transmitted in binary records (protocol.h), one record per frame
+    *       x,y of every centroid in 1/256 pixel
+    *       c_max,c_min for 5x5 and 7x7 window modes
+    *           c_max is the corner maxima
+    *           c_min is the corner minima   
+    *       energy of every event when enabled with -e
+    *       capture time of the frame, CLOCK_MONOTONIC of the Pi in ns
+    *   Records are collected by the sink and written with one writev() call per batch
+    *   Use the decode tool on the host to convert the stream to CSV
+    *   Snapshots of the accumulated image (accum.h) are sent in PROTO_IMAGE records between the event batches
     * 
 */
 
+//Destination of the event stream (output_sink.h)
+struct output_sink sink;
+
+//Accumulated image, when enabled with accum = 1
+struct accum accum;
+
+//Coincidence filter, when enabled with coincidence = drop or merge
+struct coinc coinc;
+
+//Output governor of the transmitter, when enabled with governor = 1
+struct governor gov;
+
+//Set by main at the end of the input, the transmitter drains the ring and exits
+std::atomic<bool> tx_stop(false);
+
+//Latency histograms, frame stamps and the periodic report (stats.h)
+struct pipeline_stats stats;
+
+//Capture times of the records in the sink batch, their wire latency is taken when the batch is written.
+//Room for as many event records as the batch can hold, so every record is sampled
+static long long *tx_stamp;
+static size_t n_tx_stamps, tx_stamp_cap;
+static unsigned long long tx_flushes;
+
+static void tx_note_flushes(void)
+{
+    if (sink.flushes == tx_flushes) return;
+    long long now = monotonic_ns();
+    for (size_t k = 0; k < n_tx_stamps; k++) hist_add(&stats.hist[HIST_WIRE], now - tx_stamp[k]);
+    n_tx_stamps = 0;
+    tx_flushes = sink.flushes;
+}
+
+//Wake the transmitter sleeping on the event ring
+static void wake_transmitter(void)
+{
+    pthread_mutex_lock(&ring.lock);
+    pthread_cond_signal(&ring.wake);
+    pthread_mutex_unlock(&ring.lock);
+}
+
+//Smallest output batch that holds one record of every type the transmitter sends
+static size_t tx_min_batch(void)
+{
+    //the corners of the 5x5 and 7x7 modes, the mode pin is read later
+    size_t min = proto_events_record_bytes(PROTO_F_TIME | PROTO_F_CORNERS | (cfg.send_energy ? PROTO_F_ENERGY : 0), 1);
+    if (cfg.governor && proto_level_record_bytes() > min) min = proto_level_record_bytes();
+    if (cfg.accum && cfg.accum_send && accum_min_batch(cfg.accum_bits) > min) min = accum_min_batch(cfg.accum_bits);
+    return min;
+}
+
+//Hand events to the transmitter and the accumulated image, detector only. Returns n
+static int emit_events(const struct event *ev, int n)
+{
+    if (cfg.send_events) event_ring_push(&ring, ev, n);
+    if (cfg.accum) accum_add(&accum, ev, n);
+    return n;
+}
+
+//Measure the backlog and the link for the governor, oldest is NULL when the ring is empty
+static void tx_govern(const struct event *oldest, int flags)
+{
+    long long now = monotonic_ns(), age = 0;
+    if (oldest == NULL) governor_idle(&gov);
+    else
+    {
+        long long t_ingest = frame_stamp_get(stats.stamps, oldest->frame);
+        if (t_ingest != 0) age = now - t_ingest;
+    }
+    governor_tick(&gov, now, age, ring.produced.load() + ring.dropped.load(), proto_event_bytes(flags), sink.bytes_written.load(std::memory_order_relaxed));
+    stats.level.store(gov.level, std::memory_order_relaxed);
+}
+
+//Announce the output level before the events of the frame the governor has just latched
+static void tx_level(long long now)
+{
+    struct proto_level lv;
+    governor_record(&gov, now, &lv);
+    uint8_t *rec = output_sink_reserve(&sink, proto_level_record_bytes());
+    tx_note_flushes();
+    output_sink_commit(&sink, proto_encode_level(rec, gov.frame, &lv));
+}
+
+//Arguments of uart_transmitter, set by main before the thread starts
+struct tx_args
+{
+    int flags;                          //PROTO_F_* of the event records
+};
+
 static void* uart_transmitter(void* pUser)
 {
-  
-    //UART Configuration
-    int serial = open("/dev/serial0",O_RDWR|O_NOCTTY);
-    struct termios options;
-    tcgetattr(serial, &options);
-    cfsetospeed(&options,B115200); // Baud rate at 155200
-    tcsetattr(serial,TCSANOW,&options);
-    dprintf(serial,"system on\n");
+    static struct event ev[TX_BATCH];
+    const int flags = ((const struct tx_args *)pUser)->flags;
     while(1)
-    {   
-
-        float x_c[100000],y_c[100000];
-        int c_max_t[100000],c_min_t[100000];
-        int n_c=0;
-        //get mutex lock to access the centroid array
-        pthread_mutex_lock(&cen);
-        while(number_of_centroids>0)
-        {   
-            if(n_c>100000) break;
-            x_c[n_c]= x_cen[number_of_centroids];
-            y_c[n_c]= y_cen[number_of_centroids];
-            if(Mode_select==MODE_5X5)
-            {
-                c_max_t[n_c]=c_max[number_of_centroids];
-                c_min_t[n_c]=c_min[number_of_centroids];
-            }
-            number_of_centroids--;
-            n_c++;
-
+    {
+        //take the oldest events, sleep while there are none
+        int n_c = event_ring_pop(&ring, ev, TX_BATCH);
+        if (cfg.governor) tx_govern(n_c > 0 ? &ev[0] : NULL, flags);
+        if (n_c == 0)
+        {
+            //an idle link carries the image snapshot
+            if (cfg.accum && accum_send(&accum, &sink, ACCUM_TX_RECORDS)) continue;
+            if (tx_stop.load()) break;
+            //keep the batch for at most flush_ms
+            output_sink_poll(&sink);
+            tx_note_flushes();
+            event_ring_wait(&ring, sink.pending > 0 && sink.flush_ms < TX_IDLE_MS ? sink.flush_ms : TX_IDLE_MS);
+            continue;
         }
-        pthread_mutex_unlock(&cen);
-       //transmit the data to the uart port
-        while(n_c>0)
+        //a record must fit in one batch of the sink
+        int max_k = (int)((sink.flush_bytes - proto_events_record_bytes(flags, 0)) / proto_event_bytes(flags));
+        //one record per run of events from the same frame, what the governor keeps of it
+        int n_sent = 0;
+        for (int e = 0; e < n_c; )
         {
-       
-        if(Mode_select==MODE_5X5)
-        dprintf(serial,"%f,%f,%d,%d\n",x_c[n_c],y_c[n_c],c_max_t[n_c],c_min_t[n_c]);
-        else
-        dprintf(serial,"%f,%f\n",x_c[n_c],y_c[n_c]);
-        n_c--;
+            int k = 1;
+            while (e + k < n_c && k < max_k && ev[e + k].frame == ev[e].frame) k++;
+            int n_keep = k;
+            if (cfg.governor)
+            {
+                long long now = monotonic_ns();
+                if (governor_frame(&gov, ev[e].frame, now)) tx_level(now);
+                n_keep = governor_filter(&gov, ev + e, k);
+            }
+            if (n_keep > 0)
+            {
+                uint8_t *rec = output_sink_reserve(&sink, proto_events_record_bytes(flags, n_keep));
+                tx_note_flushes();
+                long long t_ingest = frame_stamp_get(stats.stamps, ev[e].frame);
+                output_sink_commit(&sink, proto_encode_events(rec, ev[e].frame, (uint64_t)t_ingest, flags, ev + e, n_keep));
+                if (t_ingest != 0 && n_tx_stamps < tx_stamp_cap) tx_stamp[n_tx_stamps++] = t_ingest;
+            }
+            n_sent += n_keep;
+            e += k;
         }
+        event_ring_sent(&ring, n_sent);
+        if (cfg.governor) stats.withheld.store(gov.withheld_total, std::memory_order_relaxed);
+        if (cfg.accum) accum_send(&accum, &sink, ACCUM_TX_RECORDS);
+        output_sink_poll(&sink);
+        tx_note_flushes();
     }
-    close(serial);
+    //the events withheld since the last PROTO_LEVEL record
+    if (cfg.governor && gov.withheld > 0) tx_level(monotonic_ns());
+    output_sink_flush(&sink);
+    tx_note_flushes();
     return 0;
 }
 
 /* Main program
     * -----------------------
     *   This program is responsible for reading the image stream from the piped input
+    *   The frames are read by the frame_reader thread (frame_source.h), the newest complete frame is processed
+    *   The configuration is read from the command line and the optional configuration file (config.h)
     *   First the mode select pin is read and the mode is set accordingly
-    *   The image stream is then thresholded and the centroid of eventsthe phosphor screen is calculated
-    *   The centroid is then stored in the centroid array
-    *   The centroid array is then accessed by the uart_transmitter thread to transmit the data to the uart port
+    *   The image stream is then thresholded and the centroid of events inside the phosphor screen (disk ROI spans) is calculated
+    *   Candidates are found by the vectorised kernel, on the occupied tiles only, and centroided in fixed point (detect.h)
+    *   The ROI is split in bands processed in parallel by the worker pool (worker_pool.h), one buffer per band
+    *   The centroids are then pushed to the event ring (event_ring.h)
+    *   The event ring is then drained in order by the uart_transmitter thread to transmit the data to the uart port
+    *   With governor = 1 the transmitter sends fewer events, then only summaries, while the link falls behind (governor.h)
+    *   Every frame is timed from ingest to the output, stats_ms > 0 prints a periodic report (stats.h)
+    *   With background = 1 a running background is subtracted and the thresholds follow the noise (background.h),
+    *   every frame updates 1/bg_every of the model on the worker pool after detection
+    *   With calib set the bands correct the centroids for the window bias and the distortion (calib.h)
+    *   With coincidence = drop or merge the events of one photon seen in consecutive frames are removed or merged
+    *   before they leave (coincidence.h), merged events leave coinc_frames frames late
+    *   With record set the frames are also written to a sparse recording (record.h): the pixels that matter are
+    *   copied after the events have left, encoded and written by the recorder threads
+    *   With accum = 1 the centroids are also binned into the accumulated image (accum.h), snapshots are written
+    *   to disk or sent at the end of every exposure, send_events = 0 leaves only the image on the link
 */
 
-int main()
+int main(int argc, char **argv)
 {
     fprintf(stderr, "Starting script........\n");
+
+    /*  Configuration, see config.h
+        *   -c file   configuration file
+        *   -s k=v    set any configuration key
+        *   -m mode   window mode: pin, 3, 5 or 7 (default pin)
+        *   -o sink   output: serial:DEV, file:PATH, unix:PATH or udp:HOST:PORT (default serial:/dev/serial0)
+        *   -b baud   serial port speed (default 921600)
+        *   -F bytes  output batch size (default depends on the sink)
+        *   -L ms     longest time a record waits in the batch (default 10)
+        *   -e        send the energy of every event
+        *   -p        print the configuration and exit
+        *   the configuration file is read first, the other options override it
+    */
+    const char *optstring = "c:s:m:o:b:F:L:ep";
+    config_defaults(&cfg);
+    int opt;
+    while ((opt = getopt(argc, argv, optstring)) != -1)
+    {
+        if (opt == 'c' && config_load(&cfg, optarg) != 0) return 1;
+        if (opt == '?')
+        {
+            fprintf(stderr, "Usage: %s [-c file] [-s key=value] [-m pin|3|5|7] [-o sink] [-b baud] [-F bytes] [-L ms] [-e] [-p]\n", argv[0]);
+            return 1;
+        }
+    }
+    bool print_config = false;
+    int bad = 0;
+    optind = 1;
+    while ((opt = getopt(argc, argv, optstring)) != -1)
+    {
+        switch (opt)
+        {
+            case 's': bad |= config_assign(&cfg, optarg); break;
+            case 'm': bad |= config_set(&cfg, "mode", optarg); break;
+            case 'o': bad |= config_set(&cfg, "output", optarg); break;
+            case 'b': bad |= config_set(&cfg, "baud", optarg); break;
+            case 'F': bad |= config_set(&cfg, "flush_bytes", optarg); break;
+            case 'L': bad |= config_set(&cfg, "flush_ms", optarg); break;
+            case 'e': cfg.send_energy = 1; break;
+            case 'p': print_config = true; break;
+        }
+    }
+    if (bad) return 1;
+    if (print_config)
+    {
+        config_print(&cfg, stdout);
+        return 0;
+    }
+
+    //a closed socket or pipe must not kill the detector
+    signal(SIGPIPE, SIG_IGN);
+    if (output_sink_open(&sink, cfg.output, cfg.baud, cfg.flush_bytes, cfg.flush_ms) != 0)
+        return 1;
+    if (sink.flush_bytes < tx_min_batch())
+    {
+        fprintf(stderr, "Output batch of %zu bytes is too small, %zu at least\n", sink.flush_bytes, tx_min_batch());
+        return 1;
+    }
+    fprintf(stderr, "Output: %s, batches of %zu bytes, %d ms\n", cfg.output, sink.flush_bytes, sink.flush_ms);
+    tx_stamp_cap = sink.flush_bytes / proto_events_record_bytes(PROTO_F_TIME, 1) + 1;
+    tx_stamp = (long long *)malloc(sizeof(long long) * tx_stamp_cap);
+    if (tx_stamp == NULL) return 1;
   
-    int imgWidth = WIDTH;
-    int imgHeight = HEIGHT;
+    int imgWidth = cfg.width;
+    int imgHeight = cfg.height;
 
     fprintf(stderr, "Camera resolution: %d x %d\n", imgWidth, imgHeight);
 
-    FILE *fp;
-    if ((fp = fopen("/dev/stdin", "rb")) == NULL)
+    //start the reader thread on the piped input
+    struct frame_source src;
+    if (frame_source_open(&src, STDIN_FILENO, imgWidth, imgHeight, cfg.stride, cfg.rows) != 0)
     {
-        fprintf(stderr, "Cannot open input file!\n");
+        fprintf(stderr, "Cannot open input stream!\n");
+        return 1;
+    }
+    fprintf(stderr, "Frame stride: %d bytes, %d rows\n", src.stride, src.rows);
+    struct frame frame;
+    if (event_ring_init(&ring, EVENT_RING_CAPACITY) != 0)
+        return 1;
+    //the statistics report goes to stderr or to its own sink
+    struct output_sink stats_sink;
+    if (cfg.stats_output[0] != 0 && output_sink_open(&stats_sink, cfg.stats_output, cfg.baud, 0, 0) != 0)
         return 1;
+    stats_init(&stats, cfg.stats_ms, cfg.stats_output[0] != 0 ? &stats_sink : NULL);
+    if (cfg.accum)
+    {
+        if (accum_init(&accum, cfg.cenx, cfg.ceny, cfg.radius, cfg.accum_oversample, cfg.accum_bits,
+                       cfg.accum_frames, cfg.accum_path, cfg.accum_format, cfg.accum_send != 0) != 0)
+            return 1;
+        fprintf(stderr, "Accumulation: %dx%d bins of %d bit, %d frames per exposure\n",
+                accum.width, accum.height, accum.bits, cfg.accum_frames);
     }
+    if (cfg.governor)
+    {
+        //without the accumulated image on the link a summary would carry no photons
+        bool summary = cfg.accum && cfg.accum_send;
+        governor_init(&gov, cfg.gov_latency_ms, cfg.gov_decimate, cfg.gov_energy, summary ? GOV_SUMMARY : GOV_DECIMATED,
+                      sink.kind == SINK_SERIAL ? cfg.baud / 10.0 : 0, monotonic_ns());
+        fprintf(stderr, "Governor: events older than %d ms reduce the output to 1 in %d tiles%s%s\n",
+                cfg.gov_latency_ms, cfg.gov_decimate, cfg.gov_energy > 0 ? " above the energy floor" : "",
+                summary ? ", then to the accumulated image" : "");
+    }
+/*  Read the mode select pin and set the mode accordingly, unless the configuration sets it
+    *   MODE_3X3: 3x3 window mode
+    *   MODE_5X5: 5x5 window mode
+    *   MODE_7X7: 7x7 window mode, configuration only
+    *
+*/
+    wiringPiSetup();
+    if (cfg.mode == MODE_PIN)
+    {
+        pinMode(MODE_SELECT_PIN,INPUT);
+        pullUpDnControl(MODE_SELECT_PIN,PUD_UP);
+        if(digitalRead(MODE_SELECT_PIN)==LOW)     Mode_select=MODE_3X3;
+        else    Mode_select=MODE_5X5;
+    }
+    else Mode_select = cfg.mode;
+    int window = mode_window(Mode_select);
+    fprintf(stderr, "Mode: %dx%d\n", window, window);
+
+    //the record flags are fixed once the mode is known
+    struct tx_args tx;
+    tx.flags = PROTO_F_TIME | (Mode_select!=MODE_3X3 ? PROTO_F_CORNERS : 0) | (cfg.send_energy ? PROTO_F_ENERGY : 0) |
+               (cfg.calib[0] != 0 ? PROTO_F_CALIB : 0);
     int nRet = 0;
     pthread_t nThreadID1;
-    nRet = pthread_create(&nThreadID1,NULL ,uart_transmitter ,NULL);
+    nRet = pthread_create(&nThreadID1,NULL ,uart_transmitter ,&tx);
         if (nRet != 0)
         {
             printf("thread create failed.ret = %d\n",nRet);
             return 1;
         }
-    int bufLen = imgWidth * imgHeight;
-    char *buf = (char *)malloc(bufLen);
-    int count = 0;
     long long framesNumber = 0;
     long long totalTime = 0;
-    int col,row;
-/*  Read the mode select pin and set the mode accordingly
-    *   MODE_3X3: 3x3 window mode
-    *   MODE_5X5: 5x5 window mode
-    *
-*/
-    wiringPiSetup();
-    pinMode(MODE_SELECT_PIN,INPUT);
-    pullUpDnControl(MODE_SELECT_PIN,PUD_UP);
-    if(digitalRead(MODE_SELECT_PIN)==LOW)     Mode_select=MODE_3X3;
-    else    Mode_select=MODE_5X5;
-    if(Mode_select==MODE_3X3)
-        {
-            fprintf(stderr, "Mode: 3x3\n");
-            while(1)
-        {   
-                        //read the IMAGE stream form the piped input
-                        fseek(fp, -bufLen, SEEK_END);
-                        count = fread(buf, sizeof(*buf), bufLen, fp);
-                        if (count == 0)
-                        {
-                        //print zero data
-                        fprintf(stderr, "error\n");
-
-                        break;
-                        }
-                   /* 
-                    Convert the image stream to a 2D array for further processing
-                    -partial unrolling of the loop for better performance
-                    -the loop is unrolled by a factor of 8
-                    */ 
-                   
-
-
-                    int k=0;
-                        for( row=0; row < HEIGHT ;row++ )
-                            {
-                                for( col=0; col < WIDTH ; col+=8)
-                                    {
-
-                                    image[row][col] = *(buf+k);
-                                    image[row][col+1] = *(buf+k+1);
-                                    image[row][col+2] = *(buf+k+2);
-                                    image[row][col+3] = *(buf+k+3);
-                                    image[row][col+4] = *(buf+k+4);
-                                    image[row][col+5] = *(buf+k+5);
-                                    image[row][col+6] = *(buf+k+6);
-                                    image[row][col+7] = *(buf+k+7);
-                                    k=k+8;
-                                    }
-                            }
-
-                /*
-                    circular mask to remove regions outside the phosphor screen
-                */
-                        for( row=0; row < HEIGHT ;row++ )
-                            {
-                                for( col=0; col < WIDTH ; col++)
-                                    {
-                                        
-                                        if( (row-CENY)*(row-CENY) + (col-CENX)*(col-CENX) < RADIUS*RADIUS )
-                                            {
-                                            image_cv[row*WIDTH+col] = image[row][col];
-                                            }
-                                        else
-                                            {
-                                            image_cv[row*WIDTH+col] = 0;
-                                            image[row][col]=0;
-                                            }
-                                    }
-                                    
-                            }   
-                    bool over_flow;
-                    over_flow=false;
-                    //variables for centroid calculation
-                    int min,max,R1,R2,R3,C1,C2,C3;
-                    
-                        int sum;
-                        pthread_mutex_lock(&cen);
-                        for(int i=CENY-RADIUS;i<(CENY+RADIUS);i++)
-                            {
-                                    for(int j=CENX-RADIUS;j<(CENX+RADIUS);j++)
-                                    {
-
-
-                                            //REF: Photon Event Centroiding with UV Photon-counting Detectors J. B. Hutchings
-                                            sum =0;
-
-                                            //condition 1: center pixel should be greater than all the neighbouring 8 pixels 
-                                            //condition 2: center pixel should be greater than a threshold value to ignore background variation
-                                            if(image[i][j] > THRESHOLD )
-                                                {
-                                                if( image[i][j] > image[i-1][j-1] & image[i][j] > image[i-1][j] & image[i][j] > image[i-1][j+1] & image[i][j] > image[i][j-1]  & image[i][j] > image[i][j+1] & image[i][j] > image[i+1][j-1] & image[i][j] > image[i+1][j] & image[i][j] > image[i+1][j+1])
-                                                    {
-                                                    // condition 3 : Energy(sum) should be greather than a threshold
-                                                    sum   =  
-                                                            image[i-1][j-1] + image[i-1][j] + image[i-1][j+1] + 
-                                                            image[i][j-1]   + image[i][j]   + image[i][j+1]   + 
-                                                            image[i+1][j-1] + image[i+1][j] + image[i+1][j+1]  ;
-                                                    if(sum > ENERGY_THRESHOLD_3x3)
-                                                    {   
-
-                                                        ;
-                                                        R1= image[i-1][j-1] + image[i-1][j] + image[i-1][j+1] ;
-                                                    //R2= image[i][j-1]   + image[i][j]   + image[i][j+1]   ;
-                                                        R3= image[i+1][j-1] + image[i+1][j] + image[i+1][j+1] ;
-                                                    
-                                                    
-                                                        C1= image[i-1][j-1] + image[i][j-1] + image[i+1][j-1] ;
-                                                        //C2= image[i-1][j] + image[i][j] + image[i+1][j] ;
-                                                        C3= image[i-1][j+1] + image[i][j+1] + image[i+1][j+1] ;
-                                                        
-                                                        x_cen[number_of_centroids] =(float)i + (float)(C3-C1)/((float)(sum));
-                                                        y_cen[number_of_centroids] = (float)j + (float)(R3-R1)/((float)(sum));
-                                                        number_of_centroids ++ ;
-                                                    }
-                                                    }
-                                                }
-                                            else continue;
-                                            if(number_of_centroids > 100000) break;
-
-                                            }
-                                            if(number_of_centroids > 100000) 
-                                                {break;
-                                                over_flow =true;
-                                                }
-                            }
-                        pthread_mutex_unlock(&cen);
 
+    //circular mask of the phosphor screen, computed once, leaving room for the window
+    struct disk_roi roi;
+    if (disk_roi_init(&roi, cfg.cenx, cfg.ceny, cfg.radius, imgWidth, imgHeight, window / 2) != 0)
+        return 1;
+    fprintf(stderr, "ROI: %ld pixels in rows %d-%d\n", roi.pixels, roi.row_begin, roi.row_end);
+    /*  Split the ROI into bands processed in parallel by the worker pool
+        *   every core runs detection, the main thread being one of the workers
+    */
+    int n_threads = cfg.threads > 0 ? cfg.threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_threads < 1) n_threads = 1;
+    struct detect_band *bands = (struct detect_band *)malloc(sizeof(struct detect_band) * BANDS_PER_THREAD * n_threads);
+    int n_bands = detect_bands_init(bands, BANDS_PER_THREAD * n_threads, &roi);
+    struct worker_pool pool;
+    if (worker_pool_init(&pool, n_threads - 1) != 0)
+        return 1;
+    struct detect_job job;
+    job.frame = &frame;
+    job.roi = &roi;
+    job.bands = bands;
+    job.threshold = cfg.threshold;
+    job.energy_threshold = cfg.energy_threshold[Mode_select];
+    job.centroid = centroid_for_window(window);
+    job.bg = NULL;
+    job.prefilter = cfg.prefilter != 0;
+    job.calib = NULL;
+    //background model, the band edges are also the tile edges of its noise estimate
+    struct background bg;
+    struct background_job bg_job;
+    if (cfg.background)
+    {
+        if (background_init(&bg, imgWidth, imgHeight, cfg.bg_every, cfg.bg_shift, cfg.bg_nsigma, cfg.threshold,
+                            cfg.bg_hot, window / 2) != 0)
+            return 1;
+        if (cfg.hot_pixels[0] != 0 && background_load_hot(&bg, cfg.hot_pixels) != 0)
+            return 1;
+        bg_job.bg = &bg;
+        bg_job.frame = &frame;
+        bg_job.roi = &roi;
+        bg_job.bands = bands;
+        bg_job.n_bands = n_bands;
+        job.bg = &bg.maps;
+        fprintf(stderr, "Background: every pixel updated every %d frames, weight 2^-%d, threshold %d sigma and at least %d, %lu hot pixels\n",
+                cfg.bg_every, cfg.bg_shift, cfg.bg_nsigma, cfg.threshold, bg.hot_file);
+    }
+    //calibration table, applied to the centroids by the bands
+    struct calib cal;
+    if (cfg.calib[0] != 0)
+    {
+        if (calib_load(&cal, cfg.calib, window) != 0)
+            return 1;
+        job.calib = &cal.table;
+        if (cal.grid != NULL)
+            fprintf(stderr, "Calibration: %dx%d distortion grid every %d pixels", cal.table.cols, cal.table.rows, cal.step);
+        else
+            fprintf(stderr, "Calibration: no distortion grid");
+        if (cal.bias != NULL)
+            fprintf(stderr, ", %dx%d bias LUT of %d bins\n", window, window, cal.table.bins);
+        else
+            fprintf(stderr, ", no bias LUT for %dx%d\n", window, window);
+    }
+    if (cfg.coincidence != COINC_OFF)
+    {
+        if (coinc_init(&coinc, cfg.coincidence, cfg.coinc_frames, cfg.coinc_radius, cfg.cenx, cfg.ceny, cfg.radius) != 0)
+            return 1;
+        fprintf(stderr, "Coincidence: %s within %d pixels over %d frames, %dx%d cells of %d pixels\n",
+                cfg.coincidence == COINC_MERGE ? "merge" : "drop", cfg.coinc_radius, cfg.coinc_frames,
+                coinc.cols, coinc.rows, 1 << coinc.cell_shift);
+    }
+    struct recorder rec;
+    if (cfg.record[0] != 0)
+    {
+        if (cfg.record_threshold > cfg.threshold)
+            fprintf(stderr, "Recording: record_threshold %d is above threshold %d, the replay will miss events\n",
+                    cfg.record_threshold, cfg.threshold);
+        if (record_open(&rec, cfg.record, &roi, imgWidth, imgHeight, cfg.cenx, cfg.ceny, cfg.radius,
+                        cfg.record_threshold, window / 2) != 0)
+            return 1;
+        fprintf(stderr, "Recording: %s, pixels above %d and %d around them\n", cfg.record, cfg.record_threshold, window / 2);
+    }
+    fprintf(stderr, "Detection kernel: %s%s, %d threads, %d bands\n", DETECT_KERNEL,
+            job.prefilter ? " with tile prefilter" : "", n_threads, n_bands);
+    while(1)
+    {
+        //get the newest complete frame from the reader thread
+        if (!frame_source_next(&src, &frame))
+        {
+            fprintf(stderr, "End of input stream\n");
+            break;
         }
-        }
-    else 
+        long long t_start = monotonic_ns();
+        //condition 1, 2 and 3 on every band in parallel
+        worker_pool_run(&pool, detect_band_task, &job, n_bands);
+        //the transmitter finds the capture time of the events here
+        frame_stamp_put(stats.stamps, (uint32_t)frame.seq, frame.t_ingest);
+        //merged events whose window has passed leave first, in frame order
+        int n_events = 0;
+        unsigned long long duplicates = coinc.duplicates;
+        if (cfg.coincidence == COINC_MERGE)
         {
-        fprintf(stderr, "MODE 5X5\n");
-        
-        while(1)
+            int n_new = 0;
+            for (int b = 0; b < n_bands; b++) n_new += bands[b].n_events;
+            const struct event *held;
+            int n;
+            while ((n = coinc_take(&coinc, (uint32_t)frame.seq, n_new, false, &held)) > 0)
+                n_events += emit_events(held, n);
+        }
+        //hand the band buffers to the transmitter in row order, never waiting for it
+        for (int b = 0; b < n_bands; b++)
         {
-                    fseek(fp, -bufLen, SEEK_END);
-                    count = fread(buf, sizeof(*buf), bufLen, fp);
-                    if (count == 0)
-                    {
-                        //print zero data
-                        fprintf(stderr, "error\n");
-                        break;
-                    }
-
-                   /* 
-                    Convert the image stream to a 2D array for further processing
-                   */
-                int k=0;
-                    for( row=0; row < HEIGHT ;row++ )
-                        {
-                            for( col=0; col < WIDTH ; col+=8)
-                                {
-
-                                image[row][col] = *(buf+k);
-                                image[row][col+1] = *(buf+k+1);
-                                image[row][col+2] = *(buf+k+2);
-                                image[row][col+3] = *(buf+k+3);
-                                image[row][col+4] = *(buf+k+4);
-                                image[row][col+5] = *(buf+k+5);
-                                image[row][col+6] = *(buf+k+6);
-                                image[row][col+7] = *(buf+k+7);
-                                k=k+8;
-                                }
-                        }
-                /*
-                    circular mask to remove regions outside the phosphor screen
-                */
-                    for( row=0; row < HEIGHT ;row++ )
-                        {
-                            for( col=0; col < WIDTH ; col++)
-                                {
-                                     
-                                    if( (row-CENY)*(row-CENY) + (col-CENX)*(col-CENX) < RADIUS*RADIUS )
-                                        {
-                                        image_cv[row*WIDTH+col] = image[row][col];
-                                        }
-                                    else
-                                        {
-                                        image_cv[row*WIDTH+col] = 0;
-                                        image[row][col]=0;
-                                        }
-                                }
-                                
-                        }   
-                bool over_flow;
-                over_flow=false;
-                //variables for centroiding
-                int min,max,R1,R2,R3,R4,R5,C1,C2,C3,C4,C5;
-                
-                    int sum;
-                    pthread_mutex_lock(&cen);
-                    for(int i=CENY-RADIUS;i<(CENY+RADIUS);i++)
-                        {
-                                for(int j=CENX-RADIUS;j<(CENX+RADIUS);j++)
-                                {
-
-
-                                        //REF: Photon Event Centroiding with UV Photon-counting Detectors J. B. Hutchings
-                                        sum =0;
-
-                                        //condition 1: center pixel should be greater than all the neighbouring 8 pixels 
-                                        //condition 2: center pixel should be greater than a threshold value to ignore background variation
-                                        if(image[i][j] > THRESHOLD )
-                                            {
-                                            if( image[i][j] > image[i-1][j-1] & image[i][j] > image[i-1][j] & image[i][j] > image[i-1][j+1] & image[i][j] > image[i][j-1]  & image[i][j] > image[i][j+1] & image[i][j] > image[i+1][j-1] & image[i][j] > image[i+1][j] & image[i][j] > image[i+1][j+1])
-                                                {
-                                                // condition 3 : Energy(sum) should be greather than a threshold
-                                                sum   =  image[i-2][j-2] + image[i-2][j-1] + image[i-2][j] + image[i-2][j+1] + image[i-2][j+2] + 
-                                                        image[i-1][j-2] + image[i-1][j-1] + image[i-1][j] + image[i-1][j+1] + image[i-1][j+2] +
-                                                        image[i][j-2]   + image[i][j-1]   + image[i][j]   + image[i][j+1]   + image[i][j+2] + 
-                                                        image[i+1][j-2] + image[i+1][j-1] + image[i+1][j] + image[i+1][j+1] + image[i+1][j+2] +  
-                                                        image[i+2][j-2] + image[i+2][j-1] + image[i+2][j] + image[i+2][j+1] + image[i+2][j+2]  ;
-                                                if(sum > ENERGY_THRESHOLD_5x5)
-                                                {   
-
-                                                    R1= image[i-2][j-2] + image[i-2][j-1] + image[i-2][j] + image[i-2][j+1] + image[i-2][j+2];
-                                                    R2= image[i-1][j-2] + image[i-1][j-1] + image[i-1][j] + image[i-1][j+1] + image[i-1][j+2];
-                                                //  R3= image[i][j-2]   + image[i][j-1]   + image[i][j]   + image[i][j+1]   + image[i][j+2];
-                                                    R4= image[i+1][j-2] + image[i+1][j-1] + image[i+1][j] + image[i+1][j+1] + image[i+1][j+2];
-                                                    R5= image[i+2][j-2] + image[i+2][j-1] + image[i+2][j] + image[i+2][j+1] + image[i+2][j+2];
-                                                    C1= image[i-2][j-2] + image[i-1][j-2] + image[i][j-2] + image[i+1][j-2] +  image[i+2][j-2];
-                                                    C2= image[i-2][j-1] + image[i-1][j-1] + image[i][j-1] + image[i+1][j-1] + image[i+2][j-1];
-                                                // C3= image[i-2][j] + image[i-1][j] + image[i][j] + image[i+1][j] + image[i+2][j];
-                                                    C4= image[i-2][j+1] + image[i-1][j+1] + image[i][j+1] + image[i+1][j+1] + image[i+2][j+1];
-                                                    C5= image[i-2][j+2] + image[i-1][j+2] + image[i][j+2] + image[i+1][j+2] + image[i+2][j+2];
-                                                    x_cen[number_of_centroids] =(float)i + (float)(2*C5+C4-C2-2*C1)/((float)(sum));
-                                                    y_cen[number_of_centroids] = (float)j + (float)(2*R5+R4-R2-2*R1)/((float)(sum));
-                                                    //calculate the minima and maxima value of 4 corner pixels
-                                                    min = image[i-2][j-2];
-                                                    max = image[i-2][j-2];
-                                                    if(image[i-2][j+2] < min) min = image[i-2][j+2];
-                                                    if(image[i-2][j+2] > max) max = image[i-2][j+2];
-                                                    if(image[i+2][j-2] < min) min = image[i+2][j-2];
-                                                    if(image[i+2][j-2] > max) max = image[i+2][j-2];
-                                                    if(image[i+2][j+2] < min) min = image[i+2][j+2];
-                                                    if(image[i+2][j+2] > max) max = image[i+2][j+2];
-                                                    c_min[number_of_centroids] = min;
-                                                    c_max[number_of_centroids] = max;
-                                                    number_of_centroids ++ ;
-                                                }
-                                                }
-                                            }
-                                        else continue;
-                                        if(number_of_centroids > 100000) break;
-
-                                        }
-                                        if(number_of_centroids > 100000) 
-                                            {break;
-                                            over_flow =true;
-                                            }
-                        }
-                    pthread_mutex_unlock(&cen);
-
-          }
-
+            if (cfg.coincidence != COINC_OFF)
+                bands[b].n_events = coinc_filter(&coinc, bands[b].events, bands[b].n_events, (uint32_t)frame.seq);
+            n_events += emit_events(bands[b].events, bands[b].n_events);
         }
+        if (cfg.accum && accum_frame(&accum, frame.seq) && accum.send) wake_transmitter();
+        long long t_done = monotonic_ns();
+        stats_frame(&stats, &frame, t_start, t_done, n_events, (int)(coinc.duplicates - duplicates));
+        //the events are on their way, the update only delays the next frame
+        if (cfg.background) background_frame(&bg_job, &pool);
+        if (cfg.record[0] != 0) record_frame(&rec, &frame);
+        framesNumber++;
+        totalTime += monotonic_ns() - t_start;
+        stats_report(&stats, &src, &ring, &sink, false);
+    }
+    //merged events still held
+    if (cfg.coincidence == COINC_MERGE)
+    {
+        const struct event *held;
+        int n;
+        while ((n = coinc_take(&coinc, 0, 0, true, &held)) > 0) emit_events(held, n);
+    }
+    //the partial exposure is a snapshot too
+    if (cfg.accum) accum_finish(&accum);
+    //let the transmitter send what is left
+    tx_stop.store(true);
+    wake_transmitter();
+    pthread_join(nThreadID1, NULL);
+    output_sink_close(&sink);
+    frame_source_report(&src);
+    fprintf(stderr, "Events: produced %lu, sent %lu, dropped %lu\n",
+            ring.produced.load(), ring.sent.load(), ring.dropped.load());
+    if (cfg.governor)
+        fprintf(stderr, "Governor: %llu level changes, %llu events withheld, frames sent full %llu, decimated %llu, summary %llu\n",
+                gov.changes, gov.withheld_total, gov.frames[GOV_FULL], gov.frames[GOV_DECIMATED], gov.frames[GOV_SUMMARY]);
+    if (framesNumber > 0)
+        fprintf(stderr, "Processing: %lld frames, %.3f ms per frame\n", framesNumber, totalTime * 1e-6 / framesNumber);
+    stats_summary(&stats, stderr);
+    if (cfg.stats_output[0] != 0) output_sink_close(&stats_sink);
+    if (cfg.accum)
+    {
+        accum_free(&accum);
+        fprintf(stderr, "Accumulation: %u exposures, %lu written, %lu sent, %lu write errors, %llu late frames\n",
+                accum.exposures, accum.written.load(), accum.sent.load(), accum.write_errors.load(), accum.late_frames);
+    }
+    if (cfg.background)
+    {
+        fprintf(stderr, "Background: %llu updates, noise %.2f DN, hot pixels %lu from the file, %lu above bg_hot\n",
+                bg.frames / bg.every, background_noise(&bg, &roi), bg.hot_file, bg.hot_auto.load());
+        background_free(&bg);
+    }
+    if (cfg.record[0] != 0)
+    {
+        record_close(&rec);
+        fprintf(stderr, "Recording: %llu frames, %.1f kB per frame, %llu dropped, %lu write errors\n", rec.frames,
+                rec.frames > 0 ? rec.bytes / 1000.0 / rec.frames : 0.0, rec.dropped.load(), rec.write_errors.load());
+    }
+    if (cfg.coincidence != COINC_OFF)
+    {
+        fprintf(stderr, "Coincidence: %llu duplicates, %llu merged events sent early\n", coinc.duplicates, coinc.early);
+        coinc_free(&coinc);
+    }
+    if (cfg.calib[0] != 0) calib_free(&cal);
+    frame_source_close(&src);
+    worker_pool_free(&pool);
+    detect_bands_free(bands, n_bands);
+    free(bands);
+    free(tx_stamp);
+    disk_roi_free(&roi);
     return 0;
 
 }
@@ -0,0 +1,335 @@
+/*
+ * Output sinks
+ * -----------------------
+ *   Destination of the event stream, selected with a sink specification:
+ *       serial:/dev/serial0     serial port in raw mode at the configured baud rate
+ *       file:/path/to/file      regular file, FIFO or pty (file:- is stdout)
+ *       unix:/path/to/socket    Unix domain stream socket, reconnected when the listener restarts
+ *       udp:host:port           UDP datagrams
+ *
+ *   Writes are batched: records are queued as iovecs and sent with one writev()
+ *   when flush_bytes would be exceeded or when the oldest queued byte is older
+ *   than flush_ms. Small records are copied into a staging buffer owned by the
+ *   sink (output_sink_reserve/commit); large blocks can be queued by reference
+ *   (output_sink_queue) and must then stay valid until the next flush.
+ *   For UDP every flush is one datagram, so flush_bytes should fit the path MTU.
+ */
+
+#ifndef OUTPUT_SINK_H
+#define OUTPUT_SINK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <netdb.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdint.h>
+#include <atomic>
+
+#include "frame_source.h"
+
+#define SINK_SERIAL 0
+#define SINK_FILE   1
+#define SINK_UNIX   2
+#define SINK_UDP    3
+
+#define SINK_MAX_IOV 64
+//Seconds between reconnection attempts of a Unix socket sink
+#define SINK_RECONNECT_S 1
+
+struct output_sink
+{
+    int kind;
+    int fd;
+    char target[256];               //device, path or host:port
+    int baud;                       //serial only
+
+    //batching
+    size_t flush_bytes;             //flush before the queue grows beyond this size
+    int flush_ms;                   //flush when the oldest queued byte is older than this
+    struct iovec iov[SINK_MAX_IOV];
+    int n_iov;
+    size_t pending;                 //bytes queued
+    long long oldest_ns;            //time the first pending byte was queued
+    uint8_t *stage;                 //staging buffer of flush_bytes
+    size_t stage_used;
+
+    //statistics
+    std::atomic<unsigned long long> bytes_written;  //read by the statistics report
+    unsigned long long writes;
+    unsigned long long flushes;     //batches handed to writev()
+    unsigned long long bytes_lost;  //bytes discarded after write errors
+    time_t last_connect;
+};
+
+//Map a baud rate to its termios constant, 0 if unsupported
+static inline speed_t baud_to_speed(int baud)
+{
+    switch (baud)
+    {
+        case 9600: return B9600;
+        case 19200: return B19200;
+        case 38400: return B38400;
+        case 57600: return B57600;
+        case 115200: return B115200;
+        case 230400: return B230400;
+        case 460800: return B460800;
+        case 500000: return B500000;
+        case 921600: return B921600;
+        case 1000000: return B1000000;
+        case 1500000: return B1500000;
+        case 2000000: return B2000000;
+        case 3000000: return B3000000;
+        default: return 0;
+    }
+}
+
+//Default batch size of each kind of sink
+static inline size_t sink_default_flush_bytes(int kind)
+{
+    switch (kind)
+    {
+        case SINK_SERIAL: return 4096;
+        case SINK_UDP: return 1400;
+        default: return 65536;
+    }
+}
+
+//(Re)open the descriptor of the sink, returns 0 on success
+static inline int output_sink_connect(struct output_sink *sink)
+{
+    sink->last_connect = time(NULL);
+    switch (sink->kind)
+    {
+        case SINK_SERIAL:
+        {
+            //raw 8 bit so that binary records pass unchanged
+            sink->fd = open(sink->target, O_RDWR | O_NOCTTY);
+            if (sink->fd < 0) break;
+            struct termios options;
+            tcgetattr(sink->fd, &options);
+            cfmakeraw(&options);
+            cfsetispeed(&options, baud_to_speed(sink->baud));
+            cfsetospeed(&options, baud_to_speed(sink->baud));
+            tcsetattr(sink->fd, TCSANOW, &options);
+            break;
+        }
+        case SINK_FILE:
+            if (strcmp(sink->target, "-") == 0) sink->fd = dup(STDOUT_FILENO);
+            else sink->fd = open(sink->target, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            break;
+        case SINK_UNIX:
+        {
+            struct sockaddr_un addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sun_family = AF_UNIX;
+            size_t len = strlen(sink->target);
+            if (len >= sizeof(addr.sun_path)) break;
+            memcpy(addr.sun_path, sink->target, len + 1);
+            sink->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (sink->fd >= 0 && connect(sink->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+            {
+                close(sink->fd);
+                sink->fd = -1;
+            }
+            break;
+        }
+        case SINK_UDP:
+        {
+            char host[256];
+            snprintf(host, sizeof(host), "%s", sink->target);
+            char *port = strrchr(host, ':');
+            if (port == NULL) break;
+            *port++ = 0;
+            struct addrinfo hints, *res;
+            memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_DGRAM;
+            if (getaddrinfo(host, port, &hints, &res) != 0) break;
+            sink->fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+            if (sink->fd >= 0 && connect(sink->fd, res->ai_addr, res->ai_addrlen) != 0)
+            {
+                close(sink->fd);
+                sink->fd = -1;
+            }
+            freeaddrinfo(res);
+            break;
+        }
+    }
+    return sink->fd >= 0 ? 0 : -1;
+}
+
+/*
+ * Open a sink from its specification (see above).
+ * flush_bytes of 0 selects the default of the sink kind.
+ * Returns 0 on success.
+ */
+static inline int output_sink_open(struct output_sink *sink, const char *spec, int baud, size_t flush_bytes, int flush_ms)
+{
+    memset((void *)sink, 0, sizeof(*sink));
+    sink->bytes_written.store(0);
+    sink->fd = -1;
+    const char *colon = strchr(spec, ':');
+    if (colon == NULL)
+    {
+        fprintf(stderr, "output: bad sink \"%s\", expected serial:, file:, unix: or udp:\n", spec);
+        return -1;
+    }
+    size_t n = colon - spec;
+    if (n == 6 && strncmp(spec, "serial", n) == 0) sink->kind = SINK_SERIAL;
+    else if (n == 4 && strncmp(spec, "file", n) == 0) sink->kind = SINK_FILE;
+    else if (n == 4 && strncmp(spec, "unix", n) == 0) sink->kind = SINK_UNIX;
+    else if (n == 3 && strncmp(spec, "udp", n) == 0) sink->kind = SINK_UDP;
+    else
+    {
+        fprintf(stderr, "output: unknown sink type in \"%s\"\n", spec);
+        return -1;
+    }
+    snprintf(sink->target, sizeof(sink->target), "%s", colon + 1);
+    sink->baud = baud;
+    if (sink->kind == SINK_SERIAL && baud_to_speed(baud) == 0)
+    {
+        fprintf(stderr, "output: unsupported baud rate %d\n", baud);
+        return -1;
+    }
+    sink->flush_bytes = flush_bytes > 0 ? flush_bytes : sink_default_flush_bytes(sink->kind);
+    sink->flush_ms = flush_ms;
+    sink->stage = (uint8_t *)malloc(sink->flush_bytes);
+    if (sink->stage == NULL) return -1;
+    if (output_sink_connect(sink) != 0)
+    {
+        perror(spec);
+        //a Unix socket listener may come up later, the other kinds must open now
+        if (sink->kind != SINK_UNIX) return -1;
+    }
+    return 0;
+}
+
+//Send everything queued with one writev()
+static inline void output_sink_flush(struct output_sink *sink)
+{
+    if (sink->n_iov == 0) return;
+    if (sink->fd < 0 && sink->kind == SINK_UNIX && time(NULL) - sink->last_connect >= SINK_RECONNECT_S)
+        output_sink_connect(sink);
+
+    struct iovec *iov = sink->iov;
+    int n_iov = sink->n_iov;
+    size_t left = sink->pending;
+    while (sink->fd >= 0 && left > 0)
+    {
+        ssize_t w = writev(sink->fd, iov, n_iov);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0)
+        {
+            //the listener went away, drop the batch and reconnect on a later flush
+            if (sink->kind == SINK_UNIX)
+            {
+                close(sink->fd);
+                sink->fd = -1;
+            }
+            break;
+        }
+        sink->writes++;
+        sink->bytes_written.fetch_add((size_t)w, std::memory_order_relaxed);
+        left -= (size_t)w;
+        //skip what was written, datagrams are sent whole
+        while (w > 0 && n_iov > 0)
+        {
+            if ((size_t)w >= iov->iov_len)
+            {
+                w -= iov->iov_len;
+                iov++;
+                n_iov--;
+            }
+            else
+            {
+                iov->iov_base = (uint8_t *)iov->iov_base + w;
+                iov->iov_len -= w;
+                w = 0;
+            }
+        }
+    }
+    sink->bytes_lost += left;
+    sink->flushes++;
+    sink->n_iov = 0;
+    sink->pending = 0;
+    sink->stage_used = 0;
+}
+
+static inline void output_sink_note_queued(struct output_sink *sink, size_t n)
+{
+    if (sink->pending == 0) sink->oldest_ns = monotonic_ns();
+    sink->pending += n;
+}
+
+/*
+ * Queue n bytes at p by reference, p must stay valid until the next flush.
+ * Flushes first when the batch would grow beyond flush_bytes.
+ */
+static inline void output_sink_queue(struct output_sink *sink, const void *p, size_t n)
+{
+    if (n == 0) return;
+    if (sink->pending + n > sink->flush_bytes || sink->n_iov == SINK_MAX_IOV)
+        output_sink_flush(sink);
+    sink->iov[sink->n_iov].iov_base = (void *)p;
+    sink->iov[sink->n_iov].iov_len = n;
+    sink->n_iov++;
+    output_sink_note_queued(sink, n);
+}
+
+/*
+ * Return room for n bytes in the staging buffer, n <= flush_bytes.
+ * The bytes are queued by output_sink_commit().
+ */
+static inline uint8_t* output_sink_reserve(struct output_sink *sink, size_t n)
+{
+    if (n > sink->flush_bytes)
+    {
+        //main checks the batch size against every record type, this is a bug
+        fprintf(stderr, "Record of %zu bytes does not fit the %zu byte output batch\n", n, sink->flush_bytes);
+        abort();
+    }
+    if (sink->pending + n > sink->flush_bytes || sink->stage_used + n > sink->flush_bytes || sink->n_iov == SINK_MAX_IOV)
+        output_sink_flush(sink);
+    return sink->stage + sink->stage_used;
+}
+
+static inline void output_sink_commit(struct output_sink *sink, size_t n)
+{
+    uint8_t *p = sink->stage + sink->stage_used;
+    struct iovec *last = sink->n_iov > 0 ? &sink->iov[sink->n_iov - 1] : NULL;
+    //records staged back to back share one iovec
+    if (last != NULL && (uint8_t *)last->iov_base + last->iov_len == p) last->iov_len += n;
+    else
+    {
+        sink->iov[sink->n_iov].iov_base = p;
+        sink->iov[sink->n_iov].iov_len = n;
+        sink->n_iov++;
+    }
+    sink->stage_used += n;
+    output_sink_note_queued(sink, n);
+}
+
+//Flush when the oldest queued byte has waited flush_ms
+static inline void output_sink_poll(struct output_sink *sink)
+{
+    if (sink->pending > 0 && monotonic_ns() - sink->oldest_ns >= (long long)sink->flush_ms * 1000000LL)
+        output_sink_flush(sink);
+}
+
+static inline void output_sink_close(struct output_sink *sink)
+{
+    output_sink_flush(sink);
+    if (sink->fd >= 0) close(sink->fd);
+    sink->fd = -1;
+    free(sink->stage);
+}
+
+#endif
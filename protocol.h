@@ -0,0 +1,373 @@
+/*
+ * Serial event protocol
+ * -----------------------
+ *   Events are sent in binary records, one record per frame (or several when a
+ *   frame has more events than fit in one record). All fields are little endian.
+ *
+ *     offset  size  field
+ *     0       2     sync word 0xEB 0x90
+ *     2       1     record type (PROTO_EVENTS)
+ *     3       1     flags, PROTO_F_* fields present in every event
+ *                   (PROTO_F_CALIB: x and y are corrected with a calibration table)
+ *     4       4     frame number
+ *     8       2     payload length in bytes
+ *     10      n     payload
+ *     10+n    2     CRC-16/CCITT (poly 0x1021, init 0xFFFF) of bytes 2 .. 10+n-1
+ *
+ *   PROTO_EVENTS payload
+ *     8 bytes  capture time of the frame, ns of CLOCK_MONOTONIC on the Pi   (PROTO_F_TIME)
+ *   then one entry per event:
+ *     5 bytes  x and y in 1/256 pixel, 20 bits each: bits 0-19 x, bits 20-39 y
+ *     2 bytes  corner maxima and minima            (PROTO_F_CORNERS)
+ *     2 bytes  energy, sum of the window           (PROTO_F_ENERGY)
+ *
+ *   PROTO_IMAGE payload, a run of bins of one row of an accumulated image (accum.h),
+ *   the frame number of the record is the exposure number:
+ *     2 bytes  row
+ *     2 bytes  first column of the run
+ *     2 bytes  image width in bins
+ *     2 bytes  image height in bins
+ *     2 bytes  x of the left edge of the image in pixels
+ *     2 bytes  y of the top edge of the image in pixels
+ *     1 byte   oversampling, bins per pixel
+ *     1 byte   reserved, 0
+ *     4 bytes  first frame of the exposure
+ *     4 bytes  frames spanned by the exposure
+ *     n*2      bins, n*4 with PROTO_F_WIDE
+ *   Bins not covered by any record of an exposure are 0.
+ *
+ *   PROTO_LEVEL payload, the output level of the governor (governor.h) from the frame
+ *   of the record on, sent when the level changes and every second below full output:
+ *     1 byte   level: 0 every event, 1 decimated, 2 summary (no events)
+ *     1 byte   decimation n: at level 1 an event is sent when
+ *              (x/16 + y/16 + frame) % n == 0, x, y in pixels, so every tile is seen
+ *              one frame in n
+ *     2 bytes  energy floor at level 1, events below it are not sent, 0 for none
+ *     4 bytes  frames since the previous PROTO_LEVEL record
+ *     4 bytes  events of those frames that were not sent
+ *
+ *   A decoder that loses sync searches for the next sync word whose record has a
+ *   valid CRC. Records of unknown type are skipped using the payload length.
+ */
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "detect.h"
+
+#define PROTO_SYNC0 0xEB
+#define PROTO_SYNC1 0x90
+#define PROTO_HEADER_BYTES 10
+#define PROTO_CRC_BYTES 2
+#define PROTO_MAX_PAYLOAD 65535
+
+//Record types
+#define PROTO_EVENTS 1
+#define PROTO_IMAGE  2
+#define PROTO_LEVEL  3
+
+//Event flags
+#define PROTO_F_CORNERS 0x01
+#define PROTO_F_ENERGY  0x02
+#define PROTO_F_TIME    0x08
+#define PROTO_F_CALIB   0x10
+//Image flags
+#define PROTO_F_WIDE    0x04
+
+#define PROTO_IMAGE_HEADER 22
+#define PROTO_LEVEL_BYTES 12
+//Tiles of the decimated level, 16x16 pixels
+#define PROTO_LEVEL_TILE_SHIFT 4
+
+//Coordinates are packed in 20 bits
+#define PROTO_COORD_MAX ((1 << 20) - 1)
+
+static inline uint16_t proto_crc16(const uint8_t *p, size_t n)
+{
+    uint16_t crc = 0xFFFF;
+    while (n--)
+    {
+        crc ^= (uint16_t)(*p++) << 8;
+        for (int b = 0; b < 8; b++)
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+    }
+    return crc;
+}
+
+static inline int proto_event_bytes(int flags)
+{
+    return 5 + ((flags & PROTO_F_CORNERS) ? 2 : 0) + ((flags & PROTO_F_ENERGY) ? 2 : 0);
+}
+
+static inline void proto_put16(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static inline void proto_put32(uint8_t *p, uint32_t v)
+{
+    proto_put16(p, v);
+    proto_put16(p + 2, v >> 16);
+}
+
+static inline uint32_t proto_get16(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8);
+}
+
+static inline uint32_t proto_get32(const uint8_t *p)
+{
+    return proto_get16(p) | (proto_get16(p + 2) << 16);
+}
+
+//Bytes of a PROTO_EVENTS payload before the first event
+static inline int proto_events_prefix(int flags)
+{
+    return (flags & PROTO_F_TIME) ? 8 : 0;
+}
+
+//Largest number of events a record with these flags can carry
+static inline int proto_max_events(int flags)
+{
+    return (PROTO_MAX_PAYLOAD - proto_events_prefix(flags)) / proto_event_bytes(flags);
+}
+
+//Size of a PROTO_EVENTS record of n events
+static inline size_t proto_events_record_bytes(int flags, int n)
+{
+    return PROTO_HEADER_BYTES + proto_events_prefix(flags) + (size_t)n * proto_event_bytes(flags) + PROTO_CRC_BYTES;
+}
+
+/*
+ * Write the header and CRC around a payload already placed at buf+PROTO_HEADER_BYTES.
+ * Returns the size of the complete record.
+ */
+static inline size_t proto_seal(uint8_t *buf, int type, int flags, uint32_t frame, size_t payload)
+{
+    buf[0] = PROTO_SYNC0;
+    buf[1] = PROTO_SYNC1;
+    buf[2] = (uint8_t)type;
+    buf[3] = (uint8_t)flags;
+    proto_put32(buf + 4, frame);
+    proto_put16(buf + 8, (uint32_t)payload);
+    proto_put16(buf + PROTO_HEADER_BYTES + payload, proto_crc16(buf + 2, PROTO_HEADER_BYTES - 2 + payload));
+    return PROTO_HEADER_BYTES + payload + PROTO_CRC_BYTES;
+}
+
+/*
+ * Encode n events of one frame, captured at time_ns, as a PROTO_EVENTS record.
+ * n must not exceed proto_max_events(flags) and buf must hold
+ * proto_events_record_bytes(flags, n) bytes.
+ * Returns the size of the record.
+ */
+static inline size_t proto_encode_events(uint8_t *buf, uint32_t frame, uint64_t time_ns, int flags, const struct event *ev, int n)
+{
+    uint8_t *p = buf + PROTO_HEADER_BYTES;
+    if (flags & PROTO_F_TIME)
+    {
+        proto_put32(p, (uint32_t)time_ns);
+        proto_put32(p + 4, (uint32_t)(time_ns >> 32));
+        p += 8;
+    }
+    for (int e = 0; e < n; e++)
+    {
+        uint32_t x = ev[e].x < 0 ? 0 : (ev[e].x > PROTO_COORD_MAX ? PROTO_COORD_MAX : (uint32_t)ev[e].x);
+        uint32_t y = ev[e].y < 0 ? 0 : (ev[e].y > PROTO_COORD_MAX ? PROTO_COORD_MAX : (uint32_t)ev[e].y);
+        uint64_t xy = (uint64_t)x | ((uint64_t)y << 20);
+        for (int b = 0; b < 5; b++) *p++ = (uint8_t)(xy >> (8 * b));
+        if (flags & PROTO_F_CORNERS)
+        {
+            *p++ = ev[e].c_max;
+            *p++ = ev[e].c_min;
+        }
+        if (flags & PROTO_F_ENERGY)
+        {
+            proto_put16(p, ev[e].sum);
+            p += 2;
+        }
+    }
+    return proto_seal(buf, PROTO_EVENTS, flags, frame, p - (buf + PROTO_HEADER_BYTES));
+}
+
+//Number of events in a PROTO_EVENTS payload of length bytes
+static inline int proto_events_count(size_t length, int flags)
+{
+    if (length < (size_t)proto_events_prefix(flags)) return 0;
+    return (int)((length - proto_events_prefix(flags)) / proto_event_bytes(flags));
+}
+
+//Capture time of a PROTO_EVENTS payload, 0 when not sent
+static inline uint64_t proto_events_time(const uint8_t *payload, int flags)
+{
+    if (!(flags & PROTO_F_TIME)) return 0;
+    return proto_get32(payload) | ((uint64_t)proto_get32(payload + 4) << 32);
+}
+
+//Decode event e of a PROTO_EVENTS payload
+static inline void proto_decode_event(const uint8_t *payload, int flags, int e, uint32_t frame, struct event *ev)
+{
+    const uint8_t *p = payload + proto_events_prefix(flags) + (size_t)e * proto_event_bytes(flags);
+    uint64_t xy = 0;
+    for (int b = 0; b < 5; b++) xy |= (uint64_t)p[b] << (8 * b);
+    p += 5;
+    ev->frame = frame;
+    ev->x = (int32_t)(xy & PROTO_COORD_MAX);
+    ev->y = (int32_t)((xy >> 20) & PROTO_COORD_MAX);
+    ev->c_max = ev->c_min = 0;
+    ev->sum = 0;
+    if (flags & PROTO_F_CORNERS)
+    {
+        ev->c_max = p[0];
+        ev->c_min = p[1];
+        p += 2;
+    }
+    if (flags & PROTO_F_ENERGY) ev->sum = (uint16_t)proto_get16(p);
+}
+
+//Header of a PROTO_IMAGE record
+struct proto_image_run
+{
+    int row, col, n;                //n bins starting at (row, col)
+    int width, height;
+    int x0, y0;
+    int oversample;
+    uint32_t frame0, n_frames;
+    const uint8_t *bins;
+};
+
+//Write the PROTO_IMAGE header of run to the start of a payload
+static inline void proto_put_image_run(uint8_t *p, const struct proto_image_run *run)
+{
+    proto_put16(p, run->row);
+    proto_put16(p + 2, run->col);
+    proto_put16(p + 4, run->width);
+    proto_put16(p + 6, run->height);
+    proto_put16(p + 8, run->x0);
+    proto_put16(p + 10, run->y0);
+    p[12] = (uint8_t)run->oversample;
+    p[13] = 0;
+    proto_put32(p + 14, run->frame0);
+    proto_put32(p + 18, run->n_frames);
+}
+
+/*
+ * Parse a PROTO_IMAGE payload.
+ * Returns false when the run does not fit the image it describes.
+ */
+static inline bool proto_get_image_run(const uint8_t *payload, size_t length, int flags, struct proto_image_run *run)
+{
+    if (length < PROTO_IMAGE_HEADER) return false;
+    run->row = (int)proto_get16(payload);
+    run->col = (int)proto_get16(payload + 2);
+    run->width = (int)proto_get16(payload + 4);
+    run->height = (int)proto_get16(payload + 6);
+    run->x0 = (int)proto_get16(payload + 8);
+    run->y0 = (int)proto_get16(payload + 10);
+    run->oversample = payload[12];
+    run->frame0 = proto_get32(payload + 14);
+    run->n_frames = proto_get32(payload + 18);
+    run->n = (int)((length - PROTO_IMAGE_HEADER) / ((flags & PROTO_F_WIDE) ? 4 : 2));
+    run->bins = payload + PROTO_IMAGE_HEADER;
+    return run->row < run->height && run->col + run->n <= run->width;
+}
+
+//Bin k of a parsed run
+static inline uint32_t proto_image_bin(const struct proto_image_run *run, int flags, int k)
+{
+    return (flags & PROTO_F_WIDE) ? proto_get32(run->bins + 4 * k) : proto_get16(run->bins + 2 * k);
+}
+
+//Payload of a PROTO_LEVEL record
+struct proto_level
+{
+    int level;
+    int decimate;
+    int energy;
+    uint32_t n_frames;
+    uint32_t withheld;
+};
+
+//Size of a PROTO_LEVEL record
+static inline size_t proto_level_record_bytes(void)
+{
+    return PROTO_HEADER_BYTES + PROTO_LEVEL_BYTES + PROTO_CRC_BYTES;
+}
+
+//Encode a PROTO_LEVEL record into proto_level_record_bytes() bytes, returns its size
+static inline size_t proto_encode_level(uint8_t *buf, uint32_t frame, const struct proto_level *lv)
+{
+    uint8_t *p = buf + PROTO_HEADER_BYTES;
+    p[0] = (uint8_t)lv->level;
+    p[1] = (uint8_t)lv->decimate;
+    proto_put16(p + 2, (uint32_t)lv->energy);
+    proto_put32(p + 4, lv->n_frames);
+    proto_put32(p + 8, lv->withheld);
+    return proto_seal(buf, PROTO_LEVEL, 0, frame, PROTO_LEVEL_BYTES);
+}
+
+static inline bool proto_get_level(const uint8_t *payload, size_t length, struct proto_level *lv)
+{
+    if (length < PROTO_LEVEL_BYTES) return false;
+    lv->level = payload[0];
+    lv->decimate = payload[1];
+    lv->energy = (int)proto_get16(payload + 2);
+    lv->n_frames = proto_get32(payload + 4);
+    lv->withheld = proto_get32(payload + 8);
+    return true;
+}
+
+//A record located in a byte stream by proto_parse
+struct proto_record
+{
+    int type;
+    int flags;
+    uint32_t frame;
+    const uint8_t *payload;
+    size_t length;
+};
+
+/*
+ * Look for the first valid record in buf[0..n).
+ * Returns the number of bytes consumed:
+ *   - skipped garbage plus the record when one was found (rec is filled, *found set)
+ *   - only the bytes that cannot start a record when more input is needed
+ */
+static inline size_t proto_parse(const uint8_t *buf, size_t n, struct proto_record *rec, bool *found, unsigned long *crc_errors)
+{
+    size_t i = 0;
+    *found = false;
+    while (i + 1 < n)
+    {
+        if (buf[i] != PROTO_SYNC0 || buf[i + 1] != PROTO_SYNC1)
+        {
+            i++;
+            continue;
+        }
+        if (n - i < PROTO_HEADER_BYTES) return i;
+        size_t length = proto_get16(buf + i + 8);
+        size_t total = PROTO_HEADER_BYTES + length + PROTO_CRC_BYTES;
+        if (n - i < total) return i;
+        const uint8_t *r = buf + i;
+        if (proto_crc16(r + 2, PROTO_HEADER_BYTES - 2 + length) != proto_get16(r + PROTO_HEADER_BYTES + length))
+        {
+            //not a record or a corrupted one, resynchronise on the next byte
+            if (crc_errors) (*crc_errors)++;
+            i++;
+            continue;
+        }
+        rec->type = r[2];
+        rec->flags = r[3];
+        rec->frame = proto_get32(r + 4);
+        rec->payload = r + PROTO_HEADER_BYTES;
+        rec->length = length;
+        *found = true;
+        return i + total;
+    }
+    return i;
+}
+
+#endif
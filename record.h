@@ -0,0 +1,765 @@
+/*
+ * Sparse frame recording
+ * -----------------------
+ *   Keeps the raw data of a run at a small fraction of the 27 MB/s of the luma
+ *   stream: only the pixels of the disk above record_threshold are stored, with
+ *   every pixel within halo rows and columns of them, so that the windows of all
+ *   candidates are complete.
+ *
+ *   Rebuilt frames hold 0 everywhere else. With record_threshold <= threshold and
+ *   the halo of the largest window in use, replaying them finds exactly the events
+ *   of the live run (condition 2 is tested on stored pixels, conditions 1 and 3
+ *   only read pixels within the halo). The background model sees the zeros, so
+ *   runs with background = 1 replay with background = 0.
+ *
+ *   File, little endian:
+ *       header      "PCRC", version, width, height, cenx, ceny, radius, threshold, halo
+ *       frames      frame header and payload of every recorded frame
+ *       index       seq and file offset of every frame, 16 bytes each
+ *       trailer     "PCRX", frames in the index, offset of the index
+ *   The index and the trailer are written when the recording is closed, a file cut
+ *   short is read frame after frame up to the last complete one.
+ *
+ *   Frame: "PCRF", payload bytes, seq, t_ingest, then for every row with pixels
+ *       varint  rows skipped since the previous row (the first from row 0)
+ *       varint  runs
+ *       runs    varint columns skipped since the end of the previous run (the first
+ *               from column 0), varint length, the pixels
+ *
+ *   After the events of a frame have left, the detector copies the pixels the
+ *   encoder reads (the word aligned ROI spans widened by the halo, a few 100 kB)
+ *   into one of RECORD_RAW_SLOTS raw slots. The encoder thread encodes them and
+ *   fills RECORD_BLOCKS aligned blocks of RECORD_BLOCK_BYTES, written whole by the
+ *   writer thread. A frame is not recorded when no raw slot is free or when it does
+ *   not fit in the free blocks, the detector never waits for the encoder or the card.
+ */
+
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <atomic>
+
+#include "frame_source.h"
+#include "roi.h"
+#include "protocol.h"
+
+//Recordings pass 2 GiB in minutes, 32 bit targets need -D_FILE_OFFSET_BITS=64 (makefile)
+static_assert(sizeof(off_t) >= 8, "record.h needs a 64 bit off_t, build with -D_FILE_OFFSET_BITS=64");
+
+#define RECORD_MAGIC 0x43524350u          //"PCRC"
+#define RECORD_FRAME_MAGIC 0x46524350u    //"PCRF"
+#define RECORD_TRAILER_MAGIC 0x58524350u  //"PCRX"
+#define RECORD_VERSION 1
+#define RECORD_HEADER_BYTES 32
+#define RECORD_FRAME_HEADER_BYTES 24
+#define RECORD_TRAILER_BYTES 16
+//Largest halo, the window of a 15x15 mode
+#define RECORD_MAX_HALO 7
+
+//Write blocks, a multiple of the erase block of most SD cards
+#define RECORD_BLOCK_BYTES (1 << 20)
+#define RECORD_BLOCKS 8
+#define RECORD_ALIGN 4096
+//Frames copied by the detector and waiting for the encoder
+#define RECORD_RAW_SLOTS 4
+
+struct record_header
+{
+    int width, height;
+    int cenx, ceny, radius;
+    int threshold;
+    int halo;
+};
+
+static inline void record_put64(uint8_t *p, uint64_t v)
+{
+    proto_put32(p, (uint32_t)v);
+    proto_put32(p + 4, (uint32_t)(v >> 32));
+}
+
+static inline uint64_t record_get64(const uint8_t *p)
+{
+    return proto_get32(p) | ((uint64_t)proto_get32(p + 4) << 32);
+}
+
+static inline uint8_t* record_put_varint(uint8_t *p, uint32_t v)
+{
+    while (v >= 0x80)
+    {
+        *p++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+//NULL when the varint runs past end
+static inline const uint8_t* record_get_varint(const uint8_t *p, const uint8_t *end, uint32_t *v)
+{
+    *v = 0;
+    for (int shift = 0; p < end && shift < 32; shift += 7)
+    {
+        uint8_t b = *p++;
+        *v |= (uint32_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) return p;
+    }
+    return NULL;
+}
+
+//Rows that can hold stored pixels
+static inline void record_rows(const struct record_header *h, const struct disk_roi *roi, int *r0, int *r1)
+{
+    *r0 = roi->row_begin - h->halo > 0 ? roi->row_begin - h->halo : 0;
+    *r1 = roi->row_end + h->halo < h->height ? roi->row_end + h->halo : h->height;
+}
+
+//Largest encoded frame: every row with runs of one pixel and one gap
+static inline size_t record_frame_bound(const struct record_header *h, const struct disk_roi *roi)
+{
+    int r0, r1;
+    record_rows(h, roi, &r0, &r1);
+    return RECORD_FRAME_HEADER_BYTES + (size_t)(r1 - r0) * (10 + 3 * (size_t)h->width + 8);
+}
+
+//Bytes of the word w above t as 0x80, SWAR: no carry crosses a byte
+static inline uint64_t record_above(uint64_t w, int t)
+{
+    const uint64_t ones = 0x0101010101010101ULL;
+    uint64_t m = (w & (0x7f * ones)) + (uint64_t)(0x7f - (t & 0x7f)) * ones;
+    return (t < 128 ? w | m : w & m) & (0x80 * ones);
+}
+
+//Scratch of record_encode, in words
+static inline size_t record_mask_words(const struct record_header *h)
+{
+    return (size_t)(2 * h->halo + 2) * (h->width / 8 + 2);
+}
+
+/*
+ * Encode frame f into out, at least record_frame_bound() bytes, masks is scratch
+ * of record_mask_words(). Returns the bytes written.
+ *
+ * Every ROI row is compared with the threshold once, 8 pixels per word, into a ring
+ * of the masks of the last 2*halo+1 rows; a row is stored where the OR of the masks
+ * within halo rows has a bit, widened by halo columns. Rows without a pixel above
+ * the threshold cost one pass over their words. Words are little endian, byte k
+ * is column 8*w+k.
+ */
+static inline size_t record_encode(const struct record_header *h, const struct disk_roi *roi, const struct frame *f,
+                                   uint64_t *masks, uint8_t *out)
+{
+    int r0, r1;
+    record_rows(h, roi, &r0, &r1);
+    int n_slots = 2 * h->halo + 1, words = h->width / 8 + 2;
+    uint64_t *acc = masks + (size_t)n_slots * words;
+    int ws[2 * RECORD_MAX_HALO + 1], we[2 * RECORD_MAX_HALO + 1];
+    bool any[2 * RECORD_MAX_HALO + 1];
+    int next = roi->row_begin, next_slot = 0;
+    uint8_t *p = out + RECORD_FRAME_HEADER_BYTES;
+    int last_row = 0;
+    for (int r = r0; r < r1; r++)
+    {
+        //mask the ROI rows up to r+halo, once each
+        int q0 = r - h->halo > roi->row_begin ? r - h->halo : roi->row_begin;
+        int q1 = r + h->halo + 1 < roi->row_end ? r + h->halo + 1 : roi->row_end;
+        for (; next < q1; next++, next_slot = next_slot + 1 < n_slots ? next_slot + 1 : 0)
+        {
+            int slot = next_slot;
+            uint64_t *m = masks + (size_t)slot * words, seen = 0;
+            const uint8_t *src = f->data + (ptrdiff_t)next * f->stride;
+            int s = roi->start[next - roi->row_begin], e = roi->end[next - roi->row_begin];
+            ws[slot] = s / 8;
+            we[slot] = (e + 7) / 8;
+            //whole words inside the stride, a partial last one bytewise
+            int full = we[slot] < f->stride / 8 ? we[slot] : f->stride / 8;
+            for (int w = ws[slot]; w < full; w++)
+            {
+                uint64_t v;
+                memcpy(&v, src + 8 * w, 8);
+                m[w] = record_above(v, h->threshold);
+            }
+            for (int w = full > ws[slot] ? full : ws[slot]; w < we[slot]; w++)
+            {
+                uint64_t v = 0;
+                memcpy(&v, src + 8 * w, f->stride - 8 * w);
+                m[w] = record_above(v, h->threshold);
+            }
+            //only the columns of the span
+            if (ws[slot] < we[slot])
+            {
+                m[ws[slot]] &= ~0ULL << 8 * (s % 8);
+                if (e % 8 != 0) m[we[slot] - 1] &= (1ULL << 8 * (e % 8)) - 1;
+            }
+            for (int w = ws[slot]; w < we[slot]; w++) seen |= m[w];
+            any[slot] = seen != 0;
+            //narrow the range to the words with a bit, the OR below reads only those
+            if (any[slot])
+            {
+                while (m[ws[slot]] == 0) ws[slot]++;
+                while (m[we[slot] - 1] == 0) we[slot]--;
+            }
+        }
+
+        //OR of the masks within halo rows, the ring slots q0-row_begin..q1-row_begin modulo n_slots
+        int lo = words, hi = 0, n_q = q1 > q0 ? q1 - q0 : 0, first = (q0 - roi->row_begin) % n_slots;
+        for (int k = 0, slot = first; k < n_q; k++, slot = slot + 1 < n_slots ? slot + 1 : 0)
+        {
+            if (!any[slot]) continue;
+            if (ws[slot] < lo) lo = ws[slot];
+            if (we[slot] > hi) hi = we[slot];
+        }
+        if (lo >= hi) continue;
+        for (int w = lo; w < hi; w++) acc[w] = 0;
+        for (int k = 0, slot = first; k < n_q; k++, slot = slot + 1 < n_slots ? slot + 1 : 0)
+        {
+            const uint64_t *m = masks + (size_t)slot * words;
+            if (any[slot])
+                for (int w = ws[slot]; w < we[slot]; w++) acc[w] |= m[w];
+        }
+
+        //runs of the set columns widened by halo, written after room for the row prefix
+        const uint8_t *row = f->data + (ptrdiff_t)r * f->stride;
+        uint8_t *runs = p + 10;
+        int rs = -1, re = -1, prev_end = 0, n_runs = 0;
+        for (int w = lo; w < hi; w++)
+            for (uint64_t bits = acc[w]; bits != 0; bits &= bits - 1)
+            {
+                int j = 8 * w + __builtin_ctzll(bits) / 8;
+                if (j >= h->width) break;
+                int s = j - h->halo > 0 ? j - h->halo : 0;
+                int e = j + h->halo + 1 < h->width ? j + h->halo + 1 : h->width;
+                if (rs >= 0 && s <= re)
+                {
+                    re = e;
+                    continue;
+                }
+                if (rs >= 0)
+                {
+                    runs = record_put_varint(runs, (uint32_t)(rs - prev_end));
+                    runs = record_put_varint(runs, (uint32_t)(re - rs));
+                    memcpy(runs, row + rs, re - rs);
+                    runs += re - rs;
+                    prev_end = re;
+                    n_runs++;
+                }
+                rs = s;
+                re = e;
+            }
+        runs = record_put_varint(runs, (uint32_t)(rs - prev_end));
+        runs = record_put_varint(runs, (uint32_t)(re - rs));
+        memcpy(runs, row + rs, re - rs);
+        runs += re - rs;
+        n_runs++;
+
+        uint8_t prefix[10], *e = record_put_varint(prefix, (uint32_t)(r - last_row));
+        e = record_put_varint(e, (uint32_t)n_runs);
+        memcpy(p, prefix, e - prefix);
+        memmove(p + (e - prefix), p + 10, runs - (p + 10));
+        p += (e - prefix) + (runs - (p + 10));
+        last_row = r + 1;
+    }
+    size_t payload = p - out - RECORD_FRAME_HEADER_BYTES;
+    proto_put32(out, RECORD_FRAME_MAGIC);
+    proto_put32(out + 4, (uint32_t)payload);
+    record_put64(out + 8, f->seq);
+    record_put64(out + 16, (uint64_t)f->t_ingest);
+    return RECORD_FRAME_HEADER_BYTES + payload;
+}
+
+/*
+ * Rebuild a frame from its payload into dst, stride x rows bytes, 0 where nothing
+ * was stored. Returns 0 on success, -1 for a corrupt payload.
+ */
+static inline int record_decode(const struct record_header *h, const uint8_t *payload, size_t bytes,
+                                uint8_t *dst, int stride, int rows)
+{
+    memset(dst, 0, (size_t)stride * rows);
+    const uint8_t *p = payload, *end = payload + bytes;
+    uint32_t row = 0;
+    while (p < end)
+    {
+        uint32_t skip, n_runs;
+        if ((p = record_get_varint(p, end, &skip)) == NULL || (p = record_get_varint(p, end, &n_runs)) == NULL) return -1;
+        row += skip;
+        if (row >= (uint32_t)h->height || row >= (uint32_t)rows) return -1;
+        uint8_t *out = dst + (size_t)row * stride;
+        uint32_t col = 0;
+        for (uint32_t k = 0; k < n_runs; k++)
+        {
+            uint32_t gap, len;
+            if ((p = record_get_varint(p, end, &gap)) == NULL || (p = record_get_varint(p, end, &len)) == NULL) return -1;
+            col += gap;
+            if (col + len > (uint32_t)h->width || len > (size_t)(end - p)) return -1;
+            memcpy(out + col, p, len);
+            p += len;
+            col += len;
+        }
+        row++;
+    }
+    return 0;
+}
+
+struct recorder
+{
+    int fd;
+    struct record_header h;
+    const struct disk_roi *roi;
+
+    //raw slots, the detector fills slot raw_filled % RECORD_RAW_SLOTS while raw_filled - raw_encoded < RECORD_RAW_SLOTS
+    uint8_t *raw[RECORD_RAW_SLOTS];
+    unsigned long long raw_seq[RECORD_RAW_SLOTS];
+    long long raw_t[RECORD_RAW_SLOTS];
+    int raw_stride;
+    int *copy_start, *copy_end;         //columns copied of the rows record_rows(), word aligned
+    unsigned long raw_filled;
+    std::atomic<unsigned long> raw_encoded;
+
+    //blocks, the encoder fills block filled % RECORD_BLOCKS while filled - written < RECORD_BLOCKS
+    uint8_t *block[RECORD_BLOCKS];
+    size_t used[RECORD_BLOCKS];
+    unsigned long filled;
+    std::atomic<unsigned long> written;
+    size_t pos;                         //bytes in the block being filled
+    unsigned long long offset;          //file offset of the next byte
+
+    uint8_t *scratch;
+    uint64_t *masks;
+    uint8_t *index;                     //16 bytes per frame
+    size_t n_index, index_cap;
+
+    pthread_t thread, encoder;
+    pthread_mutex_t lock;
+    pthread_cond_t cond, raw_cond;
+    bool quit, raw_quit;
+
+    //statistics, frames, bytes and encode_ns of the encoder thread
+    unsigned long long frames, bytes, encode_ns;
+    std::atomic<unsigned long long> dropped;
+    std::atomic<unsigned long> write_errors;
+};
+
+//Write exactly len bytes, returns 0 on success
+static inline int record_write_full(int fd, const uint8_t *p, size_t len)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t n = write(fd, p + done, len - done);
+        if (n > 0) done += (size_t)n;
+        else if (n < 0 && errno == EINTR) continue;
+        else return -1;
+    }
+    return 0;
+}
+
+//Thread: writes the full blocks in order
+static void* record_writer(void* pUser)
+{
+    struct recorder *rec = (struct recorder *)pUser;
+    pthread_mutex_lock(&rec->lock);
+    while (1)
+    {
+        while (!rec->quit && rec->written.load() == rec->filled) pthread_cond_wait(&rec->cond, &rec->lock);
+        unsigned long k = rec->written.load();
+        if (k == rec->filled) break;
+        pthread_mutex_unlock(&rec->lock);
+        if (record_write_full(rec->fd, rec->block[k % RECORD_BLOCKS], rec->used[k % RECORD_BLOCKS]) != 0)
+        {
+            perror("record write");
+            rec->write_errors++;
+        }
+        rec->written.store(k + 1);
+        pthread_mutex_lock(&rec->lock);
+    }
+    pthread_mutex_unlock(&rec->lock);
+    return 0;
+}
+
+//Hand the block being filled to the writer thread, encoder only
+static inline void record_submit(struct recorder *rec)
+{
+    rec->used[rec->filled % RECORD_BLOCKS] = rec->pos;
+    pthread_mutex_lock(&rec->lock);
+    rec->filled++;
+    pthread_cond_signal(&rec->cond);
+    pthread_mutex_unlock(&rec->lock);
+    rec->pos = 0;
+}
+
+//Bytes that fit in the free blocks
+static inline size_t record_room(const struct recorder *rec)
+{
+    return (RECORD_BLOCKS - (rec->filled - rec->written.load())) * (size_t)RECORD_BLOCK_BYTES - rec->pos;
+}
+
+//Copy n bytes into the blocks, record_room() must allow it
+static inline void record_put(struct recorder *rec, const uint8_t *p, size_t n)
+{
+    while (n > 0)
+    {
+        size_t k = RECORD_BLOCK_BYTES - rec->pos < n ? RECORD_BLOCK_BYTES - rec->pos : n;
+        memcpy(rec->block[rec->filled % RECORD_BLOCKS] + rec->pos, p, k);
+        rec->pos += k;
+        rec->offset += k;
+        p += k;
+        n -= k;
+        if (rec->pos == RECORD_BLOCK_BYTES) record_submit(rec);
+    }
+}
+
+//The frame copied into raw slot k % RECORD_RAW_SLOTS, only the copied columns are valid
+static inline void record_raw_frame(const struct recorder *rec, unsigned long k, struct frame *f)
+{
+    int slot = (int)(k % RECORD_RAW_SLOTS);
+    f->data = rec->raw[slot];
+    f->width = rec->h.width;
+    f->height = rec->h.height;
+    f->stride = rec->raw_stride;
+    f->seq = rec->raw_seq[slot];
+    f->t_ingest = rec->raw_t[slot];
+}
+
+//Encode a frame into the blocks, encoder only
+static inline void record_store(struct recorder *rec, const struct frame *f)
+{
+    size_t n = record_encode(&rec->h, rec->roi, f, rec->masks, rec->scratch);
+    if (n > record_room(rec))
+    {
+        rec->dropped++;
+        return;
+    }
+    if (rec->n_index == rec->index_cap)
+    {
+        uint8_t *grown = (uint8_t *)realloc(rec->index, rec->index_cap * 2 * 16);
+        if (grown == NULL)
+        {
+            rec->dropped++;
+            return;
+        }
+        rec->index = grown;
+        rec->index_cap *= 2;
+    }
+    record_put64(rec->index + rec->n_index * 16, f->seq);
+    record_put64(rec->index + rec->n_index * 16 + 8, rec->offset);
+    rec->n_index++;
+    record_put(rec, rec->scratch, n);
+    rec->frames++;
+    rec->bytes += n;
+}
+
+//Thread: encodes the raw slots in order, then hands the last block to the writer
+static void* record_encoder(void* pUser)
+{
+    struct recorder *rec = (struct recorder *)pUser;
+    pthread_mutex_lock(&rec->lock);
+    while (1)
+    {
+        while (!rec->raw_quit && rec->raw_encoded.load() == rec->raw_filled) pthread_cond_wait(&rec->raw_cond, &rec->lock);
+        unsigned long k = rec->raw_encoded.load();
+        if (k == rec->raw_filled) break;
+        pthread_mutex_unlock(&rec->lock);
+        struct frame f;
+        record_raw_frame(rec, k, &f);
+        long long t = monotonic_ns();
+        record_store(rec, &f);
+        rec->encode_ns += monotonic_ns() - t;
+        rec->raw_encoded.store(k + 1);
+        pthread_mutex_lock(&rec->lock);
+    }
+    pthread_mutex_unlock(&rec->lock);
+    if (rec->pos > 0) record_submit(rec);
+    return 0;
+}
+
+/*
+ * Create the recording path of the disk roi and start the recorder thread.
+ * Returns 0 on success.
+ */
+static inline int record_open(struct recorder *rec, const char *path, const struct disk_roi *roi, int width, int height,
+                              int cenx, int ceny, int radius, int threshold, int halo)
+{
+    if (halo > RECORD_MAX_HALO)
+    {
+        fprintf(stderr, "record: halo %d above %d\n", halo, RECORD_MAX_HALO);
+        return -1;
+    }
+    rec->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (rec->fd < 0)
+    {
+        perror(path);
+        return -1;
+    }
+    rec->h.width = width;
+    rec->h.height = height;
+    rec->h.cenx = cenx;
+    rec->h.ceny = ceny;
+    rec->h.radius = radius;
+    rec->h.threshold = threshold;
+    rec->h.halo = halo;
+    rec->roi = roi;
+
+    //columns of every row the encoder can read: the ROI spans within halo rows, widened by halo
+    int r0, r1;
+    record_rows(&rec->h, roi, &r0, &r1);
+    rec->raw_stride = (width + 7) / 8 * 8;
+    rec->copy_start = (int *)malloc(sizeof(int) * (r1 - r0 + 1));
+    rec->copy_end = (int *)malloc(sizeof(int) * (r1 - r0 + 1));
+    if (rec->copy_start == NULL || rec->copy_end == NULL)
+    {
+        fprintf(stderr, "record: cannot allocate the copy spans\n");
+        return -1;
+    }
+    for (int r = r0; r < r1; r++)
+    {
+        int s = width, e = 0;
+        int q0 = r - halo > roi->row_begin ? r - halo : roi->row_begin;
+        int q1 = r + halo + 1 < roi->row_end ? r + halo + 1 : roi->row_end;
+        for (int q = q0; q < q1; q++)
+        {
+            int qs = roi->start[q - roi->row_begin], qe = roi->end[q - roi->row_begin];
+            if (qs >= qe) continue;
+            if (qs - halo < s) s = qs - halo;
+            if (qe + halo > e) e = qe + halo;
+        }
+        s = s > 0 ? s / 8 * 8 : 0;
+        e = (e + 7) / 8 * 8 < rec->raw_stride ? (e + 7) / 8 * 8 : rec->raw_stride;
+        rec->copy_start[r - r0] = s < e ? s : 0;
+        rec->copy_end[r - r0] = s < e ? e : 0;
+    }
+    for (int k = 0; k < RECORD_RAW_SLOTS; k++)
+    {
+        rec->raw[k] = (uint8_t *)calloc((size_t)rec->raw_stride * height, 1);
+        if (rec->raw[k] == NULL)
+        {
+            fprintf(stderr, "record: cannot allocate the raw slots\n");
+            return -1;
+        }
+    }
+    for (int k = 0; k < RECORD_BLOCKS; k++)
+    {
+        void *b = NULL;
+        if (posix_memalign(&b, RECORD_ALIGN, RECORD_BLOCK_BYTES) != 0)
+        {
+            fprintf(stderr, "record: cannot allocate the write blocks\n");
+            return -1;
+        }
+        rec->block[k] = (uint8_t *)b;
+    }
+    rec->scratch = (uint8_t *)malloc(record_frame_bound(&rec->h, roi));
+    rec->masks = (uint64_t *)malloc(sizeof(uint64_t) * record_mask_words(&rec->h));
+    rec->index_cap = 4096;
+    rec->index = (uint8_t *)malloc(rec->index_cap * 16);
+    if (rec->scratch == NULL || rec->masks == NULL || rec->index == NULL)
+    {
+        fprintf(stderr, "record: cannot allocate %zu bytes\n", record_frame_bound(&rec->h, roi));
+        return -1;
+    }
+    rec->n_index = 0;
+    rec->raw_filled = 0;
+    rec->raw_encoded.store(0);
+    rec->filled = 0;
+    rec->written.store(0);
+    rec->pos = 0;
+    rec->offset = 0;
+    rec->quit = rec->raw_quit = false;
+    rec->frames = rec->bytes = rec->encode_ns = 0;
+    rec->dropped.store(0);
+    rec->write_errors = 0;
+
+    uint8_t hdr[RECORD_HEADER_BYTES] = {0};
+    proto_put32(hdr, RECORD_MAGIC);
+    proto_put16(hdr + 4, RECORD_VERSION);
+    proto_put16(hdr + 6, RECORD_HEADER_BYTES);
+    proto_put16(hdr + 8, (uint32_t)width);
+    proto_put16(hdr + 10, (uint32_t)height);
+    proto_put16(hdr + 12, (uint32_t)cenx);
+    proto_put16(hdr + 14, (uint32_t)ceny);
+    proto_put16(hdr + 16, (uint32_t)radius);
+    hdr[18] = (uint8_t)threshold;
+    hdr[19] = (uint8_t)halo;
+    record_put(rec, hdr, sizeof(hdr));
+
+    pthread_mutex_init(&rec->lock, NULL);
+    pthread_cond_init(&rec->cond, NULL);
+    pthread_cond_init(&rec->raw_cond, NULL);
+    if (pthread_create(&rec->thread, NULL, record_writer, rec) != 0)
+    {
+        fprintf(stderr, "record: cannot start the writer thread\n");
+        return -1;
+    }
+    if (pthread_create(&rec->encoder, NULL, record_encoder, rec) != 0)
+    {
+        fprintf(stderr, "record: cannot start the encoder thread\n");
+        return -1;
+    }
+    return 0;
+}
+
+//Record frame f, detector only: copies the pixels the encoder reads. Returns false when it was dropped
+static inline bool record_frame(struct recorder *rec, const struct frame *f)
+{
+    if (rec->raw_filled - rec->raw_encoded.load() == RECORD_RAW_SLOTS)
+    {
+        rec->dropped++;
+        return false;
+    }
+    int r0, r1, slot = (int)(rec->raw_filled % RECORD_RAW_SLOTS);
+    record_rows(&rec->h, rec->roi, &r0, &r1);
+    uint8_t *raw = rec->raw[slot];
+    for (int r = r0; r < r1; r++)
+    {
+        int s = rec->copy_start[r - r0], e = rec->copy_end[r - r0];
+        //the last word of a row may end past the frame stride
+        if (e > f->stride) e = f->stride;
+        if (s < e) memcpy(raw + (size_t)r * rec->raw_stride + s, f->data + (ptrdiff_t)r * f->stride + s, e - s);
+    }
+    rec->raw_seq[slot] = f->seq;
+    rec->raw_t[slot] = f->t_ingest;
+    pthread_mutex_lock(&rec->lock);
+    rec->raw_filled++;
+    pthread_cond_signal(&rec->raw_cond);
+    pthread_mutex_unlock(&rec->lock);
+    return true;
+}
+
+//Encode and write the rest, the index and the trailer, and stop the recorder threads
+static inline void record_close(struct recorder *rec)
+{
+    pthread_mutex_lock(&rec->lock);
+    rec->raw_quit = true;
+    pthread_cond_signal(&rec->raw_cond);
+    pthread_mutex_unlock(&rec->lock);
+    pthread_join(rec->encoder, NULL);
+
+    pthread_mutex_lock(&rec->lock);
+    rec->quit = true;
+    pthread_cond_signal(&rec->cond);
+    pthread_mutex_unlock(&rec->lock);
+    pthread_join(rec->thread, NULL);
+
+    uint8_t trailer[RECORD_TRAILER_BYTES];
+    proto_put32(trailer, RECORD_TRAILER_MAGIC);
+    proto_put32(trailer + 4, (uint32_t)rec->n_index);
+    record_put64(trailer + 8, rec->offset);
+    if (record_write_full(rec->fd, rec->index, rec->n_index * 16) != 0 ||
+        record_write_full(rec->fd, trailer, sizeof(trailer)) != 0 || close(rec->fd) != 0)
+    {
+        perror("record close");
+        rec->write_errors++;
+    }
+    for (int k = 0; k < RECORD_BLOCKS; k++) free(rec->block[k]);
+    for (int k = 0; k < RECORD_RAW_SLOTS; k++) free(rec->raw[k]);
+    free(rec->copy_start);
+    free(rec->copy_end);
+    free(rec->scratch);
+    free(rec->masks);
+    free(rec->index);
+    pthread_mutex_destroy(&rec->lock);
+    pthread_cond_destroy(&rec->cond);
+    pthread_cond_destroy(&rec->raw_cond);
+}
+
+struct record_reader
+{
+    FILE *fp;
+    struct record_header h;
+    long frames;                        //frames in the index, -1 without one
+    unsigned long long end;             //offset of the index, or of the end of the file
+    uint8_t *payload;
+    size_t cap;
+};
+
+//Returns 0 on success
+static inline int record_reader_open(struct record_reader *rd, const char *path)
+{
+    rd->fp = fopen(path, "rb");
+    if (rd->fp == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+    uint8_t hdr[RECORD_HEADER_BYTES];
+    if (fread(hdr, 1, sizeof(hdr), rd->fp) != sizeof(hdr) || proto_get32(hdr) != RECORD_MAGIC ||
+        proto_get16(hdr + 4) != RECORD_VERSION)
+    {
+        fprintf(stderr, "%s: not a recording\n", path);
+        fclose(rd->fp);
+        return -1;
+    }
+    rd->h.width = proto_get16(hdr + 8);
+    rd->h.height = proto_get16(hdr + 10);
+    rd->h.cenx = proto_get16(hdr + 12);
+    rd->h.ceny = proto_get16(hdr + 14);
+    rd->h.radius = proto_get16(hdr + 16);
+    rd->h.threshold = hdr[18];
+    rd->h.halo = hdr[19];
+
+    uint8_t trailer[RECORD_TRAILER_BYTES];
+    rd->frames = -1;
+    fseeko(rd->fp, 0, SEEK_END);
+    rd->end = (unsigned long long)ftello(rd->fp);
+    if (fseeko(rd->fp, -RECORD_TRAILER_BYTES, SEEK_END) == 0 && fread(trailer, 1, sizeof(trailer), rd->fp) == sizeof(trailer) &&
+        proto_get32(trailer) == RECORD_TRAILER_MAGIC)
+    {
+        rd->frames = proto_get32(trailer + 4);
+        rd->end = record_get64(trailer + 8);
+    }
+    fseeko(rd->fp, (off_t)proto_get16(hdr + 6), SEEK_SET);
+    rd->payload = NULL;
+    rd->cap = 0;
+    return 0;
+}
+
+/*
+ * Go to frame k of the index. Returns 0 on success, -1 without an index or past
+ * its end.
+ */
+static inline int record_reader_seek(struct record_reader *rd, long k)
+{
+    uint8_t entry[16];
+    if (k < 0 || k >= rd->frames || fseeko(rd->fp, (off_t)(rd->end + (unsigned long long)k * 16), SEEK_SET) != 0 ||
+        fread(entry, 1, sizeof(entry), rd->fp) != sizeof(entry))
+        return -1;
+    return fseeko(rd->fp, (off_t)record_get64(entry + 8), SEEK_SET);
+}
+
+/*
+ * Rebuild the next frame into dst, stride x rows bytes. Returns 1 for a frame,
+ * 0 at the end of the recording, -1 for a damaged one.
+ */
+static inline int record_reader_next(struct record_reader *rd, uint8_t *dst, int stride, int rows,
+                                     unsigned long long *seq, long long *t_ingest)
+{
+    uint8_t fh[RECORD_FRAME_HEADER_BYTES];
+    if ((unsigned long long)ftello(rd->fp) >= rd->end || fread(fh, 1, sizeof(fh), rd->fp) != sizeof(fh)) return 0;
+    if (proto_get32(fh) != RECORD_FRAME_MAGIC) return -1;
+    size_t bytes = proto_get32(fh + 4);
+    if (bytes > rd->cap)
+    {
+        uint8_t *grown = (uint8_t *)realloc(rd->payload, bytes);
+        if (grown == NULL) return -1;
+        rd->payload = grown;
+        rd->cap = bytes;
+    }
+    //a frame cut short ends a recording without an index
+    if (fread(rd->payload, 1, bytes, rd->fp) != bytes) return 0;
+    *seq = record_get64(fh + 8);
+    *t_ingest = (long long)record_get64(fh + 16);
+    return record_decode(&rd->h, rd->payload, bytes, dst, stride, rows) == 0 ? 1 : -1;
+}
+
+static inline void record_reader_close(struct record_reader *rd)
+{
+    fclose(rd->fp);
+    free(rd->payload);
+}
+
+#endif
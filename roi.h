@@ -0,0 +1,71 @@
+/*
+ * Disk region of interest
+ * -----------------------
+ *   The phosphor screen is imaged as a disk of radius RADIUS around (CENX,CENY).
+ *   Instead of masking every frame, the disk is described once at startup as one
+ *   [start,end) column span per image row. The detector only visits pixels inside
+ *   these spans and reads the frame buffer in place.
+ *
+ *   Spans are clipped so that a detection window of half size "margin" around any
+ *   pixel in a span stays inside the image. Windows centred close to the rim of the
+ *   disk read the real (dark) pixels just outside it rather than zeros.
+ */
+
+#ifndef ROI_H
+#define ROI_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+struct disk_roi
+{
+    int row_begin, row_end;     //rows [row_begin,row_end) hold at least one span
+    int *start, *end;           //column span of row r is [start[r-row_begin], end[r-row_begin])
+    long pixels;                //total number of pixels inside the spans
+};
+
+/*
+ * Compute the spans of the disk (col-cenx)^2 + (row-ceny)^2 < radius^2.
+ * Returns 0 on success.
+ */
+static inline int disk_roi_init(struct disk_roi *roi, int cenx, int ceny, int radius, int width, int height, int margin)
+{
+    int top = ceny - radius, bottom = ceny + radius;
+    if (top < margin) top = margin;
+    if (bottom > height - margin) bottom = height - margin;
+    if (bottom <= top)
+    {
+        fprintf(stderr, "ROI: disk (%d,%d) r=%d does not intersect the %dx%d image\n", cenx, ceny, radius, width, height);
+        return -1;
+    }
+    roi->row_begin = top;
+    roi->row_end = bottom;
+    roi->start = (int *)malloc(sizeof(int) * (bottom - top));
+    roi->end = (int *)malloc(sizeof(int) * (bottom - top));
+    roi->pixels = 0;
+    if (roi->start == NULL || roi->end == NULL) return -1;
+
+    for (int row = top; row < bottom; row++)
+    {
+        int dy2 = (row - ceny) * (row - ceny);
+        //widest half width h with h^2 + dy^2 < radius^2, -1 when the row misses the disk
+        int h = -1;
+        while ((h + 1) * (h + 1) + dy2 < radius * radius) h++;
+        int s = cenx - h, e = cenx + h + 1;
+        if (s < margin) s = margin;
+        if (e > width - margin) e = width - margin;
+        if (e < s) e = s;
+        roi->start[row - top] = s;
+        roi->end[row - top] = e;
+        roi->pixels += e - s;
+    }
+    return 0;
+}
+
+static inline void disk_roi_free(struct disk_roi *roi)
+{
+    free(roi->start);
+    free(roi->end);
+}
+
+#endif
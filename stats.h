@@ -0,0 +1,264 @@
+/*
+ * Pipeline statistics
+ * -----------------------
+ *   Latency histograms and a periodic report of the detector pipeline.
+ *
+ *   Every frame carries the time it was read (frame_source.h). The detector
+ *   records for every frame
+ *       wait      ingest -> detection started (time spent as the newest frame)
+ *       process   detection started -> events pushed to the ring
+ *       ready     ingest -> events pushed to the ring
+ *   and the transmitter records per record
+ *       wire      ingest -> record written to the output
+ *   Histograms have 4 buckets per octave of ns (within 19 %) and a single
+ *   writer each, so adding a sample is a plain increment of a relaxed atomic.
+ *
+ *   The capture time of a frame is looked up by the transmitter in a table of
+ *   frame stamps indexed by the frame number, written by the detector before
+ *   the events of the frame enter the ring.
+ *
+ *   Report (one line per interval, to stderr or to a stats sink):
+ *       fps, frames read and dropped, events per frame, duplicates per frame removed
+ *       by the coincidence filter, ring depth and drops, output level and events
+ *       withheld by the governor, output rate, p50/p99 of every histogram in the interval
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <atomic>
+
+#include "frame_source.h"
+#include "event_ring.h"
+#include "output_sink.h"
+
+//4 buckets per octave up to 2^40 ns (18 min)
+#define HIST_BUCKETS (41 * 4)
+
+struct latency_hist
+{
+    std::atomic<unsigned long> count[HIST_BUCKETS];
+};
+
+static inline int hist_bucket(long long ns)
+{
+    if (ns < 4) return ns < 0 ? 0 : (int)ns;
+    int msb = 63 - __builtin_clzll((unsigned long long)ns);
+    int b = msb * 4 + (int)((ns >> (msb - 2)) & 3);
+    return b < HIST_BUCKETS ? b : HIST_BUCKETS - 1;
+}
+
+//Largest value of bucket b
+static inline long long hist_bucket_max(int b)
+{
+    if (b < 8) return b;            //only 0-3 are used below 4 ns
+    int msb = b / 4;
+    return ((long long)(4 + b % 4 + 1) << (msb - 2)) - 1;
+}
+
+static inline void hist_clear(struct latency_hist *h)
+{
+    for (int b = 0; b < HIST_BUCKETS; b++) h->count[b].store(0, std::memory_order_relaxed);
+}
+
+//Single writer per histogram
+static inline void hist_add(struct latency_hist *h, long long ns)
+{
+    std::atomic<unsigned long> *c = &h->count[hist_bucket(ns)];
+    c->store(c->load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+/*
+ * Quantiles q[0..n_q) of the samples added since the counts in prev, prev is updated.
+ * out[k] is -1 when there are no samples. Returns the number of samples.
+ */
+static inline long long hist_quantile_since(const struct latency_hist *h, unsigned long *prev, int n_q, const double *q, long long *out)
+{
+    unsigned long diff[HIST_BUCKETS], total = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++)
+    {
+        unsigned long now = h->count[b].load(std::memory_order_relaxed);
+        diff[b] = now - prev[b];
+        prev[b] = now;
+        total += diff[b];
+    }
+    for (int k = 0; k < n_q; k++)
+    {
+        out[k] = -1;
+        unsigned long rank = (unsigned long)(q[k] * total), seen = 0;
+        for (int b = 0; b < HIST_BUCKETS && total > 0; b++)
+        {
+            seen += diff[b];
+            if (seen > rank || b == HIST_BUCKETS - 1)
+            {
+                out[k] = hist_bucket_max(b);
+                break;
+            }
+        }
+    }
+    return (long long)total;
+}
+
+//Capture times of the last FRAME_STAMPS frames, by frame number
+#define FRAME_STAMPS 4096
+
+struct frame_stamp
+{
+    std::atomic<uint32_t> frame;
+    std::atomic<long long> t_ingest;
+};
+
+//Detector only, before the events of the frame are pushed
+static inline void frame_stamp_put(struct frame_stamp *stamps, uint32_t frame, long long t_ingest)
+{
+    struct frame_stamp *s = &stamps[frame % FRAME_STAMPS];
+    s->t_ingest.store(t_ingest, std::memory_order_relaxed);
+    s->frame.store(frame, std::memory_order_release);
+}
+
+//Capture time of frame, 0 when it has been overwritten
+static inline long long frame_stamp_get(struct frame_stamp *stamps, uint32_t frame)
+{
+    struct frame_stamp *s = &stamps[frame % FRAME_STAMPS];
+    if (s->frame.load(std::memory_order_acquire) != frame) return 0;
+    long long t = s->t_ingest.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return s->frame.load(std::memory_order_relaxed) == frame ? t : 0;
+}
+
+enum
+{
+    HIST_WAIT,
+    HIST_PROCESS,
+    HIST_READY,
+    HIST_WIRE,
+    HIST_COUNT
+};
+
+static const char *hist_name[HIST_COUNT] = {"wait", "process", "ready", "wire"};
+
+struct pipeline_stats
+{
+    struct latency_hist hist[HIST_COUNT];
+    struct frame_stamp stamps[FRAME_STAMPS];
+    std::atomic<unsigned long long> frames;         //frames processed
+    std::atomic<unsigned long long> events;         //events found
+    std::atomic<unsigned long long> duplicates;     //events removed by the coincidence filter
+    std::atomic<int> level;                         //output level of the governor, transmitter
+    std::atomic<unsigned long long> withheld;       //events withheld by the governor, transmitter
+
+    //reporter state
+    int interval_ms;
+    struct output_sink *out;                        //NULL for stderr
+    long long last_ns;
+    unsigned long long last_frames, last_events, last_duplicates, last_read, last_dropped, last_ring_dropped, last_bytes, last_withheld;
+    unsigned long prev[HIST_COUNT][HIST_BUCKETS];
+};
+
+static inline void stats_init(struct pipeline_stats *st, int interval_ms, struct output_sink *out)
+{
+    for (int h = 0; h < HIST_COUNT; h++) hist_clear(&st->hist[h]);
+    for (int k = 0; k < FRAME_STAMPS; k++)
+    {
+        st->stamps[k].frame.store(UINT32_MAX);
+        st->stamps[k].t_ingest.store(0);
+    }
+    st->frames.store(0);
+    st->events.store(0);
+    st->duplicates.store(0);
+    st->level.store(0);
+    st->withheld.store(0);
+    st->interval_ms = interval_ms;
+    st->out = out;
+    st->last_ns = monotonic_ns();
+    st->last_frames = st->last_events = st->last_duplicates = st->last_read = st->last_dropped = st->last_ring_dropped = st->last_bytes = st->last_withheld = 0;
+    memset(st->prev, 0, sizeof(st->prev));
+}
+
+//Detector only, after the events of frame f have been pushed, n_duplicates of them were removed
+static inline void stats_frame(struct pipeline_stats *st, const struct frame *f, long long t_start, long long t_done, int n_events,
+                               int n_duplicates)
+{
+    hist_add(&st->hist[HIST_WAIT], t_start - f->t_ingest);
+    hist_add(&st->hist[HIST_PROCESS], t_done - t_start);
+    hist_add(&st->hist[HIST_READY], t_done - f->t_ingest);
+    st->frames.store(st->frames.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    st->events.store(st->events.load(std::memory_order_relaxed) + n_events, std::memory_order_relaxed);
+    st->duplicates.store(st->duplicates.load(std::memory_order_relaxed) + n_duplicates, std::memory_order_relaxed);
+}
+
+/*
+ * Print one report line when interval_ms has passed since the last one, detector only.
+ * The sink counters are read without locking, the output rate is approximate.
+ */
+static inline void stats_report(struct pipeline_stats *st, struct frame_source *src, struct event_ring *ring,
+                                const struct output_sink *sink, bool force)
+{
+    long long now = monotonic_ns();
+    if (st->interval_ms <= 0 || (!force && now - st->last_ns < (long long)st->interval_ms * 1000000LL)) return;
+    double dt = (now - st->last_ns) * 1e-9;
+
+    pthread_mutex_lock(&src->lock);
+    unsigned long long read = src->frames_read, dropped = src->frames_dropped;
+    pthread_mutex_unlock(&src->lock);
+    unsigned long long frames = st->frames.load(), events = st->events.load(), duplicates = st->duplicates.load();
+    unsigned long long ring_dropped = ring->dropped.load(), bytes = sink->bytes_written.load(std::memory_order_relaxed), withheld = st->withheld.load();
+
+    char line[1024];
+    int n = snprintf(line, sizeof(line),
+                     "stats: fps %.1f read %.1f dropped %.1f events/frame %.1f duplicates/frame %.1f ring %lu dropped %llu level %d withheld %llu output %.1f kB/s",
+                     (frames - st->last_frames) / dt, (read - st->last_read) / dt, (dropped - st->last_dropped) / dt,
+                     frames > st->last_frames ? (double)(events - st->last_events) / (frames - st->last_frames) : 0.0,
+                     frames > st->last_frames ? (double)(duplicates - st->last_duplicates) / (frames - st->last_frames) : 0.0,
+                     event_ring_depth(ring), ring_dropped - st->last_ring_dropped, st->level.load(), withheld - st->last_withheld,
+                     (bytes - st->last_bytes) / dt / 1000);
+    static const double q[2] = {0.5, 0.99};
+    for (int h = 0; h < HIST_COUNT; h++)
+    {
+        long long v[2];
+        if (hist_quantile_since(&st->hist[h], st->prev[h], 2, q, v) > 0)
+            n += snprintf(line + n, sizeof(line) - n, " %s p50/p99 %.2f/%.2f ms", hist_name[h], v[0] * 1e-6, v[1] * 1e-6);
+    }
+    snprintf(line + n, sizeof(line) - n, "\n");
+
+    if (st->out == NULL) fputs(line, stderr);
+    else
+    {
+        size_t len = strlen(line);
+        if (len <= st->out->flush_bytes)
+        {
+            memcpy(output_sink_reserve(st->out, len), line, len);
+            output_sink_commit(st->out, len);
+            output_sink_flush(st->out);
+        }
+    }
+    st->last_ns = now;
+    st->last_frames = frames;
+    st->last_events = events;
+    st->last_duplicates = duplicates;
+    st->last_read = read;
+    st->last_dropped = dropped;
+    st->last_ring_dropped = ring_dropped;
+    st->last_bytes = bytes;
+    st->last_withheld = withheld;
+}
+
+//Latency percentiles of the whole run
+static inline void stats_summary(struct pipeline_stats *st, FILE *out)
+{
+    static const double q[3] = {0.5, 0.99, 0.999};
+    for (int h = 0; h < HIST_COUNT; h++)
+    {
+        unsigned long zero[HIST_BUCKETS] = {0};
+        long long v[3];
+        long long n = hist_quantile_since(&st->hist[h], zero, 3, q, v);
+        if (n > 0)
+            fprintf(out, "Latency %-7s p50 %.2f ms, p99 %.2f ms, p99.9 %.2f ms (%lld samples)\n",
+                    hist_name[h], v[0] * 1e-6, v[1] * 1e-6, v[2] * 1e-6, n);
+    }
+}
+
+#endif
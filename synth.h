@@ -0,0 +1,223 @@
+/*
+ * Synthetic photon frames
+ * -----------------------
+ *   Generates luma frames of the phosphor screen with photon splashes at known
+ *   sub-pixel positions, for the offline benchmark.
+ *
+ *   Per frame:
+ *       - a Poisson number of photons (mean flux) uniformly distributed over the disk
+ *       - each photon deposits a Gaussian distributed energy (gain, gain_spread)
+ *       - the energy is spread with a Gaussian PSF integrated over every pixel,
+ *         or with a measured PSF sampled on an oversampled grid
+ *       - phosphor glow: a fraction of the previous frame's signal persists
+ *       - bias and Gaussian read noise, rounded and clipped to 8 bit
+ *   The true photon positions are returned so centroids can be compared.
+ *
+ *   Measured PSF file (text): "size oversample" followed by size*size values,
+ *   row by row, sampled every 1/oversample pixel around the photon position.
+ */
+
+#ifndef SYNTH_H
+#define SYNTH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include <random>
+
+struct synth_params
+{
+    int width, height, stride;
+    int cenx, ceny, radius;         //photons land inside this disk
+    double flux;                    //mean photons per frame
+    double gain;                    //mean energy of a photon splash in DN summed over the PSF
+    double gain_spread;             //standard deviation of the energy as a fraction of gain
+    double sigma;                   //Gaussian PSF standard deviation in pixels
+    double read_noise;              //read noise standard deviation in DN
+    double bias;                    //pedestal in DN
+    double glow;                    //fraction of the previous frame's signal that persists
+    unsigned seed;
+};
+
+struct synth_photon
+{
+    double x, y;                    //true position, column and row in pixels (pixel centres at integers)
+    double energy;
+};
+
+struct synth
+{
+    struct synth_params p;
+    std::mt19937 rng;
+    float *signal;                  //photon signal of the current frame including glow
+    float *psf;                     //measured PSF, NULL for the Gaussian one
+    int psf_size, psf_oversample;
+};
+
+static inline void synth_defaults(struct synth_params *p)
+{
+    p->width = 1280;
+    p->height = 720;
+    p->stride = 1280;
+    p->cenx = 800;
+    p->ceny = 400;
+    p->radius = 300;
+    p->flux = 100;
+    p->gain = 800;
+    p->gain_spread = 0.3;
+    p->sigma = 0.8;
+    p->read_noise = 1.5;
+    p->bias = 2;
+    p->glow = 0.0;
+    p->seed = 1;
+}
+
+static inline int synth_init(struct synth *s, const struct synth_params *p)
+{
+    s->p = *p;
+    s->rng.seed(p->seed);
+    s->signal = (float *)calloc((size_t)p->width * p->height, sizeof(float));
+    s->psf = NULL;
+    s->psf_size = 0;
+    s->psf_oversample = 1;
+    return s->signal != NULL ? 0 : -1;
+}
+
+//Load a measured PSF, returns 0 on success
+static inline int synth_load_psf(struct synth *s, const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+    int size, over;
+    if (fscanf(fp, "%d %d", &size, &over) != 2 || size < 1 || size > 1024 || over < 1)
+    {
+        fprintf(stderr, "%s: expected \"size oversample\" header\n", path);
+        fclose(fp);
+        return -1;
+    }
+    s->psf = (float *)malloc(sizeof(float) * size * size);
+    double total = 0;
+    for (int k = 0; k < size * size; k++)
+    {
+        if (fscanf(fp, "%f", &s->psf[k]) != 1)
+        {
+            fprintf(stderr, "%s: expected %d values\n", path, size * size);
+            fclose(fp);
+            return -1;
+        }
+        total += s->psf[k];
+    }
+    fclose(fp);
+    for (int k = 0; k < size * size; k++) s->psf[k] = (float)(s->psf[k] / total);
+    s->psf_size = size;
+    s->psf_oversample = over;
+    return 0;
+}
+
+static inline void synth_free(struct synth *s)
+{
+    free(s->signal);
+    free(s->psf);
+}
+
+//Fraction of a unit Gaussian between a and b
+static inline double synth_gauss_cdf_diff(double a, double b)
+{
+    return 0.5 * (erf(b * M_SQRT1_2) - erf(a * M_SQRT1_2));
+}
+
+static inline void synth_deposit(struct synth *s, const struct synth_photon *ph)
+{
+    const struct synth_params *p = &s->p;
+    if (s->psf == NULL)
+    {
+        int reach = (int)ceil(4 * p->sigma) + 1;
+        int c0 = (int)floor(ph->x + 0.5), r0 = (int)floor(ph->y + 0.5);
+        double wx[64], wy[64];
+        if (reach > 31) reach = 31;
+        for (int d = -reach; d <= reach; d++)
+        {
+            wx[d + reach] = synth_gauss_cdf_diff((c0 + d - 0.5 - ph->x) / p->sigma, (c0 + d + 0.5 - ph->x) / p->sigma);
+            wy[d + reach] = synth_gauss_cdf_diff((r0 + d - 0.5 - ph->y) / p->sigma, (r0 + d + 0.5 - ph->y) / p->sigma);
+        }
+        for (int dr = -reach; dr <= reach; dr++)
+        {
+            int r = r0 + dr;
+            if (r < 0 || r >= p->height) continue;
+            for (int dc = -reach; dc <= reach; dc++)
+            {
+                int c = c0 + dc;
+                if (c < 0 || c >= p->width) continue;
+                s->signal[(size_t)r * p->width + c] += (float)(ph->energy * wy[dr + reach] * wx[dc + reach]);
+            }
+        }
+        return;
+    }
+    //measured PSF: every sample lands in the pixel that contains it
+    double half = (s->psf_size - 1) / 2.0;
+    for (int v = 0; v < s->psf_size; v++)
+    {
+        int r = (int)floor(ph->y + (v - half) / s->psf_oversample + 0.5);
+        if (r < 0 || r >= p->height) continue;
+        for (int u = 0; u < s->psf_size; u++)
+        {
+            int c = (int)floor(ph->x + (u - half) / s->psf_oversample + 0.5);
+            if (c < 0 || c >= p->width) continue;
+            s->signal[(size_t)r * p->width + c] += (float)(ph->energy * s->psf[v * s->psf_size + u]);
+        }
+    }
+}
+
+/*
+ * Render the next frame into dst (stride bytes per row).
+ * Up to max_truth photons are stored in truth. Returns the number of photons.
+ */
+static inline int synth_frame(struct synth *s, uint8_t *dst, struct synth_photon *truth, int max_truth)
+{
+    const struct synth_params *p = &s->p;
+    size_t npix = (size_t)p->width * p->height;
+    //phosphor glow of the previous frame
+    if (p->glow > 0)
+        for (size_t k = 0; k < npix; k++) s->signal[k] *= (float)p->glow;
+    else
+        memset(s->signal, 0, npix * sizeof(float));
+
+    std::poisson_distribution<int> count(p->flux > 0 ? p->flux : 1e-9);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    std::normal_distribution<double> normal(0.0, 1.0);
+    int n = count(s->rng), kept = 0;
+    for (int k = 0; k < n; k++)
+    {
+        struct synth_photon ph;
+        //uniform in the disk, staying clear of the rim
+        double r = (p->radius - 4) * sqrt(unit(s->rng)), a = 2 * M_PI * unit(s->rng);
+        ph.x = p->cenx + r * cos(a);
+        ph.y = p->ceny + r * sin(a);
+        ph.energy = p->gain * (1 + p->gain_spread * normal(s->rng));
+        if (ph.energy < 0) ph.energy = 0;
+        synth_deposit(s, &ph);
+        if (kept < max_truth) truth[kept++] = ph;
+    }
+
+    for (int r = 0; r < p->height; r++)
+    {
+        uint8_t *row = dst + (size_t)r * p->stride;
+        const float *sig = s->signal + (size_t)r * p->width;
+        for (int c = 0; c < p->width; c++)
+        {
+            double v = p->bias + sig[c] + (p->read_noise > 0 ? p->read_noise * normal(s->rng) : 0);
+            long q = lround(v);
+            row[c] = (uint8_t)(q < 0 ? 0 : (q > 255 ? 255 : q));
+        }
+        memset(row + p->width, 0, p->stride - p->width);
+    }
+    return kept;
+}
+
+#endif
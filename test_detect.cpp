@@ -0,0 +1,188 @@
+/*
+ * Title: Equivalence test of the detection kernels
+ * Description: Runs the candidate kernel selected by the compiler target flags (AVX2, SSE2,
+ * NEON) and the occupancy prefilter against the scalar reference kernel on synthetic
+ * (synth.h) and random frames, with a global threshold and with per pixel threshold maps,
+ * and compares the candidate lists and the centroids of every window mode in 1/256 pixel.
+ * Exits with status 1 when anything differs.
+ *
+ * This code is released under the MIT License, see LICENSE.
+ */
+
+/*
+ * Usage: test_detect [frames]
+ *   frames      frames of every kind (default 20)
+ *
+ * Build and run with "make test". TEST_ARCH selects the kernel under test, e.g.
+ * -march=native (AVX2), "-msse2 -mno-avx2" or $(SYS) (NEON) on the Pi. The centroid
+ * checksum printed at the end covers the random frames, made with integer arithmetic
+ * only, so builds for different targets must print the same value.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <vector>
+
+#include "frame_source.h"
+#include "roi.h"
+#include "detect.h"
+#include "synth.h"
+
+//Frame geometry, the width is not a multiple of any vector width
+#define TEST_WIDTH 1000
+#define TEST_HEIGHT 400
+#define TEST_STRIDE 1024
+
+static uint32_t rng_state = 12345;
+
+//xorshift32, the same sequence on every target
+static uint32_t test_rand(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static int failures;
+
+static void fail(const char *what, const char *kind, int frame)
+{
+    fprintf(stderr, "%s frame %d: %s differ from the scalar reference\n", kind, frame, what);
+    failures++;
+}
+
+static bool same_candidates(const std::vector<struct candidate> &a, int na, const std::vector<struct candidate> &b, int nb)
+{
+    return na == nb && memcmp(a.data(), b.data(), sizeof(struct candidate) * na) == 0;
+}
+
+//FNV-1a over the events, independent of the padding of struct event
+static uint32_t checksum_events(uint32_t h, const struct event *ev, int n)
+{
+    for (int e = 0; e < n; e++)
+    {
+        uint32_t v[4] = {(uint32_t)ev[e].x, (uint32_t)ev[e].y, ev[e].sum, (uint32_t)(ev[e].c_max << 8 | ev[e].c_min)};
+        for (int k = 0; k < 4; k++)
+            for (int b = 0; b < 4; b++) h = (h ^ (v[k] >> (8 * b) & 0xff)) * 16777619u;
+    }
+    return h;
+}
+
+/*
+ * Run every kernel on one frame, with the threshold and with the maps bg. The
+ * centroids are those of the kernel under test, the candidates being checked first.
+ */
+static uint32_t check_frame(const struct frame *f, int threshold, const struct detect_background *bg,
+                            const char *kind, int frame, uint32_t h)
+{
+    static const int windows[3] = {3, 5, 7};
+    for (int w = 0; w < 3; w++)
+    {
+        int window = windows[w];
+        struct disk_roi roi;
+        int radius = 20 + test_rand() % 300;
+        if (disk_roi_init(&roi, (int)(test_rand() % TEST_WIDTH), (int)(test_rand() % TEST_HEIGHT), radius,
+                          TEST_WIDTH, TEST_HEIGHT, window / 2) != 0)
+            continue;
+        int cap = detect_capacity(&roi, roi.row_begin, roi.row_end);
+        std::vector<struct candidate> ref(cap + 1), cand(cap + 1);
+        std::vector<struct event> ev_ref(cap + 1), ev(cap + 1);
+
+        for (int map = 0; map < 2; map++)
+        {
+            const struct detect_background *maps = map ? bg : NULL;
+            int n_ref = maps != NULL ?
+                detect_candidates_map(f, &roi, roi.row_begin, roi.row_end, maps, ref.data(), detect_row_map_scalar) :
+                detect_candidates(f, &roi, roi.row_begin, roi.row_end, threshold, ref.data(), detect_row_scalar);
+
+            int n = maps != NULL ?
+                detect_candidates_map(f, &roi, roi.row_begin, roi.row_end, maps, cand.data()) :
+                detect_candidates(f, &roi, roi.row_begin, roi.row_end, threshold, cand.data());
+            if (!same_candidates(cand, n, ref, n_ref)) fail(map ? "map candidates" : "candidates", kind, frame);
+
+            n = detect_candidates_sparse(f, &roi, roi.row_begin, roi.row_end, threshold, maps, cand.data());
+            if (!same_candidates(cand, n, ref, n_ref)) fail(map ? "prefiltered map candidates" : "prefiltered candidates", kind, frame);
+
+            //centroids of the reference candidates with the scalar kernel, of the prefiltered ones as main.o runs them
+            centroid_fn centroid = centroid_for_window(window);
+            int energy = (int)(test_rand() % 200);
+            memset(ev_ref.data(), 0, sizeof(struct event) * ev_ref.size());
+            memset(ev.data(), 0, sizeof(struct event) * ev.size());
+            int k_ref = centroid(f, ref.data(), n_ref, energy, maps, ev_ref.data(), cap);
+            int k = centroid(f, cand.data(), n, energy, maps, ev.data(), cap);
+            if (k != k_ref || memcmp(ev.data(), ev_ref.data(), sizeof(struct event) * k) != 0)
+                fail(map ? "map centroids" : "centroids", kind, frame);
+            h = checksum_events(h, ev.data(), k);
+        }
+        disk_roi_free(&roi);
+    }
+    return h;
+}
+
+int main(int argc, char **argv)
+{
+    int n_frames = argc > 1 ? atoi(argv[1]) : 20;
+    std::vector<uint8_t> pixels((size_t)TEST_STRIDE * TEST_HEIGHT);
+    std::vector<uint8_t> tmap((size_t)TEST_STRIDE * TEST_HEIGHT);
+    std::vector<uint16_t> level((size_t)TEST_STRIDE * TEST_HEIGHT);
+    struct frame f;
+    f.data = pixels.data();
+    f.width = TEST_WIDTH;
+    f.height = TEST_HEIGHT;
+    f.stride = TEST_STRIDE;
+    f.seq = 0;
+    f.t_ingest = 0;
+    struct detect_background bg;
+    bg.threshold = tmap.data();
+    bg.level = level.data();
+    bg.stride = TEST_STRIDE;
+
+    struct synth_params sp;
+    synth_defaults(&sp);
+    sp.width = TEST_WIDTH;
+    sp.height = TEST_HEIGHT;
+    sp.stride = TEST_STRIDE;
+    sp.cenx = TEST_WIDTH / 2;
+    sp.ceny = TEST_HEIGHT / 2;
+    sp.radius = TEST_HEIGHT / 2;
+    struct synth s;
+    if (synth_init(&s, &sp) != 0) return 1;
+    std::vector<struct synth_photon> ph(100000);
+
+    uint32_t h = 2166136261u;
+    for (int k = 0; k < n_frames; k++)
+    {
+        //maps of a slowly varying background, with holes and saturated thresholds
+        for (size_t p = 0; p < tmap.size(); p++)
+        {
+            uint32_t r = test_rand();
+            tmap[p] = (uint8_t)((r & 0xff) < 4 ? (r >> 8) & 0xff : 10 + (p / TEST_STRIDE / 16 + p % TEST_STRIDE / 16) % 20);
+            level[p] = (uint16_t)((r >> 16) % (8 << 8));
+        }
+
+        //synthetic photons at a low and a high flux
+        s.p.flux = k % 2 ? 2000 : 50;
+        synth_frame(&s, pixels.data(), ph.data(), (int)ph.size());
+        check_frame(&f, 6 + (int)(test_rand() % 20), &bg, "synthetic", k, 0);
+
+        //uniform noise, maxima everywhere
+        for (size_t p = 0; p < pixels.size(); p++) pixels[p] = (uint8_t)test_rand();
+        h = check_frame(&f, (int)(test_rand() % 256), &bg, "random", k, h);
+
+        //a dark frame with isolated spikes, most tiles empty for the prefilter
+        for (size_t p = 0; p < pixels.size(); p++)
+        {
+            uint32_t r = test_rand();
+            pixels[p] = (uint8_t)((r & 0x3ff) == 0 ? 20 + (r >> 10) % 236 : (r >> 10) % 4);
+        }
+        h = check_frame(&f, 10, &bg, "sparse", k, h);
+    }
+    synth_free(&s);
+
+    printf("kernel %s: %d frames of every kind, %s, centroid checksum %08x\n", DETECT_KERNEL, n_frames,
+           failures == 0 ? "identical to the scalar reference" : "DIFFERENCES", h);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,135 @@
+/*
+ * Worker pool
+ * -----------------------
+ *   Persistent helper threads that run the tasks of one frame in parallel.
+ *   worker_pool_run() publishes a batch of n_tasks tasks, works on it from the
+ *   calling thread as well and returns when every task has completed.
+ *   Tasks are claimed one at a time from an atomic counter, so bands of unequal
+ *   cost balance themselves across the cores.
+ */
+
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <atomic>
+
+typedef void (*pool_task_fn)(void *ctx, int task);
+
+struct worker_pool
+{
+    int n_threads;                  //helper threads, the caller is one more worker
+    pthread_t *threads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake, done;
+    unsigned long generation;       //incremented for every batch
+    int running;                    //helpers still busy with the current batch
+    bool quit;
+
+    pool_task_fn fn;
+    void *ctx;
+    int n_tasks;
+    std::atomic<int> next;          //next unclaimed task
+};
+
+static inline void worker_pool_work(struct worker_pool *pool)
+{
+    int t;
+    while ((t = pool->next.fetch_add(1, std::memory_order_relaxed)) < pool->n_tasks)
+        pool->fn(pool->ctx, t);
+}
+
+/* Thread: pool_worker
+    * -----------------------
+    *   Sleeps until a new batch is published, helps to finish it and reports back.
+*/
+static void* pool_worker(void* pUser)
+{
+    struct worker_pool *pool = (struct worker_pool *)pUser;
+    pthread_mutex_lock(&pool->lock);
+    //batches count from the generation at init, a helper that starts late must not skip the first one
+    unsigned long seen = 0;
+    while (1)
+    {
+        while (pool->generation == seen && !pool->quit)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        if (pool->quit) break;
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        worker_pool_work(pool);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->running == 0) pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+/*
+ * Start n_threads helper threads (0 runs everything on the caller).
+ * Returns 0 on success.
+ */
+static inline int worker_pool_init(struct worker_pool *pool, int n_threads)
+{
+    pool->n_threads = n_threads > 0 ? n_threads : 0;
+    pool->threads = (pthread_t *)malloc(sizeof(pthread_t) * (pool->n_threads + 1));
+    pool->generation = 0;                   //pool_worker starts from generation 0
+    pool->running = 0;
+    pool->quit = false;
+    pool->n_tasks = 0;
+    pool->next.store(0);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for (int t = 0; t < pool->n_threads; t++)
+    {
+        int nRet = pthread_create(&pool->threads[t], NULL, pool_worker, pool);
+        if (nRet != 0)
+        {
+            fprintf(stderr, "worker thread create failed.ret = %d\n", nRet);
+            pool->n_threads = t;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//Run fn(ctx, 0..n_tasks-1) on the pool and the calling thread, return when all are done
+static inline void worker_pool_run(struct worker_pool *pool, pool_task_fn fn, void *ctx, int n_tasks)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->fn = fn;
+    pool->ctx = ctx;
+    pool->n_tasks = n_tasks;
+    pool->next.store(0, std::memory_order_relaxed);
+    pool->running = pool->n_threads;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    worker_pool_work(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running > 0)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static inline void worker_pool_free(struct worker_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (int t = 0; t < pool->n_threads; t++) pthread_join(pool->threads[t], NULL);
+    free(pool->threads);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->done);
+}
+
+#endif